@@ -0,0 +1,217 @@
+// "dnsload" is a load generator for a DNS server (e.g. madnsd): it keeps
+//  a window of queries outstanding, for names read from a file (round
+//  robin), and reports queries/sec, latency percentiles and rcodes.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>             // malloc...
+#include <string.h>
+#include <sys/time.h>           // gettimeofday
+#include <unistd.h>             // getopt
+#include <arpa/inet.h>          // inet_pton
+#include <sys/socket.h>
+
+#define MAXWINDOW   4096        // tid = slot + MAXWINDOW * generation.
+#define NMSGS       64
+
+typedef struct {
+    double  sent;               // 0: free.
+    uint16_t tid;
+} SLOT;
+
+static void
+usage(void)
+{
+    fputs("Usage: dnsload [-s ip[:port]] [-n count] [-w window] [-t qtype]"
+          " [-T timeout_ms] namefile\n"
+          "\t-s: server (default 127.0.0.1:53)\n"
+          "\t-n: queries to send (default 100000)\n"
+          "\t-w: queries outstanding (default 256)\n", stderr);
+    exit(1);
+}
+
+static double
+tick(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, 0);
+    return t.tv_sec + 1E-6 * t.tv_usec;
+}
+
+static int
+cmp_double(void const *a, void const *b)
+{
+    double  x = *(double const *)a, y = *(double const *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Encode a query for (name) with RD set. Returns its length, or 0.
+static int
+encode_query(uint8_t * pkt, unsigned tid, char const *name, int qtype)
+{
+    uint8_t *p = pkt + 12;
+
+    memset(pkt, 0, 12);
+    pkt[0] = tid >> 8, pkt[1] = tid, pkt[2] = 1, pkt[5] = 1;
+    while (*name) {
+        int     len = strcspn(name, ".");
+
+        if (len < 1 || len > 63 || p + len + 6 > pkt + 300)
+            return 0;
+        *p++ = len, memcpy(p, name, len), p += len, name += len;
+        name += *name == '.';
+    }
+    *p++ = 0;
+    *p++ = qtype >> 8, *p++ = qtype, *p++ = 0, *p++ = 1;
+    return p - pkt;
+}
+
+int
+main(int argc, char **argv)
+{
+    char    server[64] = "127.0.0.1";
+    int     opt, port = 53, count = 100000, window = 256, qtype = 1;
+    int     timeout_ms = 2000;
+
+    while ((opt = getopt(argc, argv, "n:s:t:T:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            if (strchr(optarg, ':'))
+                sscanf(optarg, "%63[^:]:%d", server, &port);
+            else
+                snprintf(server, sizeof server, "%s", optarg);
+            break;
+        case 't':
+            qtype = atoi(optarg);
+            break;
+        case 'T':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            usage();            // '?' etc.
+        }
+    }
+    if (optind != argc - 1 || count < 1 || window < 1 || window > MAXWINDOW
+        || qtype < 1 || qtype > 65535)
+        usage();
+
+    FILE   *fp = fopen(argv[optind], "r");
+    char    line[300], **names = NULL;
+    int     nnames = 0, maxnames = 0;
+
+    if (!fp)
+        return fprintf(stderr, "dnsload: unable to read '%s'\n", argv[optind]);
+    while (fgets(line, sizeof line, fp)) {
+        line[strcspn(line, "\t\r\n #")] = 0;
+        if (!*line)
+            continue;
+        if (nnames == maxnames)
+            names = realloc(names, (maxnames = 2 * maxnames + 64) * sizeof *names);
+        names[nnames++] = strdup(line);
+    }
+    fclose(fp);
+    if (!nnames)
+        return fputs("dnsload: no names\n", stderr);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,.sin_port = htons(port) };
+    int     sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+    if (inet_pton(AF_INET, server, &addr.sin_addr) != 1)
+        usage();
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof addr))
+        return fprintf(stderr, "dnsload: %s:%d: %s\n", server, port,
+                       strerror(errno));
+
+    SLOT   *slots = calloc(window, sizeof *slots);
+    int    *freev = malloc(window * sizeof *freev);
+    double *lat = malloc(count * sizeof *lat);
+    int     nfree = window, sent = 0, answered = 0, lost = 0, bad = 0;
+    int     i, n, rcodes[16] = { 0 };
+    unsigned gen = 0;
+    uint8_t pkt[4096];
+    static uint8_t rpkts[NMSGS][512];
+    struct mmsghdr msgs[NMSGS];
+    struct iovec iovs[NMSGS];
+    double  t0 = tick(), now = t0, lastscan = t0;
+
+    for (i = 0; i < window; ++i)
+        freev[i] = window - 1 - i;
+    for (i = 0; i < NMSGS; ++i) {
+        iovs[i] = (struct iovec) {rpkts[i], sizeof rpkts[i]};
+        msgs[i].msg_hdr = (struct msghdr) {.msg_iov = &iovs[i],.msg_iovlen = 1};
+    }
+
+    while (sent < count || nfree < window) {
+        // Fill the window.
+        for (now = tick(); sent < count && nfree; ++sent) {
+            int     s = freev[--nfree];
+            unsigned tid = s + MAXWINDOW * (gen++ % (65536 / MAXWINDOW));
+            int     len = encode_query(pkt, tid, names[sent % nnames], qtype);
+
+            if (!len || send(sock, pkt, len, 0) != len) {
+                ++bad, freev[nfree++] = s;
+                continue;
+            }
+            slots[s] = (SLOT) {now, tid};
+        }
+
+        struct pollfd pfd = { sock, POLLIN, 0 };
+
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+            break;
+        now = tick();
+
+        while ((n = recvmmsg(sock, msgs, NMSGS, 0, NULL)) > 0) {
+            for (i = 0; i < n; ++i) {
+                uint8_t const *rp = rpkts[i];
+                unsigned tid = rp[0] << 8 | rp[1];
+                int     s = tid % MAXWINDOW;
+
+                if (msgs[i].msg_len < 12 || !(rp[2] & 0x80) || s >= window
+                    || !slots[s].sent || slots[s].tid != tid)
+                    continue;   // Late, after its timeout.
+                lat[answered++] = now - slots[s].sent;
+                ++rcodes[rp[3] & 15];
+                slots[s].sent = 0, freev[nfree++] = s;
+            }
+            if (n < NMSGS)
+                break;
+        }
+
+        // Give up on queries outstanding too long.
+        if (now - lastscan > 0.1) {
+            for (i = 0; i < window; ++i)
+                if (slots[i].sent && now - slots[i].sent > timeout_ms / 1000.0)
+                    ++lost, slots[i].sent = 0, freev[nfree++] = i;
+            lastscan = now;
+        }
+    }
+
+    double  secs = tick() - t0;
+
+    qsort(lat, answered, sizeof *lat, cmp_double);
+#   define  PCT(p)  (answered ? 1E6 * lat[(int)((answered - 1) * (p))] : 0)
+    printf("DNSLOAD: sent: %d answered: %d lost: %d unsent: %d secs: %.3f"
+           " => %.0f q/s\n", sent - bad, answered, lost, bad, secs,
+           answered / secs);
+    printf("latency usec: p50 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+           PCT(0.5), PCT(0.99), PCT(0.999), PCT(1));
+    printf("rcodes: NOERROR %d SERVFAIL %d NXDOMAIN %d other %d\n",
+           rcodes[0], rcodes[2], rcodes[3],
+           answered - rcodes[0] - rcodes[2] - rcodes[3]);
+
+    for (i = 0; i < nnames; ++i)
+        free(names[i]);
+    free(names), free(slots), free(freev), free(lat), close(sock);
+    return 0;
+}
@@ -2,6 +2,7 @@
 //  writing DNS responses to stdout.
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>             // malloc...
 #include <string.h>
@@ -20,18 +21,100 @@ iptoa(in_addr_t ip)
 static inline void
 usage(void)
 {
-    fputs("Usage: hostip [-c resolv.conf] [-d] (hostfile | -)\n", stderr);
+    fputs("Usage: hostip [-c resolv.conf] [-a] [-6] [-t type] [-T] [-u] [-d]"
+          " (hostfile | -)\n"
+          "\t-a: print all addresses, comma-separated\n"
+          "\t-6: query A and AAAA records (implies -a)\n"
+          "\t-t: query mx, ns, ptr, srv, txt or (number) records\n"
+          "\t-T: send every query over TCP\n"
+          "\t-u: send and receive through io_uring\n", stderr);
     exit(1);
 }
 
+static void
+print_answer(char const *input, MADNS_ANSWER const *ap)
+{
+    int     i;
+    char    buf[INET6_ADDRSTRLEN];
+
+    printf("%s\t%s", input, ap->naddrs || !ap->naddrs6
+           ? iptoa(ap->naddrs ? ap->addrs[0] : INADDR_ANY)
+           : inet_ntop(AF_INET6, &ap->addrs6[0], buf, sizeof buf));
+    for (i = 1; i < ap->naddrs; ++i)
+        printf(",%s", iptoa(ap->addrs[i]));
+    for (i = !ap->naddrs; i < ap->naddrs6; ++i)
+        printf(",%s", inet_ntop(AF_INET6, &ap->addrs6[i], buf, sizeof buf));
+    putchar('\n');
+}
+
+static void
+print_records(char const *input, MADNS_ANSWER const *ap)
+{
+    int     i;
+
+    printf("%s\t", input);
+    if (!ap->nrecs)
+        printf("%s", iptoa(ap->naddrs ? ap->addrs[0] : INADDR_ANY));
+    for (i = 0; i < ap->nrecs; ++i) {
+        MADNS_RECORD const *rp = &ap->recs[i];
+        unsigned j;
+
+        printf(i ? "," : "");
+        if (rp->type == MADNS_T_MX)
+            printf("%u %s", rp->mx.pref, rp->mx.host);
+        else if (rp->type == MADNS_T_SRV)
+            printf("%u %u %u %s", rp->srv.prio, rp->srv.weight,
+                   rp->srv.port, rp->srv.host);
+        else if (rp->type == MADNS_T_PTR || rp->type == MADNS_T_NS
+                 || rp->type == MADNS_T_CNAME)
+            printf("%s", rp->host);
+        else if (rp->type == MADNS_T_SOA)
+            printf("%s %s %u %u %u %u %u", rp->soa.mname, rp->soa.rname,
+                   rp->soa.serial, rp->soa.refresh, rp->soa.retry,
+                   rp->soa.expire, rp->soa.minimum);
+        else if (rp->type == MADNS_T_TXT)
+            for (j = 0; j < rp->raw.len; j += rp->raw.data[j] + 1)
+                printf("%s\"%.*s\"", j ? " " : "",
+                       (int)(rp->raw.len - j - 1 < rp->raw.data[j]
+                             ? rp->raw.len - j - 1 : rp->raw.data[j]),
+                       rp->raw.data + j + 1);
+        else
+            for (j = 0; j < rp->raw.len; ++j)
+                printf("%02x", rp->raw.data[j]);
+    }
+    putchar('\n');
+}
+
+static int
+qtype_of(char const *name)
+{
+    static struct { char const *name; int qtype; } const types[] = {
+        {"mx", MADNS_T_MX}, {"ns", MADNS_T_NS}, {"ptr", MADNS_T_PTR},
+        {"srv", MADNS_T_SRV}, {"txt", MADNS_T_TXT}, {"cname", MADNS_T_CNAME},
+        {"soa", MADNS_T_SOA},
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof types / sizeof *types; ++i)
+        if (!strcasecmp(name, types[i].name))
+            return types[i].qtype;
+    return atoi(name);
+}
+
 int
 main(int argc, char **argv)
 {
     char const *resolv_conf = "/etc/resolv.conf";
-    int     opt;
+    int     opt, all = 0, af = AF_INET, qtype = 0, tcp = 0, uring = 0;
 
-    while ((opt = getopt(argc, argv, "c:d")) != -1) {
+    while ((opt = getopt(argc, argv, "6ac:dt:Tu")) != -1) {
         switch (opt) {
+        case '6':
+            af = AF_UNSPEC;
+            // FALLTHROUGH
+        case 'a':
+            all = 1;
+            break;
         case 'c':
             resolv_conf = optarg;
             break;
@@ -39,6 +122,16 @@ main(int argc, char **argv)
             madns_log = stderr;
             setvbuf(stdout, 0, _IOLBF, 0);
             break;
+        case 't':
+            if ((qtype = qtype_of(optarg)) <= 0)
+                usage();
+            break;
+        case 'T':
+            tcp = 1;
+            break;
+        case 'u':
+            uring = 1;
+            break;
         default:
             usage();            // '?' etc.
         }
@@ -53,42 +146,58 @@ main(int argc, char **argv)
     MADNS  *mp = madns_create(resolv_conf, /*expiry */ 5, /*server_reqs */ 15);
     if (!mp)
         return fputs("hostip: madns_create failed\n", stderr);
+    madns_set(mp, MADNS_TCP, tcp);
+    if (uring && madns_set(mp, MADNS_URING, 1) < 0)
+        fputs("hostip: io_uring unavailable; using sendto/recvfrom\n", stderr);
 
     FILE   *fp = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
 
     if (!fp)
         return fprintf(stderr, "hostip: unable to read '%s'\n", argv[optind]);
 
-    int     nactive = 0, eoi = 0, nreqs = 0;
-    int     inpfd = fileno(fp), dnsfd = madns_fileno(mp);
-    int     nfds = (inpfd > dnsfd ? inpfd : dnsfd) + 1;
-    fd_set  inp_fds;
-
-    FD_ZERO(&inp_fds);
-    FD_SET(inpfd, &inp_fds);
-    FD_SET(dnsfd, &inp_fds);
+    int     nactive = 0, eoi = 0, nreqs = 0, held = 0;
+    int     inpfd = fileno(fp);
+    struct pollfd fds[1 + 64];  // Input, then madns_pollfds.
+#   define  NDONE   16
+    MADNS_COMPLETION done[NDONE];
+    int     i, ndone;
     time_t  t = time(0);
+    char    buf[2000];              // The line read, or held for a slot.
 
     while (!eoi || nactive > 0) {
-        char   *info, buf[2000];
+        char   *info;
         in_addr_t ipaddr;
-        fd_set  read_fds = inp_fds;
-        struct timeval tv = { madns_expires(mp), 0 };
-        if (0 > select(nfds, &read_fds, NULL, NULL, &tv)) {
-            fprintf(stderr, "expires=%lu\n", tv.tv_sec);
-            perror("select");
+        MADNS_ANSWER ans;
+        int     nfds = 1 + madns_pollfds(mp, fds + 1, 64);
+        int     expires = madns_expires(mp);
+
+        fds[0] = (struct pollfd) {eoi || held ? -1 : inpfd, POLLIN, 0};
+        if (0 > poll(fds, nfds, 1000 * expires)) {
+            fprintf(stderr, "expires=%d\n", expires);
+            perror("poll");
             break;
         }
         // Check dns responses/expiries first; may increase madns_ready.
-        for (; (info = madns_response(mp, &ipaddr)); --nactive)
-            printf("%s\t%s\n", info, iptoa(ipaddr)), free(info);
-
-        if (FD_ISSET(inpfd, &read_fds) && madns_ready(mp)) {
-            if ((eoi = !fgets(buf, sizeof buf, fp))) {
-                FD_CLR(inpfd, &inp_fds);
+        if (qtype || all)
+            while ((ndone = madns_responses(mp, done, NDONE)) > 0)
+                for (i = 0; i < ndone; ++i, --nactive) {
+                    if (qtype)
+                        print_records(done[i].ctx, &done[i].ans);
+                    else
+                        print_answer(done[i].ctx, &done[i].ans);
+                    free(done[i].ctx);
+                }
+        else
+            for (; (info = madns_response(mp, &ipaddr)); --nactive)
+                printf("%s\t%s\n", info, iptoa(ipaddr)), free(info);
+
+        if ((held || fds[0].revents) && madns_ready(mp) > (af == AF_UNSPEC)) {
+            if (!held && (eoi = !fgets(buf, sizeof buf, fp))) {
+                continue;       // Poll no more input.
             } else {
-                buf[strlen(buf) - 1] = 0;   // chomp
-                ++nreqs;
+                if (!held)
+                    buf[strlen(buf) - 1] = 0, ++nreqs;  // chomp
+                held = 0;
 
                 // Extract the hostname:
                 char    host[999];
@@ -98,11 +207,37 @@ main(int argc, char **argv)
                 host[hostlen] = 0;
 
                 // Check cache first; queue request if no cache entry:
-                ipaddr = madns_lookup(mp, host);
-                if (ipaddr == INADDR_ANY)
-                    ++nactive, madns_request(mp, host, strdup(buf));
+                in_addr_t ptr = qtype == MADNS_T_PTR ? inet_addr(host)
+                    : INADDR_NONE;
+
+                char   *ctx = NULL;
+                int     tid = 1;
+
+                if (qtype) {
+                    if (ptr != INADDR_NONE ? madns_lookup_ptr(mp, ptr, &ans)
+                        : madns_lookup_rr(mp, host, qtype, &ans))
+                        print_records(buf, &ans);
+                    else if (ptr != INADDR_NONE)
+                        tid = madns_request_ptr(mp, ptr, ctx = strdup(buf));
+                    else
+                        tid = madns_request_rr(mp, host, qtype,
+                                               ctx = strdup(buf));
+                } else if (all ? !madns_lookup_all(mp, host, &ans)
+                    : (ipaddr = madns_lookup(mp, host)) == INADDR_ANY)
+                    tid = madns_request_af(mp, host, ctx = strdup(buf), af);
+                else if (all)
+                    print_answer(buf, &ans);
                 else
                     printf("%s\t%s\n", buf, iptoa(ipaddr));
+
+                if (!tid && errno == EAGAIN)
+                    held = 1;   // A search: wait for more free slots.
+                else if (!tid)
+                    printf("%s\t%s\n", buf, iptoa(INADDR_NONE));
+                else if (ctx)
+                    ++nactive;
+                if (!tid)
+                    free(ctx);
             }
         }
     }
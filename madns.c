@@ -6,7 +6,7 @@
 //
 // Mischa Sandberg <mischasan@gmail.com> in 2012 extended Sergey's "madns"
 //  for Sophos LLC, which cheerfully releases this into the Open Source world.
-//  "send_request" and "parse_response" are Sergey's with little change.
+//  "send_request" is Sergey's with little change.
 //
 // MADNS:
 //  - uses multiple servers, taken from resolv.conf, based on latency.
@@ -14,24 +14,71 @@
 //  - keeps an (in-memory) cache
 
 #include <ctype.h>              // tolower...
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>             // offsetof
 #include <stdio.h>
 #include <stdlib.h>             // malloc...
 #include <string.h>
+#include <limits.h>             // PATH_MAX
 #include <time.h>               // time...
 #include <unistd.h>
 #include <sys/time.h>           // gettimeofday
 #include <arpa/inet.h>          // inet_ntoa inet_ntop
 #include <arpa/nameser.h>       // NS_MAXLABEL QUERY ...
+#include <netinet/tcp.h>        // TCP_NODELAY
 #undef QUERY
+#if defined(__SSE2__) && defined(__x86_64__)
+#   include <emmintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include) && !defined(MADNS_NO_URING)
+#   if __has_include(<linux/io_uring.h>)
+#       include <sys/eventfd.h>
+#       include <sys/mman.h>
+#       include <sys/syscall.h>
+#       include <linux/io_uring.h>
+#       ifdef IORING_RECV_MULTISHOT     // Linux 6.0 headers.
+#           define URING
+#       endif
+#   endif
+#endif
+#ifdef __linux__
+#   include <sys/epoll.h>
+#   include <sys/eventfd.h>
+#   include <sys/inotify.h>
+#   include <sys/timerfd.h>
+#endif
+#if defined(__has_include) && !defined(MADNS_NO_SDT)
+#   if __has_include(<sys/sdt.h>)
+#       include <sys/sdt.h>     // USDT probes; see TRACE.
+#       define SDT
+#   endif
+#endif
 #include "madns.h"
 
 #define DNS_A_RECORD         1  // aka ns_t_a
+#define DNS_NS_RECORD        2  // aka ns_t_ns
 #define DNS_CNAME            5  // aka ns_t_cname
+#define DNS_SOA              6  // aka ns_t_soa
+#define DNS_R_FORMERR        1  // aka ns_r_formerr
 #define DNS_R_NXDOMAIN       3  // aka ns_r_nxdomain
+#define DNS_PTR             12  // aka ns_t_ptr
+#define DNS_MX              15  // aka ns_t_mx
+#define DNS_AAAA            28  // aka ns_t_aaaa
+#define DNS_SRV             33  // aka ns_t_srv
+#define DNS_OPT             41  // aka ns_t_opt
+#define DNS_C_IN             1  // aka ns_c_in
 #define DNS_MAX_HOSTNAME   255  // Max host name, per RFP
-#define DNS_PACKET_LEN    2048  // Buffer size for DNS packet
+#define DNS_NAME_BUF       256  // Normalized name buffer: 16-byte blocks.
+#define DNS_MAX_CHAIN        8  // Max CNAME links followed in a response.
+#define DNS_PACKET_LEN    4096  // Buffer size for a UDP packet; max EDNS size.
+#define DNS_TCP_LEN      65535  // Max DNS message over TCP.
+#define DNS_OPT_LEN         11  // EDNS0 OPT record, with no options.
+#define DNS_QUERY_LEN   (12 + DNS_MAX_HOSTNAME + 2 + 4 + DNS_OPT_LEN)
+                                // header+qname+qtype+qclass+OPT
+#define TCP_PIPELINE        32  // Queries on a connection before opening another.
+#define MAX_SEARCH           6  // resolv.conf "search" domains; as glibc.
 
 #define MAX_TIDS         32767
 
@@ -51,60 +98,325 @@ static inline void qpush(QLINK * q, QLINK * qel);
 static inline QLINK * qpull(QLINK * q);
 static int qleng(QLINK const *list);
 //--------------|---------------------------------------------
-typedef uint32_t HASH;
+typedef uint64_t HASH;
 typedef struct sockaddr SADDR;
 typedef struct sockaddr_in INADDR;
 
+// Log-linear histogram of latencies in usecs: HIST_SUB buckets per power
+//  of 2 (as HdrHistogram, to 3 bits), from 1 usec to 2^27 (134 secs).
+#define HIST_SUB             8
+#define HIST_BUCKETS  (25 * HIST_SUB)
+
+typedef struct {
+    uint64_t n;
+    double  sum;                // secs
+    uint32_t b[HIST_BUCKETS];
+} HIST;
+
+typedef struct {
+    uint64_t sends, answers;
+    HIST    rtt;                // From (last) send to answer.
+} SERVSTATS;
+
+// Trace events (MADNS_TRACE), written by madns and read by one other
+//  thread: head and tail run free, each written by one side only, and
+//  sit on cache lines of their own.
+typedef struct {
+    unsigned mask;              // ev[mask + 1]
+    unsigned head __attribute__ ((aligned(64)));    // Next to write.
+    unsigned tail __attribute__ ((aligned(64)));    // Next to read.
+    MADNS_EVENT ev[] __attribute__ ((aligned(64)));
+} TRACE_RING;
+
 typedef struct {
     in_addr_t ip;
     int     nreqs;
     double  latency;            // Decaying-average response time.
+    SERVSTATS *stats;           // Kept across madns_reload.
 } SERVER;
 
-// Active request.
+// The servers for names in a zone ("server=/zone/ip" in resolv.conf), or
+//  (route 0) for every other name ("nameserver ip").
 typedef struct {
+    HASH    hash;               // See route_hash().
+    int     len;                // strlen(zone); 0 for route 0.
+    int     nservs;
+    int    *servs;              // Indexes into MADNS.serv[].
+    char    zone[DNS_NAME_BUF]; // Normalized.
+} ROUTE;
+
+// A TCP connection to a server, for answers truncated over UDP.
+//  Queries are written back to back, each prefixed by its length
+//  (RFC 7766), and answers are matched by tid in whatever order they come.
+typedef struct {
+    int     fd;                 // -1: closed.
+    int     nreqs;              // Queries sent and unanswered.
+    int     answered;           // Answers since connected.
+    SERVER *server;
+    int     olen, osize;        // obuf[0..olen) is not yet written.
+    char   *obuf;
+    int     ioff, ilen;         // ibuf[ioff..ilen) is not yet parsed.
+    uint8_t *ibuf;              // 2 + DNS_TCP_LEN bytes, kept once allocated.
+} TCPCONN;
+
+// Active request.
+typedef struct query {
     QLINK   link;               // See link_QUERY()
     void   *ctx;                // Application context
     time_t  expires;            // Time when this query expires.
     uint16_t tid;               // DNS transaction ID
-    char   *name;
+    uint16_t pktlen;            // 0 if name is unencodable.
+    uint16_t qtype;             // DNS_A_RECORD, DNS_AAAA, or any other.
+    uint8_t len;                // strlen(name)
+    uint8_t dual;               // Half of an A+AAAA (AF_UNSPEC) request.
+    uint8_t tcp;                // Sent over TCP; the answer comes on (conn).
+    uint16_t route;             // Index into MADNS.routes[].
+    uint8_t tries;              // Sends left, after this one.
+    uint8_t nth;                // Its candidate in (search).
+    TCPCONN *conn;              // NULL if the connection closed.
+    struct query *resend;       // Next in tcp_close's list.
+    struct query *twin;         // The other half, while it is pending.
+    struct {                    // The other half's addresses, once it
+        int     n;              //  completes; for the TTL-0 answers
+        uint32_t ttl;           //  that the cache does not keep.
+        union {
+            in_addr_t addrs[MADNS_MAX_ADDRS];
+            struct in6_addr addrs6[MADNS_MAX_ADDRS];
+        };
+    } half;
+    struct search *search;      // Request with search candidates; else NULL.
+    HASH    hash;               // of name, for cache_response.
     SERVER *server;             // entry in MADNS.serv[]
     double  started;
+    double  sent;               // By send_request, last.
+    struct query *ctxnext;      // next QUERY in same MADNS.ctxv[] chain
+    QLINK   slink;              // in MADNS.stalewait, if stale_at != 0.
+    double  stale_at;           // When to fall back on a stale entry.
+    char    name[DNS_NAME_BUF]; // Normalized; see normalize()
+    char    pkt[DNS_QUERY_LEN]; // Request packet, encoded once, sent as-is.
 } QUERY;
 
+// Zero-copy view of one resource record, pointing into the packet.
+enum { DNS_QD, DNS_AN, DNS_NS, DNS_AR };    // Message sections.
+typedef struct {
+    uint8_t const *name;        // Owner name; may contain compression ptrs.
+    uint8_t const *rdata;
+    uint16_t type, class, rdlen;
+    uint32_t ttl;
+    int     section;            // DNS_AN, DNS_NS or DNS_AR
+} DNS_RR;
+
+// Parser state for one received message. See dns_open(), dns_next().
+typedef struct {
+    uint8_t const *pkt, *end;
+    uint8_t const *rrs;         // First answer record.
+    uint8_t const *next;        // Next record for dns_next().
+    uint8_t const *qname;       // Question name; never compressed.
+    uint16_t tid;               // As sent; not byte-swapped.
+    uint16_t flags, qlen, qtype, qclass;
+    uint16_t count[4];          // Records per section.
+    int     section, left;      // Section of (next), records left in it.
+} DNS_MSG;
+
 // Info passed from parse_response to update_cache.
+//  NXDOMAIN or NODATA (for any qtype) is naddrs=1, addrs[0]=INADDR_NONE.
 typedef struct {
-    in_addr_t ip;
-    time_t  ttl;
+    int     qtype;              // DNS_A_RECORD: addrs[]; DNS_AAAA: addrs6[];
+                                //  any other: rrs[], views into the packet.
+    int     naddrs, naddrs6, nrrs;
+    in_addr_t addrs[MADNS_MAX_ADDRS];
+    struct in6_addr addrs6[MADNS_MAX_ADDRS];
+    DNS_RR  rrs[MADNS_MAX_ADDRS];
+    time_t  ttl;                // Least TTL of the records used.
     uint16_t tid;
-    char const *name;
+    int     rcode;
+    // CNAME chain: chain[0] is the query name, chain[nchain] owns addrs[].
+    //  chain[i].ttl is the TTL of its CNAME record, or of the A records.
+    int     nchain;
+    struct { uint8_t const *name; time_t ttl; } chain[DNS_MAX_CHAIN + 1];
+    DNS_RR  soa;                // Of a negative answer; soa.name NULL if none.
+    DNS_MSG msg;
 } RESPONSE;
 
-// Cached name->ip map.
+// Cached name->ip map: one allocation holding the A and AAAA RRsets.
+//  Each family has its own expiry; 0 means that family is not cached.
+// Other qtypes have their own entries (qtype != 0), holding MADNS_RECORD
+//  views of the RRset, decoded once, that point into the entry itself.
 typedef struct {
-    HASH    hash;
-    time_t  expires;
-    in_addr_t ip;               // MSB-first
-    char    name[1];
+    HASH    hash;               // See rrhash().
+    time_t  expires;            // A RRset (or NXDOMAIN).
+    time_t  expires6;           // AAAA RRset.
+    uint8_t len;                // strlen(name)
+    uint8_t naddrs;             // 0..MADNS_MAX_ADDRS
+    uint8_t naddrs6;            // 0..MADNS_MAX_ADDRS
+    uint8_t rotor;              // Next addrs[] to return, if mp->rotate.
+    uint8_t flags;              // CACHE_NXDOMAIN ...
+    uint8_t nrecs;              // 0..MADNS_MAX_ADDRS, if qtype.
+    uint16_t qtype;             // 0: A/AAAA entry.
+    uint16_t hits;              // Lookups since cached (saturating).
+    uint8_t refresh;            // A refresh-ahead query has been queued.
+    uint32_t ttl, ttl6;         // As cached: expires - ttl = time cached.
+    in_addr_t addrs[1];         // MSB-first. Followed by addrs6[], the name,
+                                //  and (aligned) MADNS_RECORD recs[nrecs].
 } CACHE_INFO;
 
+// The name does not exist, nor does anything under it (RFC 8020).
+//  Entries with no address but no such flag are NODATA, or aliases
+//  of an NXDOMAIN name.
+#define CACHE_NXDOMAIN  1
+// From madns_preload with ttl 0: never expires, never replaced by answers.
+#define CACHE_PINNED    4
+// Inside an ARENA, not malloc'd; see arena_release().
+#define CACHE_ARENA     8
+#define PINNED_EXPIRES  ((time_t)1 << 40)   // Small enough to do sums with.
+
+// One allocation holding every entry of a madns_preload. It is freed
+//  once the last of them leaves the cache.
+typedef struct arena {
+    struct arena *next;
+    size_t  size;               // Bytes at mem.
+    int     live;               // Entries still in the cache.
+    uint64_t mem[];             // CACHE_INFOs, each 8-byte aligned.
+} ARENA;
+
+// A name to try for a request; see search_cand().
+typedef struct {
+    HASH    hash;
+    int     len;
+    char    name[DNS_NAME_BUF]; // Normalized.
+} CAND;
+
+// A request that the search list applies to: one query (or A+AAAA pair)
+//  per candidate name, the first with records answering it. A candidate
+//  answered before its turn keeps its answer here, not in the cache,
+//  which may not keep it (TTL 0) or may replace it meanwhile.
+// SEARCHes come from a pool beside the query slots, like them.
+typedef struct search {
+    struct search *next;        // In mp->freesearch.
+    void   *ctx;
+    int     qtype, dual;
+    int     n, sent;            // Candidates; those sent so far.
+    int     asis;               // The name as given: cand[0] or cand[n-1].
+    int     rcode;              // Of the name as given, which had no records
+                                //  (ans[asis] answers if no candidate has
+                                //  any); -1 if it could not be sent.
+    double  started;
+    QUERY  *q[MAX_SEARCH + 1];  // Pending; NULL once answered.
+    int8_t  state[MAX_SEARCH + 1];      // 0: pending; 1: records; -1: none.
+    CACHE_INFO *own[MAX_SEARCH + 1];    // The records of ans[], if any.
+    // Not cleared for reuse: set before they are read.
+    MADNS_ANSWER ans[MAX_SEARCH + 1];   // Of those answered.
+    CAND    cand[MAX_SEARCH + 1];
+} SEARCH;
+
+// Names of hot cache entries due for refresh. Lookups queue them here,
+//  and madns_response sends. Lookups may run in several threads at once
+//  (see madns.h), so each claims its slot with a CAS on (tail); (head)
+//  moves only in madns_response, which no lookup runs alongside.
+#define REFRESH_QLEN    64
+typedef struct {
+    unsigned head, tail;        // tail - head = queued names.
+    struct {
+        HASH    hash;
+        int     af, qtype;
+        char    name[DNS_NAME_BUF];
+    } q[REFRESH_QLEN];
+} REFRESHQ;
+
+static inline struct in6_addr *
+cache_addrs6(CACHE_INFO const *cip)
+{
+    return (struct in6_addr *)(uintptr_t) (cip->addrs + cip->naddrs);
+}
+
+// The normalized name, compared with memcmp.
+static inline char *
+cache_name(CACHE_INFO const *cip)
+{
+    return (char *)(cache_addrs6(cip) + cip->naddrs6);
+}
+
+static inline MADNS_RECORD *
+cache_recs(CACHE_INFO const *cip)
+{
+    return (MADNS_RECORD *) (((uintptr_t) cache_name(cip) + cip->len + 8) & -8);
+}
+
+// Entries for other qtypes hash apart from the name's A/AAAA entry.
+//  rrhash(rrhash(h, t), t) == h.
+static inline HASH
+rrhash(HASH hash, int qtype)
+{
+    return hash ^ qtype * 0x9E3779B97F4A7C15ULL;
+}
+
+// An entry can be reused once neither family is live (or stale).
+static inline time_t
+cache_expires(CACHE_INFO const *cip)
+{
+    return cip->expires > cip->expires6 ? cip->expires : cip->expires6;
+}
+
 struct madns {
     int     query_time;         // secs till a query is expired.
     int     server_reqs;        // max reqs per server.
+    int     rotate;             // MADNS_ROTATE
+    int     refresh_pct;        // MADNS_REFRESH
+    int     refresh_hits;       // MADNS_REFRESH_HITS
+    REFRESHQ *refreshq;         // Also the ctx of refresh queries.
+    struct {                    // For madns_stats; counted in "const"
+        MADNS_STATS c;          //  lookups too, hence a pointer.
+        HIST    latency;        // Of completed requests.
+    }      *stats;
+    TRACE_RING *trace;          // MADNS_TRACE; else NULL.
+    int     stale;              // MADNS_SERVE_STALE
+    int     stale_wait;         // MADNS_STALE_WAIT
+    int     edns;               // MADNS_EDNS
+    int     tcp_conns;          // MADNS_TCP_CONNS
+    int     tcp_only;           // MADNS_TCP
     int     sock;               // UDP socket used for responses.
     int     nservs;
     SERVER *serv;
+    char   *conf;               // resolv.conf path, for madns_reload.
+    int     watch;              // MADNS_WATCH inotify fd; else -1.
+    int     nsearch;            // resolv.conf "search" (or "domain").
+    char    search[MAX_SEARCH][DNS_NAME_BUF];
+    int     ndots;              // "options ndots:n", and so on:
+    int     timeout;            //  secs per send; 0: not set.
+    int     attempts;           //  sends per query.
+    int     rotate_servers;     //  round robin, not by latency.
+    unsigned turn;              // Next server in turn, if rotate_servers.
+    int     nroutes;            // routes[0] is the default.
+    ROUTE  *routes;
+    int     routemask;          // routev[routemask + 1]: index of routes[1..]
+    uint16_t *routev;           //  by route_hash; 0 is empty.
+    TCPCONN *tcp;               // tcp[nservs * MADNS_TCP_MAXCONNS]
+    struct uring *uring;        // MADNS_URING; else NULL.
 
     // cache is an open-addr hash table with no "delete(key)".
 #   define  MIN_CACHE   16      // Must be a power of 2.
     int     limit, count;       // size and used.
+    int     nxdomains;          // Entries with CACHE_NXDOMAIN.
     CACHE_INFO **cachev;
+    ARENA  *arenas;             // madns_preload entries.
 
     int     qsize;              // nservs * server_reqs
     int     nfree;              // entries in (unused)
+    CACHE_INFO **retired;       // Entries with records that may be in use;
+    int     nretired, maxretired;   //  freed at the next madns_response.
+    struct {                    // The last completion, for madns_responses.
+        int     rcode;
+        double  latency;
+        in_addr_t server;
+    } done;
     QUERY  *queries;            // queries[qsize]
+    SEARCH *searches;           // searches[qsize / (MAX_SEARCH + 1)];
+    SEARCH *freesearch;         //  those not in use.
+    QUERY **ctxv;               // ctx->query index: chained, ctxmask+1 heads
+    int     ctxmask;
     QLINK   active;
     QLINK   unused;
+    QLINK   stalewait;          // Queries with a stale fallback, by stale_at.
 };
 
 // DNS response header (all ints in network order)
@@ -118,27 +430,155 @@ typedef struct {
     char    data[1];            // Data, variable length
 } DNS_RESP;
 
+static QUERY *start_query(MADNS *, char const *name, void *ctx, int qtype);
+static int request(MADNS *, char const *name, void *ctx, int qtype, int dual);
+static QUERY *request_one(MADNS *, char const *name, void *ctx, int qtype,
+                          int dual);
+static int search_order(MADNS const *, char const *name);
+static int search_cand(MADNS const *, int order, char const *key, int len,
+                       HASH, int i, CAND *);
+static void search_send(MADNS *, SEARCH *, int end);
+static void *search_done(MADNS *, QUERY *, RESPONSE const *, MADNS_ANSWER *);
+static SEARCH *search_take(MADNS *);
+static void search_free(MADNS *, SEARCH *);
+static int retry_query(MADNS *, QUERY *);
+static void hist_add(HIST *, double secs);
+static double hist_pct(HIST const *, double q);
+static uint64_t hist_below(HIST const *, uint64_t usecs);
+static void prom_hist(FILE *, char const *name, char const *label,
+                      HIST const *);
+static void *next_response(MADNS *, MADNS_ANSWER *);
+static void *complete_query(MADNS *, QUERY *, RESPONSE const *,
+                            CACHE_INFO *, MADNS_ANSWER *);
+static int cancel_query(MADNS *, QUERY *);
 static void *destroy_query(MADNS *, QUERY *, in_addr_t);
-static int parse_response(char *pkt, int len, RESPONSE *);
+static void *receive(MADNS *, char const *pkt, int len, in_addr_t from,
+                     TCPCONN *, MADNS_ANSWER *);
+static int parse_response(char const *pkt, int len, RESPONSE *);
+static int encode_request(QUERY * qp, int edns);
 static void send_request(MADNS * mp, QUERY * qp);
+static void transmit(MADNS *, QUERY *, int tcp);
+static void udp_send(MADNS *, QUERY *);
+
+//---- io_uring
+static int uring_create(MADNS *);
+static int uring_fileno(struct uring const *);
+static void uring_destroy(MADNS *);
+static int uring_send(MADNS *, QUERY *, INADDR const *);
+static void uring_submit(MADNS *);
+static void *uring_receive(MADNS *, MADNS_ANSWER *);
+
+//---- Routes
+static void add_route(MADNS *, char const *zone, in_addr_t);
+static void parse_server(MADNS *, char *spec);
+static int route_index(MADNS *);
+static int route_of(MADNS const *, char const *name, int len);
+static int load_conf(MADNS *, char const *path);
+static void free_servers(SERVER *, int nservs);
+static void parse_search(MADNS *, char *spec);
+static void parse_options(MADNS *, char *spec);
+static int watch_conf(MADNS *, int on);
+static void watch_check(MADNS *);
+
+//---- TCP
+static void tcp_send(MADNS *, QUERY *);
+static void tcp_flush(MADNS *, TCPCONN *);
+static void tcp_close(MADNS *, TCPCONN *);
+static void *tcp_receive(MADNS *, MADNS_ANSWER *);
 
 CASTFIELD(QUERY, link); // =>> static inline "link_QUERY()"
+CASTFIELD(QUERY, slink);
 
 //--------------|---------------------------------------------
 #undef MIN                      // occurs in <sys/param.h>
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
+#undef MAX
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
 #define OPT(x,y) ((x) ? (x) : (y))
-#define NTOHSP(_p) ntohs(*(uint16_t*)(_p))
-#define NTOHLP(_p) ntohl(*(uint32_t*)(_p))
+
+//---- DNS message parsing
+static int dns_open(DNS_MSG *, uint8_t const *pkt, int len);
+static void dns_rewind(DNS_MSG *);
+static int dns_next(DNS_MSG *, DNS_RR *);
+static int dns_nameeq(DNS_MSG const *, uint8_t const *, uint8_t const *);
+static int dns_getname(DNS_MSG const *, uint8_t const *, char *dst);
+
+//---- Context index
+static inline QUERY **ctxhead(MADNS const *, void const *ctx);
+static void ctxadd(MADNS *, QUERY *);
+static void ctxdrop(MADNS *, QUERY *);
 
 //---- Caching
-static HASH fnvstr(char const *buf);
-static void update_cache(MADNS *, RESPONSE const *);
+static int normalize(char const *src, char *dst, HASH *);
+static CACHE_INFO *cache_find(MADNS const *, char const *key, int len,
+                              HASH, int qtype);
+static int cache_live(CACHE_INFO const *, int af, time_t now);
+static CACHE_INFO *cache_lookup(MADNS const *, char const *key, int len,
+                                HASH, int af, time_t now);
+static CACHE_INFO *cache_nxparent(MADNS const *, char const *key, int len,
+                                  time_t now);
+static CACHE_INFO *cache_search(MADNS const *, char const *name,
+                                char const *key, int len, HASH, int af,
+                                time_t now);
+static int cache_positive(CACHE_INFO const *, int af, time_t now);
+static int rr_lookup(MADNS const *, char const *key, int len, HASH,
+                     int qtype, MADNS_ANSWER *);
+static unsigned cache_rotor(MADNS const *, CACHE_INFO *);
+static void count_lookup(MADNS const *, int hit);
+static in_addr_t cache_addr(MADNS const *, CACHE_INFO *);
+static void cache_answer(MADNS const *, CACHE_INFO *, int af, time_t now,
+                         MADNS_ANSWER *);
+static void cache_free(MADNS *, CACHE_INFO *);
+static int cache_retire(MADNS *, CACHE_INFO *);
+static void free_retired(MADNS *);
+static void arena_release(MADNS *, CACHE_INFO const *);
+static int cache_rebuild(MADNS *, int limit, time_t dead);
+static void cache_hit(MADNS const *, CACHE_INFO *, int af, time_t now);
+static void send_refreshes(MADNS *);
+static void refresh_done(MADNS *, QUERY const *);
+static int stale_answer(MADNS *, QUERY const *, MADNS_ANSWER *);
+static int rr_answer(CACHE_INFO const *, time_t now, MADNS_ANSWER *);
+static CACHE_INFO *rr_entry(RESPONSE const *, char const *name, int len,
+                            time_t ttl, int flags);
+static CACHE_INFO *addr_entry(CACHE_INFO const *, RESPONSE const *,
+                              char const *name, int len, time_t ttl,
+                              int flags);
+static CACHE_INFO *cache_response(MADNS *, QUERY const *, RESPONSE const *);
+static CACHE_INFO *update_cache(MADNS *, char const *name, int len, HASH,
+                                RESPONSE const *, time_t ttl, int flags);
+static int ptr_name(in_addr_t, char *dst);
 
 //---- Auditing
 FILE   *madns_log;
 static void log_(int line, const char *fmt, ...);
-static void log_packet(int line, char *pkt, int len);
+static void log_packet(int line, char const *pkt, int len);
+
+//---- Tracing: TRACE(mp, send, qp, value) queues MADNS_EV_SEND if
+//  MADNS_TRACE is set, and fires USDT probe madns:send.
+enum {
+    EV_request = MADNS_EV_REQUEST, EV_send = MADNS_EV_SEND,
+    EV_retry = MADNS_EV_RETRY, EV_receive = MADNS_EV_RECEIVE,
+    EV_parse = MADNS_EV_PARSE, EV_cache = MADNS_EV_CACHE,
+    EV_complete = MADNS_EV_COMPLETE
+};
+#ifdef SDT
+#   define PROBE(ev, qp, value) DTRACE_PROBE5(madns, ev, (qp)->tid, \
+        (qp)->server ? (qp)->server->ip : 0, (qp)->qtype, value, (qp)->name)
+#else
+#   define PROBE(ev, qp, value) ((void)0)
+#endif
+#define TRACE_AT(mp, ev, qp, value, nsecs) do { \
+        PROBE(ev, qp, value); \
+        if ((mp)->trace) \
+            trace_(mp, EV_##ev, qp, value, nsecs); \
+    } while (0)
+#define TRACE(mp, ev, qp, value) TRACE_AT(mp, ev, qp, value, 0)
+static uint64_t trace_clock(void);
+static void trace_(MADNS *, int event, QUERY const *, int value,
+                   uint64_t nsecs);
+
+// RFC 8767: stale answers are given a TTL of 30 secs.
+#define STALE_TTL   30
 
 #undef  LOG
 #define LOG(...) (madns_log ? log_(__LINE__,__VA_ARGS__) : 0)
@@ -155,27 +595,26 @@ madns_create(char const *resolv_conf, int query_time, int server_reqs)
 {
     int     i, rcvbufsiz = 128 * 1024;
     MADNS  *mp = calloc(1, sizeof(MADNS));
-    char    line[512];
 
     start = tick();
     mp->sock = -1;              // for destroy, called inside "create".
+    qinit(&mp->active);
+    qinit(&mp->stalewait);
     mp->query_time = OPT(query_time, MADNS_QUERY_TIME);
+    mp->refresh_hits = MADNS_REFRESH_HITS_DEFAULT;
+    mp->stale_wait = MADNS_STALE_WAIT_DEFAULT;
+    mp->edns = MADNS_EDNS_DEFAULT;
+    mp->tcp_conns = MADNS_TCP_CONNS_DEFAULT;
+    mp->refreshq = calloc(1, sizeof *mp->refreshq);
+    mp->stats = calloc(1, sizeof *mp->stats);
     mp->limit = MIN_CACHE;
+    mp->watch = -1;
+    mp->conf = strdup(OPT(resolv_conf, MADNS_RESOLV_CONF));
 
-    FILE   *fp = fopen(OPT(resolv_conf, MADNS_RESOLV_CONF), "r");
-
-    if (fp && (mp->serv = malloc(sizeof *mp->serv * fseek(fp, 0L, 2)))) {
-        for (rewind(fp); fgets(line, sizeof line, fp);)
-            if (1 == sscanf(line, "nameserver %s", line)) {
-                mp->serv[mp->nservs].ip = inet_addr(line);
-                if (mp->serv[mp->nservs].ip != INADDR_NONE)
-                    mp->serv[mp->nservs++].nreqs = 0;
-            }
-        fclose(fp);
-    }
-
-    if (!mp->nservs)
+    if (!mp->conf || !mp->stats || !load_conf(mp, mp->conf))
         return madns_destroy(mp), NULL;
+    if (!query_time && mp->timeout)
+        mp->query_time = mp->timeout;
 
     mp->server_reqs = MIN(OPT(server_reqs, MADNS_SERVER_REQS),
                           MAX_TIDS / mp->nservs);
@@ -183,11 +622,19 @@ madns_create(char const *resolv_conf, int query_time, int server_reqs)
     if (mp->qsize > MAX_TIDS || mp->qsize < 2)
         return madns_destroy(mp), NULL;
 
-    mp->serv = realloc(mp->serv, sizeof(SERVER) * mp->nservs);
     mp->cachev = calloc(mp->limit, sizeof(CACHE_INFO *));
-    mp->queries = malloc(mp->qsize * sizeof(*mp->queries));
+    mp->queries = calloc(mp->qsize, sizeof(*mp->queries));
+    mp->searches = calloc(MAX(1, mp->qsize / (MAX_SEARCH + 1)),
+                          sizeof *mp->searches);
+    for (i = mp->searches ? MAX(1, mp->qsize / (MAX_SEARCH + 1)) : 0; i--;)
+        search_free(mp, &mp->searches[i]);
+    for (mp->ctxmask = MIN_CACHE - 1; mp->ctxmask < mp->qsize;)
+        mp->ctxmask = mp->ctxmask * 2 + 1;
+    mp->ctxv = calloc(mp->ctxmask + 1, sizeof(QUERY *));
+    mp->tcp = calloc(mp->nservs * MADNS_TCP_MAXCONNS, sizeof *mp->tcp);
+    for (i = 0; i < mp->nservs * MADNS_TCP_MAXCONNS; ++i)
+        mp->tcp[i].fd = -1, mp->tcp[i].server = &mp->serv[i / MADNS_TCP_MAXCONNS];
 
-    qinit(&mp->active);
     qinit(&mp->unused);
     for (i = 0; i < mp->qsize; ++i)
         qpush(&mp->unused, &mp->queries[i].link);
@@ -213,19 +660,53 @@ madns_destroy(MADNS * mp)
 
     int     i;
 
-    for (i = 0; i < mp->limit; ++i)
-        free(mp->cachev[i]);
+    for (i = 0; mp->cachev && i < mp->limit; ++i)
+        cache_free(mp, mp->cachev[i]);
 
     while (!qempty(&mp->active))
-        destroy_query(mp, link_QUERY(mp->active.next), 0);
+        cancel_query(mp, link_QUERY(mp->active.next));
 
-    free(mp->queries), free(mp->serv), free(mp);
+    for (i = 0; mp->tcp && i < mp->nservs * MADNS_TCP_MAXCONNS; ++i) {
+        if (mp->tcp[i].fd != -1)
+            (void)close(mp->tcp[i].fd);
+        free(mp->tcp[i].obuf), free(mp->tcp[i].ibuf);
+    }
+
+    uring_destroy(mp);
+    if (mp->watch != -1)
+        (void)close(mp->watch);
+    free(mp->conf);
+    free_retired(mp);
+    free(mp->retired), free(mp->tcp);
+    for (i = 0; mp->routes && i < mp->nroutes; ++i)
+        free(mp->routes[i].servs);
+    free(mp->routes), free(mp->routev);
+    free_servers(mp->serv, mp->nservs);
+    free(mp->cachev), free(mp->queries), free(mp->searches), free(mp->ctxv);
+    free(mp->refreshq), free(mp->stats), free(mp->trace), free(mp);
 }
 
 int
 madns_fileno(MADNS const *mp)
 {
-    return mp->sock;
+    return mp->uring ? uring_fileno(mp->uring) : mp->sock;
+}
+
+int
+madns_pollfds(MADNS const *mp, struct pollfd *fds, int max)
+{
+    int     i, n = 0;
+
+    if (max > 0)
+        fds[n++] = (struct pollfd) {madns_fileno(mp), POLLIN, 0};
+    if (mp->watch != -1 && n < max)
+        fds[n++] = (struct pollfd) {mp->watch, POLLIN, 0};
+    for (i = 0; i < mp->nservs * MADNS_TCP_MAXCONNS && n < max; ++i)
+        if (mp->tcp[i].fd != -1)
+            fds[n++] = (struct pollfd) {
+            mp->tcp[i].fd, POLLIN | (mp->tcp[i].olen ? POLLOUT : 0), 0};
+
+    return n;
 }
 
 int
@@ -237,8 +718,16 @@ madns_ready(MADNS const *mp)
 int
 madns_expires(MADNS * mp)
 {
-    return qempty(&mp->active) ? mp->query_time + 1
+    if (mp->watch != -1)
+        watch_check(mp);
+    uring_submit(mp);
+
+    int     secs = qempty(&mp->active) ? mp->query_time + 1
         : link_QUERY(mp->active.next)->expires - time(0);
+
+    if (!qempty(&mp->stalewait))
+        secs = MIN(secs, slink_QUERY(mp->stalewait.next)->stale_at - tick() + 1);
+    return MAX(secs, 0);
 }
 
 in_addr_t
@@ -248,106 +737,616 @@ madns_lookup(MADNS const *mp, char const *name)
 
     if (ip != INADDR_NONE)
         return ip;
-    if (strlen(name) > DNS_MAX_HOSTNAME)
+
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+    int     len = normalize(name, key, &hash);
+
+    if (len < 0)
         return INADDR_NONE;
 
-    HASH    h, hash = fnvstr(name);
+    CACHE_INFO *cip = cache_search(mp, name, key, len, hash, AF_INET, time(0));
+
+    return cip ? cache_addr(mp, cip) : INADDR_ANY;
+}
+
+int
+madns_lookup6(MADNS const *mp, char const *name, struct in6_addr *ip6)
+{
+    if (inet_pton(AF_INET6, name, ip6) == 1)
+        return 1;
+
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+    int     len = normalize(name, key, &hash);
+
+    if (len < 0)
+        return -1;
+
+    CACHE_INFO *cip = cache_search(mp, name, key, len, hash, AF_INET6,
+                                   time(0));
+
+    if (!cip)
+        return 0;
+    if (!cip->naddrs6 || !cache_live(cip, AF_INET6, time(0)))
+        return -1;              // NODATA, or under an NXDOMAIN.
+    *ip6 = cache_addrs6(cip)[cache_rotor(mp, cip) % cip->naddrs6];
+    return 1;
+}
+
+int
+madns_lookup_all(MADNS const *mp, char const *name, MADNS_ANSWER * ap)
+{
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+    int     len;
     time_t  now = time(0);
 
-    for (h = hash;; ++h) {
-        CACHE_INFO *cip = mp->cachev[h &= mp->limit - 1];
+    ap->ttl = 0, ap->flags = 0, ap->naddrs6 = 0, ap->nrecs = 0;
+    ap->addrs[0] = inet_addr(name);
+    if (ap->addrs[0] != INADDR_NONE || (len = normalize(name, key, &hash)) < 0)
+        return ap->naddrs = 1;
+    if (inet_pton(AF_INET6, name, ap->addrs6) == 1)
+        return ap->naddrs = 0, ap->naddrs6 = 1;
 
-        if (!cip)
-            return INADDR_ANY;
-        if (cip->hash == hash && cip->expires >= now
-            && !strcasecmp(cip->name, name))
-            return cip->ip;
+    CACHE_INFO *cip = cache_search(mp, name, key, len, hash, AF_UNSPEC, now);
+
+    ap->naddrs = 0;
+    if (cip)
+        cache_answer(mp, cip, AF_UNSPEC, now, ap);
+    return ap->naddrs + ap->naddrs6;
+}
+
+int
+madns_lookup_rr(MADNS const *mp, char const *name, int qtype,
+                MADNS_ANSWER * ap)
+{
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+    int     len = normalize(name, key, &hash);
+
+    if (len < 0) {
+        rr_answer(NULL, 0, ap);
+        ap->naddrs = 1, ap->addrs[0] = INADDR_NONE;
+        return -1;
+    }
+
+    // As cache_search: the first candidate with records, unless one
+    //  before it is not cached; else the answer for the name as given.
+    int     order = search_order(mp, name), i, ret;
+    CAND    cand;
+
+    for (i = 0; order && i <= mp->nsearch; ++i)
+        if (search_cand(mp, order, key, len, hash, i, &cand) > 0
+            && (ret = rr_lookup(mp, cand.name, cand.len, cand.hash, qtype,
+                                ap)) >= 0)
+            break;
+    if (!order || (order == 1 && i > mp->nsearch))
+        ret = rr_lookup(mp, key, len, hash, qtype, ap);
+    else if (i > mp->nsearch)
+        ret = -1;
+    count_lookup(mp, ret);
+    return ret;
+}
+
+// madns_lookup_rr of a normalized name, without the search list.
+static int
+rr_lookup(MADNS const *mp, char const *key, int len, HASH hash, int qtype,
+          MADNS_ANSWER * ap)
+{
+    time_t  now = time(0);
+    CACHE_INFO *cip = cache_find(mp, key, len, hash, qtype);
+
+    if (cip && cip->expires >= now)
+        cache_hit(mp, cip, AF_INET, now);
+    else if (!(cip = cache_find(mp, key, len, hash, 0))
+             || !(cip->flags & CACHE_NXDOMAIN) || cip->expires < now)
+        cip = cache_nxparent(mp, key, len, now);
+    return rr_answer(cip, now, ap);
+}
+
+// PTR names are absolute: the search list does not apply.
+int
+madns_lookup_ptr(MADNS const *mp, in_addr_t ip, MADNS_ANSWER * ap)
+{
+    char    name[DNS_NAME_BUF];
+
+    strcpy(name + ptr_name(ip, name), ".");
+    return madns_lookup_rr(mp, name, DNS_PTR, ap);
+}
+
+int
+madns_lookup_many(MADNS const *mp, char const **names, in_addr_t * out, int n)
+{
+#   define  BATCH   16
+    char    keys[BATCH][DNS_NAME_BUF];
+    int     lens[BATCH], i, j, m, hits = 0;
+    HASH    hashes[BATCH];
+    time_t  now = time(0);
+
+    for (i = 0; i < n; i += BATCH) {
+        m = MIN(BATCH, n - i);
+
+        // Pass 1: hash the batch and prefetch each home bucket.
+        for (j = 0; j < m; ++j) {
+            out[i + j] = inet_addr(names[i + j]);
+            lens[j] = out[i + j] != INADDR_NONE ? -1
+                : normalize(names[i + j], keys[j], &hashes[j]);
+            if (lens[j] >= 0)
+                __builtin_prefetch(&mp->cachev[hashes[j] & (mp->limit - 1)]);
+        }
+
+        // Pass 2: the buckets are (mostly) in cache; prefetch the entries.
+        for (j = 0; j < m; ++j)
+            if (lens[j] >= 0)
+                __builtin_prefetch(mp->cachev[hashes[j] & (mp->limit - 1)]);
+
+        // Pass 3: probe.
+        for (j = 0; j < m; ++j) {
+            if (lens[j] >= 0) {
+                CACHE_INFO *cip = cache_search(mp, names[i + j], keys[j],
+                                               lens[j], hashes[j], AF_INET,
+                                               now);
+                out[i + j] = cip ? cache_addr(mp, cip) : INADDR_ANY;
+            }
+            hits += out[i + j] != INADDR_ANY;
+        }
     }
+
+    return hits;
 }
 
 int
 madns_request(MADNS * mp, char const *name, void *ctx)
 {
-    if (!ctx || !madns_ready(mp) || strlen(name) > DNS_MAX_HOSTNAME)
-        return 0;
+    return madns_request_af(mp, name, ctx, AF_INET);
+}
+
+int
+madns_request_af(MADNS * mp, char const *name, void *ctx, int af)
+{
+    if (!ctx || (af != AF_INET && af != AF_INET6 && af != AF_UNSPEC))
+        return errno = EINVAL, 0;
+    return request(mp, name, ctx, af == AF_INET6 ? DNS_AAAA : DNS_A_RECORD,
+                   af == AF_UNSPEC);
+}
+
+int
+madns_request_rr(MADNS * mp, char const *name, int qtype, void *ctx)
+{
+    if (qtype == DNS_A_RECORD || qtype == DNS_AAAA)
+        return madns_request_af(mp, name, ctx,
+                                qtype == DNS_AAAA ? AF_INET6 : AF_INET);
+    if (!ctx || qtype < 1 || qtype > 0xFFFF)
+        return errno = EINVAL, 0;
+    return request(mp, name, ctx, qtype, 0);
+}
+
+// PTR names are absolute: the search list does not apply.
+int
+madns_request_ptr(MADNS * mp, in_addr_t ip, void *ctx)
+{
+    char    name[DNS_NAME_BUF];
+
+    strcpy(name + ptr_name(ip, name), ".");
+    return madns_request_rr(mp, name, DNS_PTR, ctx);
+}
+
+// Start a request: one query for (name), or one per candidate name
+//  if the search list applies (see search_order). For order 2, the
+//  candidates go out at once, so a short name costs one round trip;
+//  for order 1, the rest go only if the name as given has no records.
+//  A refusal sets errno, as madns_request documents.
+static int
+request(MADNS * mp, char const *name, void *ctx, int qtype, int dual)
+{
+    int     order = ctx == mp->refreshq ? 0 : search_order(mp, name);
+    QUERY  *qp;
+
+    if (!order) {
+        qp = request_one(mp, name, ctx, qtype, dual);
+        qp ? mp->stats->c.requests++ : mp->stats->c.drops++;
+        return qp ? qp->tid : 0;
+    }
+
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+    int     i, len = normalize(name, key, &hash);
+    SEARCH *sp;
+
+    if (len < 0)
+        return mp->stats->c.drops++, errno = EINVAL, 0;
+    if (!(sp = search_take(mp)))
+        return mp->stats->c.drops++, errno = EAGAIN, 0;
+    sp->rcode = -1;
+    for (i = 0; i <= mp->nsearch; ++i) {
+        if (search_cand(mp, order, key, len, hash, i, &sp->cand[sp->n]) < 0)
+            continue;
+        if (sp->cand[sp->n].len == len)
+            sp->asis = sp->n;
+        sp->n++;
+    }
+
+    int     need = (order == 2 ? sp->n : 1) * (1 + dual);
+
+    if (madns_ready(mp) < need) {
+        errno = need > mp->qsize ? ENOBUFS : EAGAIN;
+        return mp->stats->c.drops++, search_free(mp, sp), 0;
+    }
+    sp->ctx = ctx, sp->qtype = qtype, sp->dual = dual;
+    sp->started = tick();
+    search_send(mp, sp, order == 2 ? sp->n : 1);
+    for (i = 0; i < sp->n && !sp->q[i]; ++i);
+    if (i == sp->n)
+        return mp->stats->c.drops++, search_free(mp, sp), 0;
+    mp->stats->c.requests++;
+    return sp->q[i]->tid;
+}
+
+// Send the candidates of a search request up to (end); those without a
+//  free slot count as having no records.
+static void
+search_send(MADNS * mp, SEARCH * sp, int end)
+{
+    QUERY  *qp;
 
-    QUERY  *qp = link_QUERY(qpull(mp->unused.next));
+    for (; sp->sent < end; ++sp->sent) {
+        qp = request_one(mp, sp->cand[sp->sent].name, sp->ctx, sp->qtype,
+                         sp->dual);
+        if (!qp) {
+            sp->state[sp->sent] = -1;
+            memset(&sp->ans[sp->sent], 0, sizeof *sp->ans);
+            continue;
+        }
+        if (qp->stale_at)       // Serve-stale is for one name, not several.
+            qpull(&qp->slink), qp->stale_at = 0;
+        sp->q[sp->sent] = qp;
+        qp->search = sp, qp->nth = sp->sent;
+        if (qp->twin)
+            qp->twin->search = sp, qp->twin->nth = sp->sent;
+    }
+}
+
+// Start the query for one name (both halves, if (dual)), and send it.
+static QUERY *
+request_one(MADNS * mp, char const *name, void *ctx, int qtype, int dual)
+{
+    QUERY  *qp;
+
+    if (madns_ready(mp) <= dual)
+        return errno = EAGAIN, NULL;
+    if (!(qp = start_query(mp, name, ctx, qtype)))
+        return errno = EINVAL, NULL;
+    TRACE(mp, request, qp, dual);
+
+    // Serve-stale: if the name has only an expired entry, fall back on it
+    //  should this query fail or not be answered within stale_wait.
+    time_t  now = time(0);
+    CACHE_INFO *cip;
+
+    if (mp->stale && ctx != mp->refreshq && qtype == DNS_A_RECORD && !dual
+        && (cip = cache_find(mp, qp->name, qp->len, qp->hash, 0))
+        && cip->expires < now && cip->expires >= now - mp->stale) {
+        qp->stale_at = qp->started + mp->stale_wait / 1000.0;
+        qpush(&mp->stalewait, &qp->slink);
+    }
+
+    // Both halves go out at once; the later one completes the request.
+    if (dual) {
+        qp->twin = start_query(mp, name, ctx, DNS_AAAA);
+        qp->twin->twin = qp;
+        qp->dual = qp->twin->dual = 1;
+        TRACE(mp, request, qp->twin, 1);
+        send_request(mp, qp->twin);
+    }
+
+    send_request(mp, qp);
+    return qp;
+}
 
+// Take the next free slot for a (qtype) query, and encode it.
+//  Normalize straight into the slot; take it only if the name is valid.
+static QUERY *
+start_query(MADNS * mp, char const *name, void *ctx, int qtype)
+{
+    QUERY  *qp = link_QUERY(mp->unused.next);
+    int     len = normalize(name, qp->name, &qp->hash);
+
+    if (len < 0)
+        return NULL;
+
+    qpull(&qp->link);
     mp->nfree--;
     qp->ctx = ctx;
+    qp->len = len;
+    qp->qtype = qtype;
+    qp->dual = 0, qp->twin = NULL, qp->stale_at = 0, qp->half.n = 0;
+    qp->tcp = 0, qp->conn = NULL;
+    qp->search = NULL, qp->nth = 0, qp->tries = mp->attempts - 1;
+    qp->route = mp->nroutes > 1 ? route_of(mp, qp->name, len) : 0;
     qp->expires = 0;            // so failure in "send_request" causes instant expiry.
     qp->tid = qp - mp->queries + mp->qsize * ((rand() & 32767) / mp->qsize + 1);
-    qp->name = strdup(name);
+    qp->pktlen = encode_request(qp, mp->edns);
     qp->started = tick();
+    ctxadd(mp, qp);
     qpush(&mp->active, &qp->link);
-    send_request(mp, qp);
-
-    return qp->tid;             // for auditing only; anything other than (-1) is okay.
+    return qp;
 }
 
 void   *
 madns_response(MADNS * mp, in_addr_t * ip)
 {
-    while (1) {
+    MADNS_ANSWER ans;
+    void   *ctx = madns_response_all(mp, &ans);
+
+    *ip = ans.naddrs ? ans.addrs[0] : INADDR_ANY;
+    return ctx;
+}
+
+void   *
+madns_response_all(MADNS * mp, MADNS_ANSWER * ap)
+{
+    void   *ctx;
+
+    free_retired(mp);
+    if ((ctx = next_response(mp, ap)))
+        hist_add(&mp->stats->latency, mp->done.latency);
+    return ctx;
+}
+
+int
+madns_responses(MADNS * mp, MADNS_COMPLETION * out, int max)
+{
+    int     n;
+
+    free_retired(mp);
+    for (n = 0; n < max && (out[n].ctx = next_response(mp, &out[n].ans)); ++n) {
+        hist_add(&mp->stats->latency, mp->done.latency);
+        out[n].rcode = mp->done.rcode;
+        out[n].latency = mp->done.latency;
+        out[n].server = mp->done.server;
+    }
+
+    return n;
+}
+
+// The next completion: an answer, an expiry, or a stale fallback.
+//  Record views in (*ap) stay valid until free_retired.
+static void *
+next_response(MADNS * mp, MADNS_ANSWER * ap)
+{
+    void   *ctx;
+
+    send_refreshes(mp);
+    if ((ctx = tcp_receive(mp, ap)))
+        return ctx;
+    if (mp->uring && (ctx = uring_receive(mp, ap)))
+        return ctx;
+
+    while (!mp->uring) {
         char    pkt[DNS_PACKET_LEN];
         INADDR  sa;
         socklen_t salen = sizeof sa;
-        RESPONSE resp;
-        char    ips[99];
-
         int     len = recvfrom(mp->sock, pkt, sizeof pkt, 0,
                                (SADDR *) & sa, &salen);
         if (len <= 0)
             break;
+        if ((ctx = receive(mp, pkt, len, sa.sin_addr.s_addr, NULL, ap)))
+            return ctx;
+    }
 
-        if (!parse_response(pkt, len, &resp))
+    while (!qempty(&mp->active)) {
+        QUERY  *qp = link_QUERY(mp->active.next);
+
+        if (qp->expires > time(0))
+            break;
+        if (qp->tries && retry_query(mp, qp))
             continue;
+        mp->stats->c.expiries++;
+
+        RESPONSE none = {.qtype = qp->qtype,.rcode = -1 };
 
-        LOG("resp: ip %s ttl %lu tid %hu name %s\n",
-            ipstr(resp.ip, ips), resp.ttl, resp.tid, resp.name);
+        if ((ctx = complete_query(mp, qp, &none, NULL, ap)))
+            return ctx;
+    }
 
-        QUERY  *qp = &mp->queries[(int)resp.tid % mp->qsize];
+    // A query past its stale deadline completes with the stale entry,
+    //  and carries on as a refresh query.
+    double  now = tick();
 
-        if (qp->ctx && qp->tid == resp.tid && qp->server
-            && qp->server->ip == sa.sin_addr.s_addr) {
+    while (!qempty(&mp->stalewait)) {
+        QUERY  *qp = slink_QUERY(mp->stalewait.next);
 
-            if (resp.ip != INADDR_ANY && !strcasecmp(resp.name, qp->name))
-                update_cache(mp, &resp);
-            return destroy_query(mp, qp, *ip = resp.ip);
+        if (qp->stale_at > now)
+            break;
+        qpull(&qp->slink);
+        qp->stale_at = 0;
+        if (stale_answer(mp, qp, ap)) {
+            mp->stats->c.stale++;
+            mp->done.rcode = -1, mp->done.server = INADDR_ANY;
+            mp->done.latency = now - qp->started;
+            ctx = qp->ctx;
+            ctxdrop(mp, qp);
+            qp->ctx = mp->refreshq;
+            ctxadd(mp, qp);
+            return ctx;
         }
+    }
+
+    return NULL;
+}
+
+// Match a DNS message from (from), over UDP or TCP (conn), to its query;
+//  cache it and complete the query.
+// Returns the request context, or NULL if there is none to return.
+static void *
+receive(MADNS * mp, char const *pkt, int len, in_addr_t from, TCPCONN * conn,
+        MADNS_ANSWER * ap)
+{
+    RESPONSE resp;
+    char    ips[99];
+    uint64_t arrived = mp->trace ? trace_clock() : 0;
+
+    if (!parse_response(pkt, len, &resp))
+        return NULL;
+
+    QUERY  *qp = &mp->queries[(int)resp.tid % mp->qsize];
 
+    // A late UDP answer to a query resent over TCP is ignored.
+    if (!qp->ctx || qp->tid != resp.tid || !qp->server
+        || qp->server->ip != from || qp->tcp != !!conn
+        || (conn && qp->conn != conn)) {
         log_packet(__LINE__, pkt, len);
-        if (qp->server && qp->server->ip != sa.sin_addr.s_addr)
+        if (qp->server && qp->server->ip != from)
             LOG("resp.addr=%s tid=%hu ttl=%lu serv=%s\n",
-                ipstr(sa.sin_addr.s_addr, pkt), resp.tid, resp.ttl,
-                ipstr(qp->server->ip, pkt + 33));
+                ipstr(from, ips), resp.tid, resp.ttl,
+                ipstr(qp->server->ip, ips + 33));
+        return NULL;
     }
 
-    if (!qempty(&mp->active)) {
-        QUERY  *qp = link_QUERY(mp->active.next);
+    LOG("resp: ip %s naddrs %d ttl %lu tid %hu name %s%s\n",
+        ipstr(resp.naddrs ? resp.addrs[0] : INADDR_ANY, ips),
+        resp.naddrs, resp.ttl, resp.tid, qp->name, conn ? " (tcp)" : "");
 
-        if (qp->expires <= time(0))
-            return destroy_query(mp, qp, *ip = INADDR_ANY);
+    // The request qname was sent in lower case and is echoed as-is.
+    // A different question is not an answer to this query.
+    if (resp.msg.qlen != qp->len + 2 || resp.qtype != qp->qtype
+        || memcmp(resp.msg.qname, qp->pkt + 12, resp.msg.qlen)) {
+        log_packet(__LINE__, pkt, len);
+        return NULL;
     }
 
-    return NULL;
+    TRACE_AT(mp, receive, qp, len, arrived);
+    TRACE(mp, parse, qp, resp.rcode);
+    if (conn)
+        conn->answered++;
+    mp->stats->c.answers++;
+    mp->stats->c.nxdomains += resp.rcode == DNS_R_NXDOMAIN;
+    mp->stats->c.errors += resp.rcode && resp.rcode != DNS_R_NXDOMAIN;
+    qp->server->stats->answers++;
+    hist_add(&qp->server->stats->rtt, tick() - qp->sent);
+
+    // Truncated: ask again over TCP.
+    if (resp.msg.flags & 0x0200 && !conn) {
+        mp->stats->c.truncated++;
+        transmit(mp, qp, 1);
+        return NULL;
+    }
+
+    // A server that does not know EDNS0 (RFC 6891 7): ask again without.
+    if (resp.rcode == DNS_R_FORMERR && !conn
+        && ((DNS_RESP *) qp->pkt)->nother) {
+        qp->pktlen = encode_request(qp, 0);
+        transmit(mp, qp, 0);
+        return NULL;
+    }
+
+    CACHE_INFO *cip = resp.naddrs || resp.naddrs6 || resp.nrrs
+        ? cache_response(mp, qp, &resp) : NULL;
+
+    return complete_query(mp, qp, &resp, cip, ap);
 }
 
 int
-madns_cancel(MADNS * mp, const void *context)
+madns_set(MADNS * mp, MADNS_PARAM param, int value)
 {
-    QLINK  *lp;
+    int     old;
 
-    for (lp = mp->active.next; lp != &mp->active; lp = lp->next) {
-        QUERY  *qp = link_QUERY(lp);
+    switch (param) {
+    case MADNS_ROTATE:
+        old = mp->rotate, mp->rotate = value;
+        return old;
+    case MADNS_REFRESH:
+        if (value < 0 || value > 100)
+            return -1;
+        old = mp->refresh_pct, mp->refresh_pct = value;
+        return old;
+    case MADNS_REFRESH_HITS:
+        old = mp->refresh_hits, mp->refresh_hits = value;
+        return old;
+    case MADNS_SERVE_STALE:
+        old = mp->stale, mp->stale = MAX(value, 0);
+        return old;
+    case MADNS_STALE_WAIT:
+        old = mp->stale_wait, mp->stale_wait = MAX(value, 0);
+        return old;
+    case MADNS_EDNS:
+        if (value && (value < 512 || value > DNS_PACKET_LEN))
+            return -1;
+        old = mp->edns, mp->edns = value;
+        return old;
+    case MADNS_TCP:
+        old = mp->tcp_only, mp->tcp_only = !!value;
+        return old;
+    case MADNS_URING:
+        old = !!mp->uring;
+        if (!!value == old)
+            return old;
+        if (!qempty(&mp->active))
+            return -1;
+        if (!value)
+            return uring_destroy(mp), old;
+        return uring_create(mp) ? old : -1;
+    case MADNS_TCP_CONNS:
+        if (value < 1 || value > MADNS_TCP_MAXCONNS)
+            return -1;
+        old = mp->tcp_conns, mp->tcp_conns = value;
+        return old;
+    case MADNS_WATCH:
+        old = mp->watch != -1;
+        return watch_conf(mp, !!value) ? old : -1;
+    case MADNS_TRACE:
+        if (value < 0 || value > MADNS_TRACE_MAX)
+            return -1;
+        old = mp->trace ? (int)mp->trace->mask + 1 : 0;
+        free(mp->trace), mp->trace = NULL;
+        if (value) {
+            unsigned size = 1;
 
-        if (qp->ctx == context) {
-            int     tid = qp->tid;  // To audit what was cancelled.
-            return destroy_query(mp, qp, 0), tid;
+            while (size < (unsigned)value)
+                size <<= 1;
+            mp->trace = calloc(1, sizeof *mp->trace
+                               + size * sizeof *mp->trace->ev);
+            if (!mp->trace)
+                return -1;
+            mp->trace->mask = size - 1;
         }
+        return old;
     }
 
-    return 0;
+    return -1;
+}
+
+int
+madns_cancel(MADNS * mp, const void *context)
+{
+    QUERY  *qp, *oldest = NULL;
+
+    // Chains are pushed at the head, so the last match is the oldest.
+    for (qp = *ctxhead(mp, context); qp; qp = qp->ctxnext)
+        if (qp->ctx == context)
+            oldest = qp;
+    if (!oldest)
+        return 0;
+
+    int     tid = oldest->tid;  // To audit what was cancelled.
+    return cancel_query(mp, oldest), tid;
+}
+
+int
+madns_cancel_all(MADNS * mp, const void *context)
+{
+    QUERY  *qp;
+    int     count = 0;
+
+    // Cancelling a request may take any number of queries off the chain.
+    for (qp = *ctxhead(mp, context); qp;)
+        if (qp->ctx == context)
+            count += cancel_query(mp, qp), qp = *ctxhead(mp, context);
+        else
+            qp = qp->ctxnext;
+
+    return count;
 }
 
 void
@@ -366,6 +1365,11 @@ madns_dump(MADNS const *mp, FILE * fp, MADNS_OPTS opts)
             " nservs:%d qsize:%d nfree:%d #active:%d #unused:%d\n",
             mp, mp->query_time, mp->server_reqs, mp->sock,
             mp->nservs, mp->qsize, mp->nfree, nactive, nunused);
+    fprintf(fp, "# search:");
+    for (i = 0; i < mp->nsearch; ++i)
+        fprintf(fp, " %s", mp->search[i]);
+    fprintf(fp, " ndots:%d attempts:%d%s\n", mp->ndots, mp->attempts,
+            mp->rotate_servers ? " rotate" : "");
 
     if (opts & QUERIES) {
         fprintf(fp, "# SERVERS:\n# ..... ip............. reqs latency\n");
@@ -373,6 +1377,21 @@ madns_dump(MADNS const *mp, FILE * fp, MADNS_OPTS opts)
             fprintf(fp, "# %5d %-15s %4d %.4f\n",
                     i, ipstr(mp->serv[i].ip, ips), mp->serv[i].nreqs,
                     mp->serv[i].latency);
+        for (i = 1; i < mp->nroutes; ++i) {
+            int     j;
+
+            fprintf(fp, "# route %s:", mp->routes[i].zone);
+            for (j = 0; j < mp->routes[i].nservs; ++j)
+                fprintf(fp, " %s",
+                        ipstr(mp->serv[mp->routes[i].servs[j]].ip, ips));
+            fputc('\n', fp);
+        }
+        for (i = 0; i < mp->nservs * MADNS_TCP_MAXCONNS; ++i)
+            if (mp->tcp[i].fd != -1)
+                fprintf(fp, "# tcp %-15s fd:%d reqs:%d answered:%d"
+                        " unsent:%d\n", ipstr(mp->tcp[i].server->ip, ips),
+                        mp->tcp[i].fd, mp->tcp[i].nreqs, mp->tcp[i].answered,
+                        mp->tcp[i].olen);
 
         if (nactive) {
             fprintf(fp, "# QUERIES:\n# ..... ctx....... elapsed.. tid.."
@@ -391,252 +1410,2665 @@ madns_dump(MADNS const *mp, FILE * fp, MADNS_OPTS opts)
     }
 
     if (opts & CACHE) {
-        fprintf(fp, "# CACHE: limit:%d count:%d\n# ..... hash.... exps."
-                " ip............. name\n", mp->limit, mp->count);
-        int     now = time(0);
+        int     now = time(0), narenas = 0;
+        size_t  bytes = 0;
         CACHE_INFO *cip;
+        ARENA  *ap;
+
+        for (ap = mp->arenas; ap; ap = ap->next)
+            ++narenas, bytes += ap->size;
+        fprintf(fp, "# CACHE: limit:%d count:%d preloads:%d (%zu bytes)\n"
+                "# ..... hash............ exps. ip............. name\n",
+                mp->limit, mp->count, narenas, bytes);
 
         for (i = 0; i < mp->limit; ++i)
-            if ((cip = mp->cachev[i]))
-                fprintf(fp, "# %5d %08X %5d %-15s %s\n",
-                        i, cip->hash, (int)cip->expires - now,
-                        ipstr(cip->ip, ips), cip->name);
+            if ((cip = mp->cachev[i]) && cip->qtype)
+                fprintf(fp, "# %5d %016llX %5d %-15s %s (type %d: %d)\n",
+                        i, (unsigned long long)cip->hash,
+                        (int)cip->expires - now, "", cache_name(cip),
+                        cip->qtype, cip->nrecs);
+            else if (cip)
+                fprintf(fp, "# %5d %016llX %5d %-15s %s%s%s%s\n",
+                        i, (unsigned long long)cip->hash,
+                        cip->flags & CACHE_PINNED ? -1
+                        : (int)cache_expires(cip) - now,
+                        ipstr(cip->naddrs ? cip->addrs[0] : INADDR_ANY, ips),
+                        cache_name(cip), cip->naddrs > 1 ? " (+more)" : "",
+                        cip->naddrs6 ? " (+AAAA)" : "",
+                        cip->flags & CACHE_PINNED ? " (pinned)" : "");
     }
 
     putc('\n', fp);
 }
 
-static void *
-destroy_query(MADNS * mp, QUERY * qp, in_addr_t logip)
+void
+madns_stats(MADNS const *mp, MADNS_STATS * sp)
+{
+    *sp = mp->stats->c;
+    sp->hits = __atomic_load_n(&mp->stats->c.hits, __ATOMIC_RELAXED);
+    sp->misses = __atomic_load_n(&mp->stats->c.misses, __ATOMIC_RELAXED);
+    sp->entries = mp->count, sp->limit = mp->limit;
+    sp->active = mp->qsize - mp->nfree;
+    sp->nservs = mp->nservs;
+    sp->p50 = hist_pct(&mp->stats->latency, 0.5);
+    sp->p99 = hist_pct(&mp->stats->latency, 0.99);
+    sp->p999 = hist_pct(&mp->stats->latency, 0.999);
+}
+
+int
+madns_server_stats(MADNS const *mp, int i, MADNS_SERVER_STATS * sp)
+{
+    if (i < 0 || i >= mp->nservs)
+        return 0;
+
+    SERVER const *svp = &mp->serv[i];
+
+    sp->ip = svp->ip, sp->reqs = svp->nreqs, sp->latency = svp->latency;
+    sp->sends = svp->stats->sends, sp->answers = svp->stats->answers;
+    sp->p50 = hist_pct(&svp->stats->rtt, 0.5);
+    sp->p99 = hist_pct(&svp->stats->rtt, 0.99);
+    sp->p999 = hist_pct(&svp->stats->rtt, 0.999);
+    return 1;
+}
+
+// Histogram buckets are exported at powers of 2 usecs, which are bucket
+//  boundaries, so each "le" count is exact: 128 usecs .. 16.8 secs.
+#define PROM_LE_MIN  7
+#define PROM_LE_MAX  24
+
+void
+madns_prometheus(MADNS const *mp, FILE * fp)
+{
+    static struct {
+        char const *name, *help;
+        size_t  off;
+    } const counters[] = {
+#       define  C(x, help) { #x, help, offsetof(MADNS_STATS, x) }
+        C(requests, "Requests taken."),
+        C(drops, "Requests refused."),
+        C(sends, "Queries sent, retries included."),
+        C(retries, "Queries sent again after query_time."),
+        C(truncated, "Answers truncated over UDP, asked again over TCP."),
+        C(answers, "Server answers matched to a query."),
+        C(nxdomains, "Answers with NXDOMAIN."),
+        C(errors, "Answers with SERVFAIL, REFUSED etc."),
+        C(expiries, "Queries never answered."),
+        C(stale, "Requests answered with an expired entry."),
+        C(refreshes, "Refresh-ahead queries."),
+        C(hits, "Lookups found in the cache."),
+        C(misses, "Lookups not found in the cache."),
+        C(rebuilds, "Cache table rebuilds."),
+        C(trace_lost, "Trace events dropped: the ring was full."),
+#       undef   C
+    };
+    MADNS_STATS st;
+    char    ips[INET_ADDRSTRLEN];
+    unsigned i;
+
+    madns_stats(mp, &st);
+    for (i = 0; i < sizeof counters / sizeof *counters; ++i)
+        fprintf(fp, "# HELP madns_%s_total %s\n# TYPE madns_%s_total counter\n"
+                "madns_%s_total %llu\n", counters[i].name, counters[i].help,
+                counters[i].name, counters[i].name, (unsigned long long)
+                *(uint64_t const *)((char const *)&st + counters[i].off));
+
+    fprintf(fp, "# TYPE madns_cache_entries gauge\nmadns_cache_entries %d\n"
+            "# TYPE madns_cache_slots gauge\nmadns_cache_slots %d\n"
+            "# TYPE madns_active_queries gauge\nmadns_active_queries %d\n",
+            st.entries, st.limit, st.active);
+    fprintf(fp, "# TYPE madns_request_latency_quantile_seconds gauge\n"
+            "madns_request_latency_quantile_seconds{quantile=\"0.5\"} %g\n"
+            "madns_request_latency_quantile_seconds{quantile=\"0.99\"} %g\n"
+            "madns_request_latency_quantile_seconds{quantile=\"0.999\"} %g\n",
+            st.p50, st.p99, st.p999);
+
+    fprintf(fp, "# HELP madns_request_latency_seconds Request latency.\n"
+            "# TYPE madns_request_latency_seconds histogram\n");
+    prom_hist(fp, "madns_request_latency_seconds", "", &mp->stats->latency);
+    fprintf(fp, "# HELP madns_server_latency_seconds Server response time.\n"
+            "# TYPE madns_server_latency_seconds histogram\n");
+    for (i = 0; i < (unsigned)mp->nservs; ++i) {
+        char    label[40];
+
+        snprintf(label, sizeof label, "server=\"%s\",",
+                 ipstr(mp->serv[i].ip, ips));
+        prom_hist(fp, "madns_server_latency_seconds", label,
+                  &mp->serv[i].stats->rtt);
+    }
+}
+
+// One Prometheus histogram; (label) is "" or 'name="value",'.
+static void
+prom_hist(FILE * fp, char const *name, char const *label, HIST const *hp)
+{
+    int     k;
+
+    for (k = PROM_LE_MIN; k <= PROM_LE_MAX; ++k)
+        fprintf(fp, "%s_bucket{%sle=\"%.6f\"} %llu\n", name, label,
+                (1 << k) / 1E6, (unsigned long long)hist_below(hp, 1 << k));
+    fprintf(fp, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, label,
+            (unsigned long long)hp->n);
+    if (*label)                 // Drop the trailing ','.
+        fprintf(fp, "%s_sum{%.*s} %g\n%s_count{%.*s} %llu\n",
+                name, (int)strlen(label) - 1, label, hp->sum,
+                name, (int)strlen(label) - 1, label, (unsigned long long)hp->n);
+    else
+        fprintf(fp, "%s_sum %g\n%s_count %llu\n", name, hp->sum, name,
+                (unsigned long long)hp->n);
+}
+
+// Bucket of (usecs): linear below HIST_SUB, then HIST_SUB per power of 2.
+static inline int
+hist_bucket(uint64_t usecs)
+{
+    if (usecs < HIST_SUB)
+        return usecs;
+
+    int     e = 63 - __builtin_clzll(usecs);    // >= 3
+    int     i = (e - 2) * HIST_SUB + (int)((usecs >> (e - 3)) & (HIST_SUB - 1));
+
+    return MIN(i, HIST_BUCKETS - 1);
+}
+
+// The first usecs value above bucket (i).
+static uint64_t
+hist_top(int i)
+{
+    if (i < HIST_SUB)
+        return i + 1;
+    return (uint64_t) (HIST_SUB + i % HIST_SUB + 1) << (i / HIST_SUB - 1);
+}
+
+static void
+hist_add(HIST * hp, double secs)
+{
+    hp->b[hist_bucket(secs > 0 ? secs * 1E6 : 0)]++;
+    hp->n++, hp->sum += secs;
+}
+
+// The (q) quantile, as the top of its bucket; 0 if there is no data.
+static double
+hist_pct(HIST const *hp, double q)
+{
+    uint64_t rank = q * hp->n, seen = 0;
+    int     i;
+
+    rank += !rank || rank < q * hp->n;  // ceil, and at least the first.
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        if ((seen += hp->b[i]) >= rank)
+            return hist_top(i) / 1E6;
+    return 0;
+}
+
+// Observations below (usecs), a bucket boundary.
+static uint64_t
+hist_below(HIST const *hp, uint64_t usecs)
+{
+    uint64_t n = 0;
+    int     i;
+
+    for (i = 0; i < HIST_BUCKETS && hist_top(i) <= usecs; ++i)
+        n += hp->b[i];
+    return n;
+}
+
+int
+madns_trace_read(MADNS * mp, MADNS_EVENT * out, int max)
+{
+    TRACE_RING *tp = mp->trace;
+    unsigned tail, head;
+    int     n;
+
+    if (!tp || max <= 0)
+        return 0;
+    tail = __atomic_load_n(&tp->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&tp->head, __ATOMIC_ACQUIRE);
+    for (n = 0; n < max && tail != head; ++n, ++tail)
+        out[n] = tp->ev[tail & tp->mask];
+    __atomic_store_n(&tp->tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+static uint64_t
+trace_clock(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Queue an event, stamped now unless (nsecs) is given. If the reader
+//  has fallen a ring behind, drop it: the query must not wait.
+static void
+trace_(MADNS * mp, int event, QUERY const *qp, int value, uint64_t nsecs)
+{
+    TRACE_RING *tp = mp->trace;
+    unsigned head = __atomic_load_n(&tp->head, __ATOMIC_RELAXED);
+
+    if (head - __atomic_load_n(&tp->tail, __ATOMIC_ACQUIRE) > tp->mask) {
+        mp->stats->c.trace_lost++;
+        return;
+    }
+    tp->ev[head & tp->mask] = (MADNS_EVENT) {
+    .nsecs = nsecs ? nsecs : trace_clock(),
+            .server = qp->server ? qp->server->ip : INADDR_ANY,
+            .value = value,.tid = qp->tid,.qtype = qp->qtype,.event = event};
+    __atomic_store_n(&tp->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Complete a query with its response (or, if it expired, an empty one),
+//  and (cip), the entry cache_response made for it, if any.
+// Returns the request context; or NULL if this is only the first half
+//  of an A+AAAA request, or a refresh, which the caller does not see.
+static void *
+complete_query(MADNS * mp, QUERY * qp, RESPONSE const *rp, CACHE_INFO * cip,
+               MADNS_ANSWER * ap)
+{
+    TRACE(mp, complete, qp, rp->rcode);
+    if (qp->ctx == mp->refreshq && !qp->twin)
+        refresh_done(mp, qp);
+    ap->flags = rp->rcode == DNS_R_NXDOMAIN ? MADNS_NXDOMAIN : 0;
+    ap->ttl = rp->ttl;
+    ap->naddrs = rp->naddrs, ap->naddrs6 = rp->naddrs6;
+    ap->nrecs = 0, ap->recs = NULL;
+    if (rp->nrrs) {             // Views into the entry, cached or not.
+        if (!cip && (cip = rr_entry(rp, qp->name, qp->len, 0, 0))
+            && !cache_retire(mp, cip))
+            free(cip), cip = NULL;      // No records, rather than a leak.
+        if (cip)
+            ap->nrecs = cip->nrecs, ap->recs = cache_recs(cip);
+    }
+    memcpy(ap->addrs, rp->addrs, rp->naddrs * sizeof *ap->addrs);
+    memcpy(ap->addrs6, rp->addrs6, rp->naddrs6 * sizeof *ap->addrs6);
+    if (!rp->naddrs && !rp->naddrs6 && qp->stale_at    // SERVFAIL, expiry.
+        && stale_answer(mp, qp, ap))
+        mp->stats->c.stale++;
+
+    if (qp->twin) {
+        QUERY  *twin = qp->twin;
+
+        twin->half.ttl = ap->ttl;
+        if (qp->qtype == DNS_AAAA)
+            memcpy(twin->half.addrs6, ap->addrs6,
+                   (twin->half.n = ap->naddrs6) * sizeof *ap->addrs6);
+        else
+            memcpy(twin->half.addrs, ap->addrs,
+                   (twin->half.n = ap->naddrs) * sizeof *ap->addrs);
+        if (qp->search)
+            qp->search->q[qp->nth] = twin;
+        return destroy_query(mp, qp, 0), NULL;
+    }
+
+    mp->done.rcode = rp->rcode;
+    mp->done.server = rp->rcode < 0 || !qp->server ? INADDR_ANY
+        : qp->server->ip;
+    mp->done.latency = tick() - qp->started;
+
+    // Merge the first half's answer, kept by its completion.
+    if (qp->dual && qp->half.n) {
+        if (qp->qtype == DNS_AAAA)
+            memcpy(ap->addrs, qp->half.addrs,
+                   (ap->naddrs = qp->half.n) * sizeof *ap->addrs);
+        else
+            memcpy(ap->addrs6, qp->half.addrs6,
+                   (ap->naddrs6 = qp->half.n) * sizeof *ap->addrs6);
+        ap->ttl = ap->ttl ? MIN(ap->ttl, qp->half.ttl) : qp->half.ttl;
+    }
+    // "No address" only if neither family has one.
+    if (ap->naddrs6 && ap->naddrs == 1 && ap->addrs[0] == INADDR_NONE)
+        ap->naddrs = 0;
+    if (qp->search)
+        return search_done(mp, qp, rp, ap);
+
+    void   *ctx = destroy_query(mp, qp, ap->naddrs ? ap->addrs[0] : 0);
+
+    return ctx == mp->refreshq ? NULL : ctx;
+}
+
+// A candidate of a search request has its answer, (*ap), from (rp).
+//  The request completes with the first candidate, in order, that has
+//  records, once every one before it has none; if none has any, with the
+//  answer for the name as given. Returns the request context then; else
+//  NULL.
+static void *
+search_done(MADNS * mp, QUERY * qp, RESPONSE const *rp, MADNS_ANSWER * ap)
+{
+    SEARCH *sp = qp->search;
+    CAND const *cp = &sp->cand[qp->nth];
+    int     i, nth = qp->nth, found = ap->nrecs || ap->naddrs6
+        || (ap->naddrs && ap->addrs[0] != INADDR_NONE);
+
+    destroy_query(mp, qp, ap->naddrs ? ap->addrs[0] : 0);
+    sp->q[nth] = NULL, sp->state[nth] = found ? 1 : -1;
+    sp->ans[nth] = *ap;
+    if (!found && nth == sp->asis)
+        sp->rcode = rp->rcode;
+    if (!found && sp->sent < sp->n)
+        search_send(mp, sp, sp->n);     // Order 1: now the search list.
+
+    for (i = 0; i < sp->n && sp->state[i] < 0; ++i);
+    if (i < sp->n && !sp->state[i]) {
+        // Wait for it. Record views last only till the next response,
+        //  so a winner-in-waiting keeps its own copy of them.
+        if (ap->nrecs) {
+            CACHE_INFO *own = rp->nrrs
+                ? rr_entry(rp, cp->name, cp->len, 0, 0) : NULL;
+
+            sp->own[nth] = own;
+            sp->ans[nth].nrecs = own ? own->nrecs : 0;
+            sp->ans[nth].recs = own ? cache_recs(own) : NULL;
+        }
+        return NULL;
+    }
+    if (i != nth) {             // An earlier answer, or none.
+        if (i == sp->n)
+            i = sp->asis;
+        mp->done.rcode = sp->state[i] > 0 ? 0 : sp->rcode;
+        mp->done.server = INADDR_ANY;
+        *ap = sp->ans[i];
+        if (sp->own[i] && cache_retire(mp, sp->own[i]))
+            sp->own[i] = NULL;  // Freed at the next madns_response.
+        else if (sp->own[i])
+            ap->nrecs = 0, ap->recs = NULL;
+    }
+    mp->done.latency = tick() - sp->started;
+
+    void   *ctx = sp->ctx;
+
+    for (i = 0; i < sp->n; ++i)
+        if ((qp = sp->q[i]))
+            qp->search = NULL, cancel_query(mp, qp);
+    search_free(mp, sp);
+    return ctx;
+}
+
+// A cleared SEARCH from the pool; NULL if all are in use.
+static SEARCH *
+search_take(MADNS * mp)
+{
+    SEARCH *sp = mp->freesearch;
+
+    if (sp) {
+        mp->freesearch = sp->next;
+        memset(sp, 0, offsetof(SEARCH, ans));
+    }
+    return sp;
+}
+
+// Return a search request to the pool, and free any records it kept.
+static void
+search_free(MADNS * mp, SEARCH * sp)
+{
+    int     i;
+
+    for (i = 0; i < sp->n; ++i)
+        free(sp->own[i]);
+    sp->n = 0, sp->next = mp->freesearch, mp->freesearch = sp;
+}
+
+// Destroy a query, and the other half of an A+AAAA request, and the
+//  queries for the other names of a search request.
+//  Returns 1 (one request cancelled).
+static int
+cancel_query(MADNS * mp, QUERY * qp)
+{
+    SEARCH *sp = qp->search;
+    QUERY  *twin = qp->twin;
+    int     i;
+
+    if (sp) {
+        for (i = 0; i < sp->n; ++i)
+            if ((qp = sp->q[i]))
+                qp->search = NULL, cancel_query(mp, qp);
+        return search_free(mp, sp), 1;
+    }
+    TRACE(mp, complete, qp, -2);
+    destroy_query(mp, qp, 0);
+    if (twin) {
+        TRACE(mp, complete, twin, -2);
+        destroy_query(mp, twin, 0);
+    }
+    return 1;
+}
+
+static void *
+destroy_query(MADNS * mp, QUERY * qp, in_addr_t logip)
 {
     void   *ret = qp->ctx;
     double  latency = tick() - qp->started;
 
-    qp->server->nreqs--;
-    qp->server->latency += (latency - qp->server->latency)
-        / mp->server_reqs / 2;
-    char    ips[99];
+    char    ips[99];
+
+    // No server: every server for its zone was busy, or was removed.
+    if (qp->server) {
+        qp->server->nreqs--;
+        qp->server->latency += (latency - qp->server->latency)
+            / mp->server_reqs / 2;
+        LOG("%s %s lat %.4f -> server %s %.4f reqs=%d\n", qp->name,
+            ipstr(logip, ips + 33), latency, ipstr(qp->server->ip, ips),
+            qp->server->latency, qp->server->nreqs);
+    }
+
+    ctxdrop(mp, qp);
+    qpull(&qp->link);
+    if (qp->stale_at)
+        qpull(&qp->slink);
+    if (qp->twin)
+        qp->twin->twin = NULL;
+    if (qp->conn)
+        qp->conn->nreqs--;
+    qp->ctx = NULL, qp->server = NULL, qp->tid = 0, qp->stale_at = 0;
+    qp->twin = NULL, qp->conn = NULL, qp->tcp = 0, qp->search = NULL;
+    qpush(&mp->unused, &qp->link);
+    mp->nfree++;
+
+    return ret;
+}
+
+// Fibonacci hash of a context ptr, to pick its MADNS.ctxv[] chain.
+static inline QUERY **
+ctxhead(MADNS const *mp, void const *ctx)
+{
+    uint64_t h = (uintptr_t) ctx * 0x9E3779B97F4A7C15ULL;
+
+    return &mp->ctxv[(h >> 32) & mp->ctxmask];
+}
+
+// Refresh queries, including those a stale answer has completed, all
+//  have the context mp->refreshq, so they are not indexed: there may be
+//  qsize/2 of them, on one chain, and no caller can cancel them.
+static void
+ctxadd(MADNS * mp, QUERY * qp)
+{
+    if (qp->ctx == mp->refreshq)
+        return;
+    qp->ctxnext = *ctxhead(mp, qp->ctx);
+    *ctxhead(mp, qp->ctx) = qp;
+}
+
+static void
+ctxdrop(MADNS * mp, QUERY * qp)
+{
+    if (qp->ctx == mp->refreshq)
+        return;
+
+    QUERY **pp = ctxhead(mp, qp->ctx);
+
+    while (*pp != qp)
+        pp = &(*pp)->ctxnext;
+    *pp = qp->ctxnext;
+}
+
+static inline HASH
+hashmix(HASH h, uint64_t lo, uint64_t hi)
+{
+    h = (h ^ lo) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 29) ^ hi) * 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+// Lowercase, validate and hash a host name in one pass over 16-byte blocks.
+//  (dst) gets the name with no trailing dot, zero-padded to a block boundary,
+//  so it needs DNS_NAME_BUF bytes. Equal names are then equal by memcmp.
+// Returns strlen(dst), or -1 if the name is empty, too long,
+//  or contains bytes outside '!'..'~'.
+static int
+normalize(char const *src, char *dst, HASH * hashp)
+{
+    int     len = strnlen(src, DNS_MAX_HOSTNAME + 2), i, bad = 0;
+
+    if (len && src[len - 1] == '.')
+        --len;
+    if (len < 1 || len > DNS_MAX_HOSTNAME)
+        return -1;
+
+    HASH    h = 0x6A09E667F3BCC908ULL ^ len;
+
+    for (i = 0; i < len; i += 16) {
+        int     n = MIN(16, len - i);
+#if defined(__SSE2__) && defined(__x86_64__)
+        __m128i v;
+
+        if (n == 16) {
+            v = _mm_loadu_si128((__m128i const *)(src + i));
+        } else {
+            char    tail[16] = { 0 };
+            memcpy(tail, src + i, n);
+            v = _mm_loadu_si128((__m128i const *)tail);
+        }
+
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+        v = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+        bad |= ~_mm_movemask_epi8(_mm_and_si128(
+                              _mm_cmpgt_epi8(v, _mm_set1_epi8(' ')),
+                              _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F))))
+            & ((1 << n) - 1);
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+        h = hashmix(h, _mm_cvtsi128_si64(v),
+                    _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+#else
+        uint64_t w[2] = { 0, 0 };
+        uint8_t *b = (uint8_t *) w;
+        int     j;
+
+        for (j = 0; j < n; ++j) {
+            uint8_t c = src[i + j];
+            b[j] = c + ((uint8_t) (c - 'A') < 26) * 0x20;
+            bad |= b[j] <= ' ' || b[j] >= 0x7F;
+        }
+        memcpy(dst + i, w, 16);
+        h = hashmix(h, w[0], w[1]);
+#endif
+    }
+
+    dst[len] = 0;
+    *hashp = h ^ (h >> 31);
+    return bad ? -1 : len;
+}
+
+static void
+log_(int line, const char *fmt, ...)
+{
+    fprintf(madns_log, "madns[%d]%8.4f ", line, tick() - start);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(madns_log, fmt, ap);
+}
+
+static void
+log_packet(int line, char const *pkt, int len)
+{
+    if (!madns_log)
+        return;
+    int     i;
+    char    buf[len * 3], *cp = buf;
+
+    for (i = 12; i < len; ++i)
+        cp +=
+            sprintf(cp, isgraph(pkt[i]) ? " %c" : " %02X", (uint8_t) pkt[i]);
+
+    DNS_RESP const *dp = (DNS_RESP const *)pkt;
+
+    log_(line, "UDP[%d]: tid=%hu flags=%hX nquer=%hu"
+         " nansw=%hu nauth=%hu noth=%hu [%s ]\n",
+         len, dp->tid, ntohs(dp->flags), ntohs(dp->nqueries),
+         ntohs(dp->nanswers), ntohs(dp->nauth), ntohs(dp->nother), buf);
+}
+
+//--------------|---------------------------------------------
+// Zero-copy DNS message parser. Names and rdata are left in the packet;
+//  every read is bounds-checked against the end of the packet.
+
+static inline unsigned
+get16(uint8_t const *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static inline uint32_t
+get32(uint8_t const *p)
+{
+    return (uint32_t) get16(p) << 16 | get16(p + 2);
+}
+
+static inline uint8_t
+lc(uint8_t c)
+{
+    return c + ((uint8_t) (c - 'A') < 26) * 0x20;
+}
+
+// Skip a name in place, without following compression pointers.
+// Returns NULL if it runs off the end or uses an obsolete label type.
+static uint8_t const *
+dns_skipname(uint8_t const *p, uint8_t const *end)
+{
+    while (p < end) {
+        if (!*p)
+            return p + 1;
+        if ((*p & 0xC0) == 0xC0)
+            return p + 2 <= end ? p + 2 : NULL;
+        if (*p & 0xC0)
+            return NULL;
+        p += *p + 1;
+    }
+
+    return NULL;
+}
+
+// Follow compression pointers from (p) to a real label, which must
+//  fit in the packet. Pointers must point backwards, so every chain ends.
+static uint8_t const *
+dns_label(DNS_MSG const *msg, uint8_t const *p)
+{
+    while (p + 1 < msg->end && (*p & 0xC0) == 0xC0) {
+        unsigned off = (p[0] & 0x3F) << 8 | p[1];
+
+        if (off >= (unsigned)(p - msg->pkt))
+            return NULL;
+        p = msg->pkt + off;
+    }
+
+    return p < msg->end && !(*p & 0xC0) && p + 1 + *p <= msg->end ? p : NULL;
+}
+
+// Compare two (possibly compressed) names in the message, ignoring case.
+static int
+dns_nameeq(DNS_MSG const *msg, uint8_t const *a, uint8_t const *b)
+{
+    int     i, len = 0;
+
+    while ((a = dns_label(msg, a)) && (b = dns_label(msg, b)) && *a == *b) {
+        if (!*a)
+            return 1;
+        if ((len += *a + 1) > DNS_MAX_HOSTNAME)
+            return 0;
+        for (i = *a; i > 0; --i)
+            if (lc(a[i]) != lc(b[i]))
+                return 0;
+        a += *a + 1, b += *b + 1;
+    }
+
+    return 0;
+}
+
+// Decode a (possibly compressed) name into (dst) as lowercase "a.b.c".
+//  (dst) needs DNS_NAME_BUF bytes. Returns its length, or -1 if malformed.
+static int
+dns_getname(DNS_MSG const *msg, uint8_t const *p, char *dst)
+{
+    int     i, len = 0;
+
+    while ((p = dns_label(msg, p)) && *p) {
+        if (len + !!len + *p > DNS_MAX_HOSTNAME)
+            return -1;
+        if (len)
+            dst[len++] = '.';
+        for (i = 1; i <= *p; ++i)
+            dst[len++] = lc(p[i]);
+        p += *p + 1;
+    }
+
+    dst[len] = 0;
+    return p ? len : -1;
+}
+
+// Check the header and question, and position at the first answer.
+// Returns 0 if the message is not a single-question response.
+static int
+dns_open(DNS_MSG * msg, uint8_t const *pkt, int len)
+{
+    int     i;
+
+    if (len < 12)
+        return 0;
+
+    *msg = (DNS_MSG) {.pkt = pkt,.end = pkt + len,.qname = pkt + 12};
+    memcpy(&msg->tid, pkt, sizeof msg->tid);
+    msg->flags = get16(pkt + 2);
+    for (i = DNS_QD; i <= DNS_AR; ++i)
+        msg->count[i] = get16(pkt + 4 + 2 * i);
+    if (!(msg->flags & 0x8000) || msg->count[DNS_QD] != 1)
+        return 0;
+
+    uint8_t const *p = dns_skipname(msg->qname, msg->end);
+
+    if (!p || p + 4 > msg->end || *msg->qname >= 0xC0)
+        return 0;
+    msg->qlen = p - msg->qname;
+    msg->qtype = get16(p);
+    msg->qclass = get16(p + 2);
+    msg->rrs = p + 4;
+    dns_rewind(msg);
+    return 1;
+}
+
+static void
+dns_rewind(DNS_MSG * msg)
+{
+    msg->next = msg->rrs;
+    msg->section = DNS_AN;
+    msg->left = msg->count[DNS_AN];
+}
+
+// Step through the answer, authority and additional records in order.
+// Returns 1 and sets (*rr); 0 at the end; -1 if the rest is malformed.
+static int
+dns_next(DNS_MSG * msg, DNS_RR * rr)
+{
+    while (!msg->left) {
+        if (msg->section == DNS_AR)
+            return 0;
+        msg->left = msg->count[++msg->section];
+    }
+
+    uint8_t const *p = dns_skipname(msg->next, msg->end);
+
+    if (!p || p + 10 > msg->end || p + 10 + get16(p + 8) > msg->end) {
+        msg->section = DNS_AR, msg->left = 0;
+        return -1;
+    }
+
+    uint32_t ttl = get32(p + 4);
+
+    *rr = (DNS_RR) {
+    msg->next, p + 10, get16(p), get16(p + 2), get16(p + 8),
+            ttl & 0x80000000 ? 0 : ttl, msg->section};
+    msg->next = rr->rdata + rr->rdlen;
+    msg->left--;
+    return 1;
+}
+
+// RFC 2308: a negative answer is cached for the lesser of the TTL
+//  and the MINIMUM field of the SOA record in the authority section.
+// Returns -1 if there is no SOA; such answers must not be cached.
+//  Sets (*soa) to the SOA record, if there is one.
+static time_t
+soa_ttl(DNS_MSG * msg, DNS_RR * soa)
+{
+    DNS_RR  rr;
+
+    for (dns_rewind(msg); dns_next(msg, &rr) > 0;) {
+        if (rr.section != DNS_NS || rr.type != DNS_SOA)
+            continue;
+
+        uint8_t const *end = rr.rdata + rr.rdlen;
+        uint8_t const *p = dns_skipname(rr.rdata, end);    // MNAME
+
+        if (p && (p = dns_skipname(p, end)) && p + 20 <= end) // RNAME
+            return *soa = rr, MIN(rr.ttl, get32(p + 16));
+    }
+
+    return -1;
+}
+
+// Find the records of the query type for the query name, following any
+//  CNAME chain. A and AAAA records are copied out; others are left as views.
+// Returns 0 if this is not a well-formed response to an IN query.
+static int
+parse_response(char const *pkt, int len, RESPONSE * rp)
+{
+    DNS_MSG *msg = &rp->msg;
+    DNS_RR  rr;
+    int     ret = 0, hops, *np;
+
+    rp->naddrs = rp->naddrs6 = rp->nrrs = 0, rp->ttl = 0;
+    rp->soa.name = NULL;
+    log_packet(__LINE__, pkt, len);
+
+    if (!dns_open(msg, (uint8_t const *)pkt, len) || msg->qclass != DNS_C_IN)
+        return 0;
+    rp->qtype = msg->qtype;
+    np = rp->qtype == DNS_A_RECORD ? &rp->naddrs
+        : rp->qtype == DNS_AAAA ? &rp->naddrs6 : &rp->nrrs;
+    rp->tid = msg->tid;
+    rp->rcode = msg->flags & 0x000F;
+
+    // Chains are normally in order, and resolve in one pass.
+    //  An NXDOMAIN answer may still hold the chain to the missing name.
+    uint8_t const *target = msg->qname, *prev = NULL;
+
+    rp->nchain = 0;
+    rp->chain[0].name = target;
+    rp->chain[0].ttl = 0;
+    for (hops = 0; target != prev && !*np && hops < DNS_MAX_CHAIN; ++hops) {
+        prev = target;
+        for (dns_rewind(msg); (ret = dns_next(msg, &rr)) > 0
+             && rr.section == DNS_AN;) {
+            if (rr.class != DNS_C_IN || !dns_nameeq(msg, rr.name, target))
+                continue;
+            if (rr.type == DNS_CNAME && rp->qtype != DNS_CNAME
+                && rp->nchain < DNS_MAX_CHAIN) {
+                rp->chain[rp->nchain++].ttl = rr.ttl;
+                rp->chain[rp->nchain].name = target = rr.rdata;
+                rp->chain[rp->nchain].ttl = 0;
+            } else if (rr.type == rp->qtype && *np < MADNS_MAX_ADDRS) {
+                if (rr.type == DNS_A_RECORD && rr.rdlen == 4)
+                    memcpy(&rp->addrs[*np], rr.rdata, 4);
+                else if (rr.type == DNS_AAAA && rr.rdlen == 16)
+                    memcpy(&rp->addrs6[*np], rr.rdata, 16);
+                else if (np == &rp->nrrs)
+                    rp->rrs[*np] = rr;
+                else
+                    continue;
+                if (!(*np)++ || rp->chain[rp->nchain].ttl > rr.ttl)
+                    rp->chain[rp->nchain].ttl = rr.ttl;
+            }
+        }
+        if (ret < 0)
+            return log_packet(__LINE__, pkt, len), 0;
+    }
+
+    // NXDOMAIN, or NOERROR with no address (NODATA): "no address",
+    //  cached for the SOA negative TTL. Without an SOA, the answer is
+    //  returned but not cached.
+    if (!*np && (rp->rcode == DNS_R_NXDOMAIN || rp->rcode == 0)) {
+        time_t  ttl = soa_ttl(msg, &rp->soa);
+
+        if (ttl < 0 && rp->rcode != DNS_R_NXDOMAIN)
+            return 1;           // Referral or lame answer: try another server?
+        rp->addrs[rp->naddrs++] = INADDR_NONE;
+        rp->chain[rp->nchain].ttl = MAX(ttl, 0);
+    }
+
+    // The query name's answer lasts only as long as every link.
+    for (hops = 0, rp->ttl = rp->chain[rp->nchain].ttl; hops < rp->nchain;
+         ++hops)
+        rp->ttl = MIN(rp->ttl, rp->chain[hops].ttl);
+
+    return 1;
+}
+
+// Encode the request packet once; retries resend it unchanged.
+//  (edns) is the UDP payload size to advertise, or 0 for no OPT record.
+static int
+encode_request(QUERY * qp, int edns)
+{
+    DNS_RESP *header = (DNS_RESP *) qp->pkt;
+
+    header->tid = qp->tid;
+    header->flags = ntohs(0x0100);  // Recursive query.
+    header->nqueries = ntohs(1);
+    header->nanswers = 0;
+    header->nauth = 0;
+    header->nother = ntohs(!!edns);
+
+    // Encode "mail.google.com" as \4mail\6google\3com\0
+    char   *p = header->data, *dst = p + 1;
+    char const *src;
+
+    for (src = qp->name; *src; ++src, ++dst) {
+        if (*src != '.')
+            *dst = *src;        // Already lowercase.
+        else if (dst - p - 1 > NS_MAXLABEL || dst == p + 1)
+            return 0;           // Unencodable domain name; expiry=0.
+        else
+            *p = dst - p - 1, p = dst;
+    }
+
+    if (dst - p - 1 > NS_MAXLABEL || dst == p + 1)
+        return 0;
+    *p = dst - p - 1, p = dst;
+    *p++ = 0;                   // Mark end of host name
+    *p++ = qp->qtype >> 8;      // Query Type: (ns_t_a) or (ns_t_aaaa)
+    *p++ = qp->qtype;
+    *p++ = 0;
+    *p++ = 1;                   // Class: inet aka (ns_c_in)
+    if (edns) {                 // OPT: root name, type, payload size as class;
+        *p++ = 0;               //  extended rcode, version, flags and rdlen 0.
+        *p++ = DNS_OPT >> 8;
+        *p++ = DNS_OPT;
+        *p++ = edns >> 8;
+        *p++ = edns;
+        memset(p, 0, 6), p += 6;
+    }
+    return p - qp->pkt;
+}
+
+static void
+send_request(MADNS * mp, QUERY * qp)
+{
+    SERVER *prev = qp->server, *best = NULL;
+    ROUTE const *rp = &mp->routes[qp->route];
+    char    ips[99];
+
+    // Choose the lowest-latency server for the name's zone; or, with
+    //  "options rotate", the next in turn. A retry goes to another server,
+    //  or back to the same one if there is no other.
+    int     i, first = mp->rotate_servers && rp->nservs
+        ? mp->turn++ % rp->nservs : 0;
+
+    for (i = 0; i < rp->nservs; ++i) {
+        SERVER *sp = &mp->serv[rp->servs[(first + i) % rp->nservs]];
+
+        if (sp != prev && sp->nreqs < mp->server_reqs
+            && (!best || sp->latency < best->latency)) {
+            best = sp;
+            if (mp->rotate_servers)
+                break;
+        }
+    }
+    if (!best && !(best = prev))
+        return;
+
+    if (prev)
+        prev->nreqs--;
+    qp->server = best;
+    qp->server->nreqs++;
+
+    if (!qp->pktlen)
+        return;                 // Unencodable domain name; expiry=0.
+
+    transmit(mp, qp, mp->tcp_only);
+    LOG("%s tid=%d to %s reqs %d%s\n", qp->name, qp->tid,
+        ipstr(qp->server->ip, ips), qp->server->nreqs,
+        qp->tcp ? " (tcp)" : "");
+}
+
+// Send (qp) to its server, over TCP or UDP, and count the send.
+static void
+transmit(MADNS * mp, QUERY * qp, int tcp)
+{
+    qp->sent = tick();
+    mp->stats->c.sends++;
+    qp->server->stats->sends++;
+    if (tcp)
+        tcp_send(mp, qp);
+    else
+        udp_send(mp, qp);
+}
+
+// An unanswered query with tries left goes out again, for another
+//  query_time. Returns 0 if it could not be sent, to expire now.
+static int
+retry_query(MADNS * mp, QUERY * qp)
+{
+    qp->tries--;
+    mp->stats->c.retries++;
+    TRACE(mp, retry, qp, qp->tries);
+    if (qp->conn)
+        qp->conn->nreqs--;
+    qp->conn = NULL, qp->tcp = 0, qp->expires = 0;
+    send_request(mp, qp);
+    if (!qp->expires)
+        return 0;
+    qpull(&qp->link);
+    qpush(&mp->active, &qp->link);  // Still in order of expiry.
+    return 1;
+}
+
+static void
+udp_send(MADNS * mp, QUERY * qp)
+{
+    INADDR  addr = { /*FAMILY*/ AF_INET, /*PORT*/ htons(NS_DEFAULTPORT),
+         /*INADDR*/ {qp->server->ip}, /*ZERO*/ {}
+    };
+    TRACE(mp, send, qp, 0);
+    if (mp->uring && uring_send(mp, qp, &addr))
+        return;
+    if (qp->pktlen == sendto(mp->sock, qp->pkt, qp->pktlen, 0,
+                             (SADDR *) & addr, sizeof addr)
+        && !qp->expires)
+        qp->expires = time(0) + mp->query_time;
+}
+
+//--------------|---------------------------------------------
+// Split-horizon routing: "server=/corp.example/10.99.112.1" sends names
+//  in corp.example (and below) only to 10.99.112.1; other names go to the
+//  "nameserver" servers. The longest matching zone wins. Zones are found
+//  in one right-to-left pass over the name, hashing as it goes, and
+//  probing routev at each label boundary.
+
+#define ROUTE_SEED  0xCBF29CE484222325ULL   // FNV-1a, 64-bit.
+#define ROUTE_PRIME 0x100000001B3ULL
+
+// Hash a (normalized) name from its last byte back.
+static HASH
+route_hash(char const *name, int len)
+{
+    HASH    h = ROUTE_SEED;
+
+    while (len-- > 0)
+        h = (h ^ (uint8_t) name[len]) * ROUTE_PRIME;
+    return h;
+}
+
+// Add (ip) to the servers of (zone); "" is the default route.
+static void
+add_route(MADNS * mp, char const *zone, in_addr_t ip)
+{
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+    int     i, r, len = *zone ? normalize(zone, key, &hash) : 0;
+
+    if (ip == INADDR_NONE || len < 0)
+        return;
+
+    for (r = 0; r < mp->nroutes; ++r)
+        if (mp->routes[r].len == len && !memcmp(mp->routes[r].zone, key, len))
+            break;
+    if (r == mp->nroutes) {
+        ROUTE  *rp = r < 0xFFFF
+            ? realloc(mp->routes, (r + 1) * sizeof *rp) : NULL;
+
+        if (!rp)
+            return;
+        mp->routes = rp, rp += r, mp->nroutes++;
+        *rp = (ROUTE) {.hash = route_hash(key, len),.len = len};
+        memcpy(rp->zone, key, len + 1);
+    }
+
+    for (i = 0; i < mp->nservs && mp->serv[i].ip != ip; ++i);
+    if (i == mp->nservs)
+        mp->serv[mp->nservs++] = (SERVER) {.ip = ip};
+
+    ROUTE  *rp = &mp->routes[r];
+    int     j, *servs;
+
+    for (j = 0; j < rp->nservs && rp->servs[j] != i; ++j);
+    if (j == rp->nservs
+        && (servs = realloc(rp->servs, (j + 1) * sizeof *servs)))
+        rp->servs = servs, rp->servs[rp->nservs++] = i;
+}
+
+// "server=/zone/.../ip": (spec) is what follows "server=/".
+static void
+parse_server(MADNS * mp, char *spec)
+{
+    char   *last = strrchr(spec, '/'), *ip, *zone;
+
+    if (!last || !(ip = strtok(last + 1, " \t\r\n")))
+        return;
+    *last = 0;
+    for (zone = strtok(spec, "/"); zone; zone = strtok(NULL, "/"))
+        add_route(mp, zone, inet_addr(ip));
+}
+
+// Index routes[1..] by zone hash. Returns 0 if out of memory.
+static int
+route_index(MADNS * mp)
+{
+    int     r, i;
+
+    for (mp->routemask = 1; mp->routemask < 2 * mp->nroutes;)
+        mp->routemask = mp->routemask * 2 + 1;
+    if (!(mp->routev = calloc(mp->routemask + 1, sizeof *mp->routev)))
+        return 0;
+
+    for (r = 1; r < mp->nroutes; ++r) {
+        for (i = mp->routes[r].hash & mp->routemask; mp->routev[i];
+             i = (i + 1) & mp->routemask);
+        mp->routev[i] = r;
+    }
+    return 1;
+}
+
+// The route of the longest zone that (name) is in or under; else 0.
+static int
+route_of(MADNS const *mp, char const *name, int len)
+{
+    HASH    h = ROUTE_SEED;
+    int     i, j, r, best = 0;
+
+    for (i = len; i-- > 0;) {
+        h = (h ^ (uint8_t) name[i]) * ROUTE_PRIME;
+        if (i && name[i - 1] != '.')
+            continue;
+        for (j = h & mp->routemask; (r = mp->routev[j]);
+             j = (j + 1) & mp->routemask)
+            if (mp->routes[r].hash == h && mp->routes[r].len == len - i
+                && !memcmp(mp->routes[r].zone, name + i, len - i)) {
+                best = r;
+                break;
+            }
+    }
+    return best;
+}
+
+// "search a.example b.example", or "domain a.example": the last such
+//  line wins, as in glibc.
+static void
+parse_search(MADNS * mp, char *spec)
+{
+    char   *tok, *save;
+    HASH    hash;
+
+    if (*spec != ' ' && *spec != '\t')
+        return;
+    for (mp->nsearch = 0; mp->nsearch < MAX_SEARCH
+         && (tok = strtok_r(spec, " \t\r\n", &save)); spec = NULL)
+        mp->nsearch += normalize(tok, mp->search[mp->nsearch], &hash) > 0;
+}
+
+// "options ndots:n timeout:n attempts:n rotate"; others are ignored.
+static void
+parse_options(MADNS * mp, char *spec)
+{
+    char   *tok, *save;
+    int     n;
+
+    for (; (tok = strtok_r(spec, " \t\r\n", &save)); spec = NULL)
+        if (sscanf(tok, "ndots:%d", &n) == 1)
+            mp->ndots = MIN(MAX(n, 0), 15);
+        else if (sscanf(tok, "timeout:%d", &n) == 1)
+            mp->timeout = MIN(MAX(n, 1), 30);
+        else if (sscanf(tok, "attempts:%d", &n) == 1)
+            mp->attempts = MIN(MAX(n, 1), 5);
+        else if (!strcmp(tok, "rotate"))
+            mp->rotate_servers = 1;
+}
+
+// Does the search list apply to (name), and in which order?
+//  0: no (no search list, or an absolute name, ending in '.');
+//  1: the name as given first, then under each search domain, as it has
+//  at least (ndots) dots; 2: under each search domain, then as given.
+static int
+search_order(MADNS const *mp, char const *name)
+{
+    char const *cp;
+    int     dots = 0;
+
+    if (!mp->nsearch || !*name)
+        return 0;
+    for (cp = name; *cp; ++cp)
+        dots += *cp == '.';
+    return cp[-1] == '.' ? 0 : dots >= mp->ndots ? 1 : 2;
+}
+
+// Candidate (i), 0..nsearch, of (order) for a normalized name: the name
+//  as given, or it under a search domain.
+// Returns its length, or -1 if too long.
+static int
+search_cand(MADNS const *mp, int order, char const *key, int len, HASH hash,
+            int i, CAND * cp)
+{
+    char    buf[2 * DNS_NAME_BUF + 2];
+    int     s = order == 1 ? i - 1 : i;
+
+    if (s < 0 || s == mp->nsearch) {
+        memcpy(cp->name, key, len + 1);
+        return cp->hash = hash, cp->len = len;
+    }
+    snprintf(buf, sizeof buf, "%s.%s", key, mp->search[s]);
+    return cp->len = normalize(buf, cp->name, &cp->hash);
+}
+
+// Read "nameserver" and "server=" lines into mp->serv and mp->routes,
+//  which must be empty, and the search list and options.
+//  Returns 0 if there are no servers.
+static int
+load_conf(MADNS * mp, char const *path)
+{
+    FILE   *fp = fopen(path, "r");
+    char    line[512];
+
+    mp->routes = calloc(mp->nroutes = 1, sizeof *mp->routes);
+    mp->ndots = mp->attempts = 1;
+
+    // File size bounds the number of servers.
+    if (fp && mp->routes && !fseek(fp, 0L, SEEK_END)
+        && (mp->serv = malloc(sizeof *mp->serv * (ftell(fp) + 1)))) {
+        for (rewind(fp); fgets(line, sizeof line, fp);)
+            if (1 == sscanf(line, "nameserver %s", line))
+                add_route(mp, "", inet_addr(line));
+            else if (!strncmp(line, "server=/", 8))
+                parse_server(mp, line + 8);
+            else if (!strncmp(line, "search", 6) || !strncmp(line, "domain", 6))
+                parse_search(mp, line + 6);
+            else if (!strncmp(line, "options", 7))
+                parse_options(mp, line + 7);
+    }
+    if (fp)
+        fclose(fp);
+
+    SERVER *serv = mp->nservs
+        ? realloc(mp->serv, mp->nservs * sizeof *serv) : NULL;
+    int     i;
+
+    if (serv)
+        mp->serv = serv;
+    for (i = 0; serv && i < mp->nservs; ++i)
+        if (!(serv[i].stats = calloc(1, sizeof *serv[i].stats)))
+            serv = NULL;
+    return serv && route_index(mp);
+}
+
+// Free (serv) and the stats of each.
+static void
+free_servers(SERVER * serv, int nservs)
+{
+    while (nservs > 0)
+        free(serv[--nservs].stats);
+    free(serv);
+}
+
+//--------------|---------------------------------------------
+// Reload: swap in the servers and routes of a new resolv.conf, keeping
+//  the cache and every query. A server that remains keeps its latency,
+//  its TCP connections and its queries; queries on a removed server are
+//  sent again to a server of their (new) route.
+
+int
+madns_reload(MADNS * mp, char const *path)
+{
+    MADNS   new = {.nservs = 0 };
+    char   *conf = path ? strdup(path) : mp->conf;
+    int     i, j, k, *moved = calloc(mp->nservs, sizeof *moved);
+    TCPCONN *tcp = NULL;
+    QLINK  *lp;
+
+    if (!conf || !moved || !load_conf(&new, conf)
+        || !(tcp = calloc(new.nservs * MADNS_TCP_MAXCONNS, sizeof *tcp))) {
+        if (conf != mp->conf)
+            free(conf);
+        for (i = 0; new.routes && i < new.nroutes; ++i)
+            free(new.routes[i].servs);
+        free(new.routes), free(new.routev), free(moved);
+        free_servers(new.serv, new.nservs);
+        return -1;
+    }
+
+    for (j = 0; j < new.nservs * MADNS_TCP_MAXCONNS; ++j)
+        tcp[j].fd = -1, tcp[j].server = &new.serv[j / MADNS_TCP_MAXCONNS];
+
+    // moved[i]: the new index of mp->serv[i], or -1.
+    for (i = 0; i < mp->nservs; ++i) {
+        for (j = 0; j < new.nservs && new.serv[j].ip != mp->serv[i].ip; ++j);
+        moved[i] = j < new.nservs ? j : -1;
+        for (k = 0; k < MADNS_TCP_MAXCONNS; ++k) {
+            TCPCONN *cp = &mp->tcp[i * MADNS_TCP_MAXCONNS + k];
+
+            if (moved[i] < 0) {
+                if (cp->fd != -1)
+                    (void)close(cp->fd);
+                free(cp->obuf), free(cp->ibuf);
+            } else {
+                tcp[j * MADNS_TCP_MAXCONNS + k] = *cp;
+                tcp[j * MADNS_TCP_MAXCONNS + k].server = &new.serv[j];
+            }
+        }
+        if (moved[i] >= 0) {
+            SERVSTATS *stats = new.serv[j].stats;
+
+            new.serv[j].latency = mp->serv[i].latency;
+            new.serv[j].stats = mp->serv[i].stats, mp->serv[i].stats = stats;
+        }
+    }
+
+    for (lp = mp->active.next; lp != &mp->active; lp = lp->next) {
+        QUERY  *qp = link_QUERY(lp);
+        int     conn = qp->conn ? qp->conn - mp->tcp : -1;
+
+        qp->route = new.nroutes > 1 ? route_of(&new, qp->name, qp->len) : 0;
+        if (!qp->server)
+            continue;
+        if ((j = moved[qp->server - mp->serv]) < 0) {
+            qp->server = NULL, qp->conn = NULL, qp->tcp = 0;
+            continue;
+        }
+        qp->server = &new.serv[j];
+        qp->server->nreqs++;
+        if (conn >= 0)
+            qp->conn = &tcp[j * MADNS_TCP_MAXCONNS + conn % MADNS_TCP_MAXCONNS];
+    }
+
+    for (i = 0; i < mp->nroutes; ++i)
+        free(mp->routes[i].servs);
+    free(mp->routes), free(mp->routev), free(mp->tcp);
+    free_servers(mp->serv, mp->nservs);
+    free(moved);
+    if (conf != mp->conf) {
+        int     newpath = strcmp(conf, mp->conf);
+
+        free(mp->conf), mp->conf = conf;
+        if (newpath && mp->watch != -1 && !watch_conf(mp, 1))
+            LOG("cannot watch %s\n", mp->conf);
+    }
+    mp->serv = new.serv, mp->nservs = new.nservs, mp->tcp = tcp;
+    mp->routes = new.routes, mp->nroutes = new.nroutes;
+    mp->routev = new.routev, mp->routemask = new.routemask;
+    mp->nsearch = new.nsearch, mp->ndots = new.ndots;
+    memcpy(mp->search, new.search, sizeof mp->search);
+    mp->attempts = new.attempts, mp->rotate_servers = new.rotate_servers;
+
+    // Orphans go out again; send_request leaves a query with no server
+    //  if its route's servers are all busy, and then it expires.
+    for (lp = mp->active.next; lp != &mp->active; lp = lp->next)
+        if (!link_QUERY(lp)->server)
+            send_request(mp, link_QUERY(lp));
+
+    LOG("reloaded %s: %d servers, %d routes\n", mp->conf, mp->nservs,
+        mp->nroutes - 1);
+    return mp->nservs;
+}
+
+// MADNS_WATCH: inotify on the directory of mp->conf, since resolv.conf
+//  is often replaced by a rename rather than rewritten.
+#ifdef __linux__
+
+static int
+watch_conf(MADNS * mp, int on)
+{
+    if (mp->watch != -1)
+        (void)close(mp->watch), mp->watch = -1;
+    if (!on)
+        return 1;
+
+    char    dir[PATH_MAX];
+    char const *slash = strrchr(mp->conf, '/');
+
+    snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - mp->conf) + 1 : 1,
+             slash ? mp->conf : ".");
+    mp->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mp->watch != -1
+        && inotify_add_watch(mp->watch, dir, IN_CLOSE_WRITE | IN_MOVED_TO
+                             | IN_CREATE) == -1)
+        (void)close(mp->watch), mp->watch = -1;
+    return mp->watch != -1;
+}
+
+// Reload if mp->conf has been written or replaced.
+static void
+watch_check(MADNS * mp)
+{
+    char    buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char const *slash = strrchr(mp->conf, '/');
+    char const *base = slash ? slash + 1 : mp->conf;
+    int     n, changed = 0;
+
+    while ((n = read(mp->watch, buf, sizeof buf)) > 0) {
+        char   *p;
+
+        for (p = buf; p < buf + n;) {
+            struct inotify_event const *ev = (void const *)p;
+
+            changed |= ev->len && !strcmp(ev->name, base);
+            p += sizeof *ev + ev->len;
+        }
+    }
+    if (changed && madns_reload(mp, NULL) < 0)
+        LOG("reload %s failed; keeping the old servers\n", mp->conf);
+}
+
+#else // !__linux__: MADNS_WATCH is refused.
+
+static int watch_conf(MADNS * mp, int on) { (void)mp; return !on; }
+static void watch_check(MADNS * mp) { (void)mp; }
+
+#endif
+
+//--------------|---------------------------------------------
+// TCP transport: a few connections per server, each carrying any number
+//  of queries at once; for truncated answers, or every query (MADNS_TCP).
+//  Everything is non-blocking; writes that would block wait in obuf for
+//  the next madns_response (see madns_pollfds).
+
+static int
+tcp_open(TCPCONN * cp)
+{
+    INADDR  addr = { AF_INET, htons(NS_DEFAULTPORT), {cp->server->ip}, {} };
+    int     on = 1;
+    char    ips[99];
+
+    if (!cp->ibuf && !(cp->ibuf = malloc(2 + DNS_TCP_LEN)))
+        return 0;
+    if ((cp->fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+        return 0;
+
+    fcntl(cp->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(cp->fd, F_SETFL, O_NONBLOCK | fcntl(cp->fd, F_GETFL, 0));
+    setsockopt(cp->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof on);
+    if (connect(cp->fd, (SADDR *) & addr, sizeof addr) && errno != EINPROGRESS) {
+        (void)close(cp->fd);
+        return cp->fd = -1, 0;
+    }
+
+    cp->nreqs = cp->answered = cp->olen = cp->ioff = cp->ilen = 0;
+    LOG("tcp fd=%d to %s\n", cp->fd, ipstr(cp->server->ip, ips));
+    return 1;
+}
+
+// Send a query on the least-loaded connection to its server,
+//  opening another one if those are busy. If there is none, the
+//  query expires as usual.
+static void
+tcp_send(MADNS * mp, QUERY * qp)
+{
+    TCPCONN *cp = &mp->tcp[(qp->server - mp->serv) * MADNS_TCP_MAXCONNS];
+    TCPCONN *best = NULL, *closed = NULL;
+    int     i;
+
+    for (i = 0; i < mp->tcp_conns; ++i, ++cp)
+        if (cp->fd == -1)
+            closed = closed ? closed : cp;
+        else if (!best || cp->nreqs < best->nreqs)
+            best = cp;
+    if (closed && (!best || best->nreqs >= TCP_PIPELINE) && tcp_open(closed))
+        best = closed;
+    if (!best || !qp->pktlen)
+        return;
+
+    if (best->olen + 2 + qp->pktlen > best->osize) {
+        int     size = MAX(2 * best->osize, best->olen + 2 + qp->pktlen);
+        char   *obuf = realloc(best->obuf, size);
+
+        if (!obuf)
+            return;
+        best->obuf = obuf, best->osize = size;
+    }
+
+    best->obuf[best->olen++] = qp->pktlen >> 8;
+    best->obuf[best->olen++] = qp->pktlen;
+    memcpy(best->obuf + best->olen, qp->pkt, qp->pktlen);
+    best->olen += qp->pktlen;
+    best->nreqs++;
+    qp->tcp = 1, qp->conn = best;
+    TRACE(mp, send, qp, 1);
+    if (!qp->expires)
+        qp->expires = time(0) + mp->query_time;
+    tcp_flush(mp, best);
+}
+
+static void
+tcp_flush(MADNS * mp, TCPCONN * cp)
+{
+    while (cp->olen) {
+        int     n = send(cp->fd, cp->obuf, cp->olen, MSG_NOSIGNAL);
+
+        if (n > 0) {
+            memmove(cp->obuf, cp->obuf + n, cp->olen - n);
+            cp->olen -= n;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            tcp_close(mp, cp);  // Includes "connection refused".
+            return;
+        } else {
+            return;             // Connecting, or the socket buffer is full.
+        }
+    }
+}
+
+// A server may close a connection at any time (RFC 7766 6.2.4).
+//  If it ever answered, its unanswered queries are sent again;
+//  otherwise they are left to expire.
+static void
+tcp_close(MADNS * mp, TCPCONN * cp)
+{
+    QLINK  *lp;
+    QUERY  *qp, *next, *list = NULL, **end = &list;
+    int     resend = cp->answered;
+
+    LOG("tcp fd=%d closed: reqs %d answered %d\n", cp->fd, cp->nreqs,
+        cp->answered);
+    (void)close(cp->fd);
+    cp->fd = -1, cp->nreqs = cp->answered = cp->olen = cp->ioff = cp->ilen = 0;
+
+    // Its queries go again on another connection (or this one, reopened)
+    //  if it was answering. Any not sent expire now, to be retried or
+    //  failed, rather than wait out query_time. They are listed first:
+    //  a send can close another connection, which reorders mp->active.
+    for (lp = mp->active.next; lp != &mp->active; lp = lp->next)
+        if ((qp = link_QUERY(lp))->conn == cp)
+            qp->conn = NULL, *end = qp, end = &qp->resend;
+    *end = NULL;
+
+    for (qp = list; qp; qp = next) {
+        next = qp->resend;      // A send may list (qp) anew.
+        if (resend)
+            transmit(mp, qp, 1);
+        if (!qp->conn) {
+            qp->expires = 0;
+            qpull(&qp->link), qpush(mp->active.next, &qp->link);
+        }
+    }
+}
+
+// Write what is pending, then read and handle whole messages.
+static void *
+tcp_receive(MADNS * mp, MADNS_ANSWER * ap)
+{
+    TCPCONN *cp, *end = mp->tcp + mp->nservs * MADNS_TCP_MAXCONNS;
+    void   *ctx;
+
+    for (cp = mp->tcp; cp < end; ++cp) {
+        if (cp->fd != -1 && cp->olen)
+            tcp_flush(mp, cp);
+
+        while (cp->fd != -1) {
+            uint8_t *p = cp->ibuf + cp->ioff;
+            int     n, avail = cp->ilen - cp->ioff;
+
+            if (avail >= 2 && avail >= 2 + (n = get16(p))) {
+                cp->ioff += 2 + n;
+                if ((ctx = receive(mp, (char *)p + 2, n, cp->server->ip, cp, ap)))
+                    return ctx;
+                continue;
+            }
+
+            if (cp->ioff)
+                memmove(cp->ibuf, p, avail), cp->ilen = avail, cp->ioff = 0;
+            n = recv(cp->fd, cp->ibuf + cp->ilen, 2 + DNS_TCP_LEN - cp->ilen, 0);
+            if (n > 0)
+                cp->ilen += n;
+            else if (!n || (errno != EAGAIN && errno != EINTR))
+                tcp_close(mp, cp);
+            else
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+//--------------|---------------------------------------------
+// io_uring backend (MADNS_URING), driven by raw syscalls.
+//  One multishot recvmsg takes every UDP answer into a ring of kernel-
+//  selected buffers, so draining needs no syscall per packet. Sends are
+//  queued as sendmsg entries of the encoded request packets, and go to the
+//  kernel in one io_uring_enter at the next madns_expires or madns_response.
+//  Completions signal an eventfd, which madns_fileno returns. A send that
+//  cannot be queued (the SQ is full, or the slot's last sendmsg has not
+//  completed) goes out by sendto instead.
+#ifdef URING
+
+#define URING_ENTRIES   256
+#define URING_NBUFS     128     // Must be a power of 2.
+#define URING_BUFLEN    (sizeof(struct io_uring_recvmsg_out) + sizeof(INADDR) \
+                         + DNS_PACKET_LEN)
+#define URING_RECV      1       // user_data of the recvmsg;
+#define URING_SEND      2       //  of a sendmsg: this + its query slot.
+
+// A sendmsg, as the kernel reads it: one per query slot.
+typedef struct {
+    struct msghdr mh;
+    struct iovec iov;
+    INADDR  to;
+    int     busy;               // Queued; its completion not yet seen.
+} USEND;
+
+struct uring {
+    int     efd;                // eventfd signalled by completions.
+    int     fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void   *sq_ring, *cq_ring;
+    size_t  sq_len, cq_len, sqes_len;
+    unsigned nsubmit;           // Queued since the last io_uring_enter.
+    int     armed;              // The multishot recvmsg is active.
+    struct io_uring_buf_ring *br;   // Provided buffers, bufs[URING_NBUFS].
+    uint16_t br_tail;
+    uint8_t *bufs;
+    struct msghdr rmsg;         // Layout of each received buffer.
+    USEND  *sends;              // sends[qsize]
+};
+
+static int
+uring_fileno(struct uring const *u)
+{
+    return u->efd;
+}
+
+// The next free SQE, cleared; NULL if the SQ stays full after a submit.
+static struct io_uring_sqe *
+uring_sqe(MADNS * mp)
+{
+    struct uring *u = mp->uring;
+    unsigned tail = *u->sq_tail;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask) {
+        uring_submit(mp);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask)
+            return NULL;
+    }
+
+    unsigned i = tail & *u->sq_mask;
+
+    memset(&u->sqes[i], 0, sizeof u->sqes[i]);
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->nsubmit++;
+    return &u->sqes[i];
+}
+
+static void
+uring_submit(MADNS * mp)
+{
+    struct uring *u = mp->uring;
+
+    if (u && u->nsubmit
+        && syscall(__NR_io_uring_enter, u->fd, u->nsubmit, 0, 0, NULL, 0) >= 0)
+        u->nsubmit = 0;
+}
+
+static void
+uring_arm(MADNS * mp)
+{
+    struct io_uring_sqe *sqe = uring_sqe(mp);
+
+    if (!sqe)
+        return;                 // Armed by the next uring_receive.
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = mp->sock;
+    sqe->addr = (uintptr_t) & mp->uring->rmsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = URING_RECV;
+    mp->uring->armed = 1;
+}
+
+static void
+uring_recycle(struct uring *u, int bid)
+{
+    struct io_uring_buf *bp = &u->br->bufs[u->br_tail & (URING_NBUFS - 1)];
+
+    bp->addr = (uintptr_t) (u->bufs + bid * URING_BUFLEN);
+    bp->len = URING_BUFLEN;
+    bp->bid = bid;
+    __atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+// Queue a sendmsg for (qp). Returns 0 if it cannot be queued: the kernel
+//  may still be reading the slot's USEND for an earlier send.
+static int
+uring_send(MADNS * mp, QUERY * qp, INADDR const *to)
+{
+    USEND  *sp = &mp->uring->sends[qp - mp->queries];
+    struct io_uring_sqe *sqe;
+
+    if (sp->busy || !(sqe = uring_sqe(mp)))
+        return 0;
+    sp->busy = 1;
+    sp->to = *to;
+    sp->iov = (struct iovec) {qp->pkt, qp->pktlen};
+    sp->mh = (struct msghdr) {.msg_name = &sp->to,.msg_namelen = sizeof sp->to,
+        .msg_iov = &sp->iov,.msg_iovlen = 1};
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = mp->sock;
+    sqe->addr = (uintptr_t) & sp->mh;
+    sqe->len = 1;
+    sqe->user_data = URING_SEND + (qp - mp->queries);
+    if (!qp->expires)
+        qp->expires = time(0) + mp->query_time;
+    return 1;
+}
+
+// Handle completions: answers, and failed sends.
+static void *
+uring_receive(MADNS * mp, MADNS_ANSWER * ap)
+{
+    struct uring *u = mp->uring;
+    uint64_t count;
+    void   *ctx = NULL;
+    unsigned head = *u->cq_head;
+
+    if (read(u->efd, &count, sizeof count) < 0 && errno != EAGAIN)
+        LOG("uring eventfd: %s\n", strerror(errno));
+    uring_submit(mp);
+
+    while (!ctx && head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = u->cqes[head++ & *u->cq_mask];
+
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        if (cqe.user_data != URING_RECV) {
+            u->sends[cqe.user_data - URING_SEND].busy = 0;
+            if (cqe.res < 0)
+                LOG("uring send: %s\n", strerror(-cqe.res));
+            continue;
+        }
+
+        u->armed &= !!(cqe.flags & IORING_CQE_F_MORE);
+        if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+            continue;           // ENOBUFS: re-armed below.
+
+        int     bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = u->bufs + bid * URING_BUFLEN;
+        struct io_uring_recvmsg_out const *out = (void *)buf;
+        INADDR const *from = (void const *)(out + 1);
+
+        if (out->namelen >= sizeof *from && !(out->flags & MSG_TRUNC))
+            ctx = receive(mp, (char const *)(out + 1) + u->rmsg.msg_namelen,
+                          out->payloadlen, from->sin_addr.s_addr, NULL, ap);
+        uring_recycle(u, bid);
+    }
+
+    if (!u->armed) {
+        uring_arm(mp);
+        uring_submit(mp);
+    }
+
+    return ctx;
+}
+
+static int
+uring_create(MADNS * mp)
+{
+    // Room for every completion at once: each query slot has at most one
+    //  sendmsg in flight, and the recvmsg at most one per buffer.
+    struct io_uring_params p = {.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP,
+        .cq_entries = mp->qsize + URING_NBUFS
+    };
+    struct uring *u = calloc(1, sizeof *u);
+    int     i;
+
+    mp->uring = u;
+    u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->efd < 0 || u->fd < 0 || !(p.features & IORING_FEAT_NODROP))
+        return uring_destroy(mp), 0;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_len = u->cq_len = MAX(u->sq_len, u->cq_len);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(0, u->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? u->sq_ring
+        : mmap(0, u->cq_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(0, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    u->br = mmap(0, URING_NBUFS * sizeof(struct io_uring_buf),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = malloc(URING_NBUFS * URING_BUFLEN);
+    u->sends = calloc(mp->qsize, sizeof *u->sends);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED
+        || u->sqes == MAP_FAILED || u->br == MAP_FAILED
+        || !u->bufs || !u->sends)
+        return uring_destroy(mp), 0;
+
+    uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t) u->br,.ring_entries = URING_NBUFS,.bgid = 0
+    };
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0
+        || syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_EVENTFD,
+                   &u->efd, 1) < 0)
+        return uring_destroy(mp), 0;
+
+    for (i = 0; i < URING_NBUFS; ++i)
+        uring_recycle(u, i);
+    u->rmsg.msg_namelen = sizeof(INADDR);
+    uring_arm(mp);
+    uring_submit(mp);
+    return 1;
+}
+
+static void
+uring_destroy(MADNS * mp)
+{
+    struct uring *u = mp->uring;
+
+    if (!u)
+        return;
+    if (u->fd >= 0)
+        (void)close(u->fd);     // Cancels the pending recvmsg.
+    if (u->efd >= 0)
+        (void)close(u->efd);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_len);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+    if (u->br && u->br != MAP_FAILED)
+        munmap(u->br, URING_NBUFS * sizeof(struct io_uring_buf));
+    free(u->bufs), free(u->sends), free(u);
+    mp->uring = NULL;
+}
+
+#else // !URING: MADNS_URING is refused.
+
+static int uring_create(MADNS * mp) { (void)mp; return 0; }
+static int uring_fileno(struct uring const *u) { (void)u; return -1; }
+static void uring_destroy(MADNS * mp) { (void)mp; }
+static int uring_send(MADNS * mp, QUERY * qp, INADDR const *to)
+{ (void)mp, (void)qp, (void)to; return 0; }
+static void uring_submit(MADNS * mp) { (void)mp; }
+static void *uring_receive(MADNS * mp, MADNS_ANSWER * ap)
+{ (void)mp, (void)ap; return NULL; }
+
+#endif
+
+//--------------|---------------------------------------------
+// Driver loop (Linux). One thread runs madns under epoll: the madns fds,
+//  a timerfd armed for the next query deadline, and an eventfd that other
+//  threads ring after queueing requests. The queue is a bounded ring
+//  (Vyukov's MPSC queue): submitters claim a slot with one CAS, and the
+//  eventfd is written only when the queue was empty.
+#ifdef __linux__
+
+typedef struct {
+    unsigned seq;               // == pos: free; == pos + 1: full.
+    int     qtype;
+    void   *ctx;
+    char    name[DNS_NAME_BUF];
+} LOOP_SLOT;
+
+struct madns_loop {
+    MADNS  *mp;
+    MADNS_CALLBACK *cb;
+    void   *arg;
+    int     epfd, efd, tfd;
+    int     nfds, maxfds;
+    struct pollfd *fds;         // As registered with epfd.
+    unsigned mask;              // slots[mask + 1]
+    unsigned head;              // Loop thread only.
+    unsigned tail;              // Atomic: claimed by submitters.
+    unsigned npending;          // Atomic: queued, not yet taken.
+    LOOP_SLOT *slots;
+};
+
+MADNS_LOOP *
+madns_loop_create(MADNS * mp, MADNS_CALLBACK * cb, void *arg)
+{
+    MADNS_LOOP *lp = calloc(1, sizeof *lp);
+    unsigned i, size;
+
+    if (!lp)
+        return NULL;
+
+    for (size = 1024; size < 2u * mp->qsize; size <<= 1);
+    *lp = (MADNS_LOOP) {
+    .mp = mp,.cb = cb,.arg = arg,.mask = size - 1,
+            .epfd = epoll_create1(EPOLL_CLOEXEC),
+            .efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+            .tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC),
+            .maxfds = 2 + mp->nservs * MADNS_TCP_MAXCONNS,
+            .fds = calloc(2 + mp->nservs * MADNS_TCP_MAXCONNS, sizeof *lp->fds),
+            .slots = calloc(size, sizeof *lp->slots)};
+
+    struct epoll_event ev = {.events = EPOLLIN,.data.fd = lp->efd };
+
+    if (lp->epfd < 0 || lp->efd < 0 || lp->tfd < 0 || !lp->fds || !lp->slots
+        || epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->efd, &ev)
+        || (ev.data.fd = lp->tfd,
+            epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->tfd, &ev))) {
+        LOG("loop create: %s\n", strerror(errno));
+        madns_loop_destroy(lp);
+        return NULL;
+    }
+
+    for (i = 0; i < size; ++i)
+        lp->slots[i].seq = i;
+
+    return lp;
+}
+
+void
+madns_loop_destroy(MADNS_LOOP * lp)
+{
+    if (!lp)
+        return;
+    if (lp->epfd >= 0)
+        (void)close(lp->epfd);
+    if (lp->efd >= 0)
+        (void)close(lp->efd);
+    if (lp->tfd >= 0)
+        (void)close(lp->tfd);
+    free(lp->fds), free(lp->slots), free(lp);
+}
+
+int
+madns_loop_fileno(MADNS_LOOP const *lp)
+{
+    return lp->epfd;
+}
+
+int
+madns_loop_submit(MADNS_LOOP * lp, char const *name, int qtype, void *ctx)
+{
+    int     len = strnlen(name, DNS_NAME_BUF);
+    unsigned pos = __atomic_load_n(&lp->tail, __ATOMIC_RELAXED);
+    LOOP_SLOT *sp;
+
+    if (!ctx || len == DNS_NAME_BUF)
+        return 0;
+
+    while (1) {
+        sp = &lp->slots[pos & lp->mask];
+
+        int     dif = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE) - pos;
+
+        if (dif < 0)
+            return 0;           // Full.
+        if (dif > 0)
+            pos = __atomic_load_n(&lp->tail, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&lp->tail, &pos, pos + 1, 1,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+            break;
+    }
+
+    memcpy(sp->name, name, len + 1);
+    sp->qtype = qtype, sp->ctx = ctx;
+    __atomic_store_n(&sp->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (!__atomic_fetch_add(&lp->npending, 1, __ATOMIC_ACQ_REL))
+        madns_loop_wake(lp);
+    return 1;
+}
+
+void
+madns_loop_wake(MADNS_LOOP * lp)
+{
+    uint64_t one = 1;
+
+    if (write(lp->efd, &one, sizeof one) < 0)
+        LOG("loop wake: %s\n", strerror(errno));
+}
+
+// Complete a submission from the cache, or post its request.
+//  Returns 1 if it completed, -1 if it must wait for a free slot.
+static int
+loop_request(MADNS_LOOP * lp, LOOP_SLOT const *sp)
+{
+    MADNS  *mp = lp->mp;
+    MADNS_COMPLETION c = {.ctx = sp->ctx,.server = INADDR_ANY };
+    int     hit;
+
+    if (sp->qtype == DNS_A_RECORD || sp->qtype == DNS_AAAA)
+        hit = madns_lookup_all(mp, sp->name, &c.ans)
+            && (sp->qtype == DNS_AAAA ? c.ans.naddrs6 : c.ans.naddrs);
+    else
+        hit = madns_lookup_rr(mp, sp->name, sp->qtype, &c.ans) != 0;
+
+    if (hit) {
+        c.ans.flags |= MADNS_CACHED;
+    } else if (madns_request_rr(mp, sp->name, sp->qtype, sp->ctx)) {
+        return 0;
+    } else if (errno == EAGAIN) {
+        return -1;
+    } else {
+        c.rcode = -1;           // Invalid name or qtype.
+        c.ans = (MADNS_ANSWER) {.naddrs = 1,.addrs = {INADDR_NONE}};
+    }
+
+    lp->cb(lp->arg, &c);
+    return 1;
+}
+
+// Take submissions while madns has free query slots. Any left over
+//  (or one that needs more slots than are free, such as a search) are
+//  taken as completions free slots.
+// Returns the number completed at once.
+static int
+loop_drain(MADNS_LOOP * lp)
+{
+    unsigned n;
+    int     ret, done = 0;
+
+    do {
+        for (n = 0; madns_ready(lp->mp) > 0; ++n, ++lp->head) {
+            LOOP_SLOT *sp = &lp->slots[lp->head & lp->mask];
+
+            if (__atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE) != lp->head + 1)
+                break;          // Empty.
+            if ((ret = loop_request(lp, sp)) < 0)
+                break;          // Left queued.
+            done += ret;
+            __atomic_store_n(&sp->seq, lp->head + lp->mask + 1,
+                             __ATOMIC_RELEASE);
+        }
+    } while (n && __atomic_sub_fetch(&lp->npending, n, __ATOMIC_ACQ_REL));
+
+    return done;
+}
+
+// Make the epoll set match madns_pollfds. TCP fds are always re-added:
+//  a closed one has left the set, and its number may have been reused.
+//  The number of servers changes with madns_reload.
+static void
+loop_sync(MADNS_LOOP * lp)
+{
+    int     i, j, max = 2 + lp->mp->nservs * MADNS_TCP_MAXCONNS;
+    struct pollfd now[max];
+    int     n = madns_pollfds(lp->mp, now, max);
+
+    if (n > lp->maxfds) {
+        struct pollfd *fds = realloc(lp->fds, max * sizeof *fds);
+
+        if (!fds)
+            return;
+        lp->fds = fds, lp->maxfds = max;
+    }
+
+    for (i = 0; i < n; ++i) {
+        struct epoll_event ev = {.data.fd = now[i].fd,
+            .events = (now[i].events & POLLOUT ? EPOLLOUT : 0) | EPOLLIN };
+
+        if (!i && lp->nfds && lp->fds[0].fd == now[0].fd)
+            continue;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_MOD, now[i].fd, &ev))
+            epoll_ctl(lp->epfd, EPOLL_CTL_ADD, now[i].fd, &ev);
+    }
+
+    for (j = 0; j < lp->nfds; ++j) {
+        for (i = 0; i < n && now[i].fd != lp->fds[j].fd; ++i);
+        if (i == n)
+            epoll_ctl(lp->epfd, EPOLL_CTL_DEL, lp->fds[j].fd, NULL);
+    }
+
+    memcpy(lp->fds, now, n * sizeof *now);
+    lp->nfds = n;
+}
+
+// Arm the timer for the next query expiry or stale fallback.
+static void
+loop_arm(MADNS_LOOP * lp)
+{
+    MADNS  *mp = lp->mp;
+    struct itimerspec its = { {0, 0}, {0, 0} };
+
+    if (!qempty(&mp->active)) {
+        double  t = link_QUERY(mp->active.next)->expires;
+
+        if (!qempty(&mp->stalewait))
+            t = MIN(t, slink_QUERY(mp->stalewait.next)->stale_at);
+        its.it_value.tv_sec = t;
+        its.it_value.tv_nsec = (t - its.it_value.tv_sec) * 1E9;
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;   // Due now; zero would disarm.
+    }
+
+    timerfd_settime(lp->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int
+madns_loop_run(MADNS_LOOP * lp, int timeout_ms)
+{
+    struct epoll_event evs[16];
+    MADNS_COMPLETION done[16];
+    uint64_t count;
+    int     i, n, total = 0;
+
+    if (lp->mp->watch != -1)
+        watch_check(lp->mp);
+    uring_submit(lp->mp);
+    loop_sync(lp);
+    loop_arm(lp);
+
+    n = epoll_wait(lp->epfd, evs, 16, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; ++i)
+        if (evs[i].data.fd == lp->efd || evs[i].data.fd == lp->tfd)
+            (void)read(evs[i].data.fd, &count, sizeof count);
+
+    total = loop_drain(lp);
+    while ((n = madns_responses(lp->mp, done, 16)) > 0) {
+        for (i = 0; i < n; ++i)
+            lp->cb(lp->arg, &done[i]);
+        total += n + loop_drain(lp);
+    }
+
+    return total;
+}
+
+#endif
+
+static double
+tick(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, 0);
+    return t.tv_sec + 1E-6 * t.tv_usec;
+}
+
+// Find the entry for a name, live or not; see cache_live().
+//  qtype 0 is the A/AAAA entry.
+static CACHE_INFO *
+cache_find(MADNS const *mp, char const *key, int len, HASH hash, int qtype)
+{
+    HASH    h;
 
-    LOG("%s %s lat %.4f -> server %s %.4f reqs=%d\n", qp->name,
-        ipstr(logip, ips + 33), latency, ipstr(qp->server->ip, ips),
-        qp->server->latency, qp->server->nreqs);
+    for (hash = rrhash(hash, qtype), h = hash;; ++h) {
+        CACHE_INFO *cip = mp->cachev[h &= mp->limit - 1];
 
-    free(qp->name);
-    qpull(&qp->link);
-    memset(qp, 0, sizeof *qp);
-    qpush(&mp->unused, &qp->link);
-    mp->nfree++;
+        if (!cip)
+            return NULL;
+        if (cip->hash == hash && cip->len == len && cip->qtype == qtype
+            && !memcmp(cache_name(cip), key, len))
+            return cip;
+    }
+}
 
-    return ret;
+// Is the entry's RRset for (af) unexpired? AF_UNSPEC: for either family.
+static int
+cache_live(CACHE_INFO const *cip, int af, time_t now)
+{
+    return (af != AF_INET6 && cip->expires >= now)
+        || (af != AF_INET && cip->expires6 >= now);
 }
 
-// Fowler-Noll-Voh 32-bit hash.
-static  HASH
-fnvstr(char const *buf)
+// cache_find for a live (af) RRset, falling back on an NXDOMAIN entry for
+//  any parent of (key): nothing exists under a name that does not exist
+//  (RFC 8020).
+static CACHE_INFO *
+cache_lookup(MADNS const *mp, char const *key, int len, HASH hash, int af,
+             time_t now)
 {
-    uint32_t hash = 0x811C9DC5;
+    CACHE_INFO *cip = cache_find(mp, key, len, hash, 0);
 
-    while (*buf)
-        hash = (hash ^ tolower(*buf++)) * 0x01000193;
-    hash += hash << 13;
-    hash ^= hash >> 7;
-    hash += hash << 3;
-    hash ^= hash >> 17;
-    hash += hash << 5;
-    return hash;
+    if (cip && cache_live(cip, af, now))
+        return cache_hit(mp, cip, af, now), cip;
+    return cache_nxparent(mp, key, len, now);
 }
 
-static void
-log_(int line, const char *fmt, ...)
+// cache_lookup, by the search list (see search_order): the entry of the
+//  first candidate name with (af) addresses, unless one before it is not
+//  cached; if none has any, that of the name as given.
+static CACHE_INFO *
+cache_search(MADNS const *mp, char const *name, char const *key, int len,
+             HASH hash, int af, time_t now)
 {
-    fprintf(madns_log, "madns[%d]%8.4f ", line, tick() - start);
-    va_list ap;
+    int     order = search_order(mp, name), i;
+    CACHE_INFO *cip, *asis = NULL;
+    CAND    cand;
 
-    va_start(ap, fmt);
-    vfprintf(madns_log, fmt, ap);
+    if (!order)
+        asis = cache_lookup(mp, key, len, hash, af, now);
+    for (i = 0; order && i <= mp->nsearch; ++i) {
+        if (search_cand(mp, order, key, len, hash, i, &cand) < 0)
+            continue;
+        if (!(cip = cache_lookup(mp, cand.name, cand.len, cand.hash, af, now)))
+            return count_lookup(mp, 0), NULL;   // A request will ask.
+        if (cache_positive(cip, af, now))
+            return count_lookup(mp, 1), cip;
+        if (cand.len == len)
+            asis = cip;
+    }
+    count_lookup(mp, !!asis);
+    return asis;
+}
+
+// Does a live entry have an (af) address, rather than NODATA or NXDOMAIN?
+static int
+cache_positive(CACHE_INFO const *cip, int af, time_t now)
+{
+    return (af != AF_INET6 && cip->expires >= now && cip->naddrs
+            && cip->addrs[0] != INADDR_NONE)
+        || (af != AF_INET && cip->expires6 >= now && cip->naddrs6);
+}
+
+// The live NXDOMAIN entry of a parent of (key), if any.
+static CACHE_INFO *
+cache_nxparent(MADNS const *mp, char const *key, int len, time_t now)
+{
+    CACHE_INFO *cip = NULL;
+    char    parent[DNS_NAME_BUF];
+    char const *dot = key;
+    HASH    hash;
+
+    while (!cip && mp->nxdomains && (dot = memchr(dot, '.', key + len - dot))) {
+        int     plen = normalize(++dot, parent, &hash);
+
+        if (plen > 0 && (cip = cache_find(mp, parent, plen, hash, 0))
+            && !(cip->flags & CACHE_NXDOMAIN && cip->expires >= now))
+            cip = NULL;
+    }
+
+    return cip;
 }
 
+// Count a hit. Once a hot entry is (refresh_pct)% through its TTL,
+//  queue it for a refresh query, so it is replaced before it expires.
+//  A lookup of both families refreshes both.
 static void
-log_packet(int line, char *pkt, int len)
+cache_hit(MADNS const *mp, CACHE_INFO * cip, int af, time_t now)
 {
-    if (!madns_log)
+    REFRESHQ *rq = mp->refreshq;
+    time_t  expires = af == AF_INET6 ? cip->expires6 : cip->expires;
+    uint32_t ttl = af == AF_INET6 ? cip->ttl6 : cip->ttl;
+    unsigned hits = __atomic_load_n(&cip->hits, __ATOMIC_RELAXED), tail;
+
+    if (af == AF_UNSPEC && cip->expires6 && cip->expires6 < expires)
+        expires = cip->expires6, ttl = cip->ttl6;
+
+    if (hits < 0xFFFF)
+        __atomic_store_n(&cip->hits, ++hits, __ATOMIC_RELAXED);
+    if (!mp->refresh_pct || hits < (unsigned)mp->refresh_hits
+        || (now - expires + ttl) * 100 < (time_t) ttl * mp->refresh_pct
+        || __atomic_load_n(&cip->refresh, __ATOMIC_RELAXED)
+        || __atomic_exchange_n(&cip->refresh, 1, __ATOMIC_RELAXED))
         return;
-    int     i;
-    char    buf[len * 3], *cp = buf;
 
-    for (i = 12; i < len; ++i)
-        cp +=
-            sprintf(cp, isgraph(pkt[i]) ? " %c" : " %02X", (uint8_t) pkt[i]);
+    tail = __atomic_load_n(&rq->tail, __ATOMIC_RELAXED);
+    do {
+        if (tail - rq->head == REFRESH_QLEN) {
+            __atomic_store_n(&cip->refresh, 0, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&rq->tail, &tail, tail + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    DNS_RESP *dp = (DNS_RESP *) pkt;
+    rq->q[tail % REFRESH_QLEN].hash = rrhash(cip->hash, cip->qtype);
+    rq->q[tail % REFRESH_QLEN].qtype = cip->qtype;
+    rq->q[tail % REFRESH_QLEN].af = af == AF_UNSPEC && !cip->expires6
+        ? AF_INET : af;
+    memcpy(rq->q[tail % REFRESH_QLEN].name, cache_name(cip), cip->len + 1);
+}
 
-    log_(line, "UDP[%d]: tid=%hu flags=%hX nquer=%hu"
-         " nansw=%hu nauth=%hu noth=%hu [%s ]\n",
-         len, dp->tid, ntohs(dp->flags), ntohs(dp->nqueries),
-         ntohs(dp->nanswers), ntohs(dp->nauth), ntohs(dp->nother), buf);
+// Send queued refreshes, while at least half the query slots are free.
+//  A refresh that cannot be sent is dropped, and may be queued again.
+static void
+send_refreshes(MADNS * mp)
+{
+    REFRESHQ *rq = mp->refreshq;
+    CACHE_INFO *cip;
+
+    for (; rq->head != rq->tail; ++rq->head) {
+        char const *name = rq->q[rq->head % REFRESH_QLEN].name;
+        int     qtype = rq->q[rq->head % REFRESH_QLEN].qtype;
+
+        if (mp->nfree > mp->qsize / 2
+            && (qtype ? madns_request_rr(mp, name, qtype, rq)
+                : madns_request_af(mp, name, rq,
+                                   rq->q[rq->head % REFRESH_QLEN].af))) {
+            mp->stats->c.refreshes++;
+            continue;
+        }
+        if ((cip = cache_find(mp, name, strlen(name),
+                              rq->q[rq->head % REFRESH_QLEN].hash, qtype)))
+            cip->refresh = 0;
+    }
 }
 
-static int
-parse_response(char *pkt, int len, RESPONSE * rp)
+// A refresh query is done, answered or not: its entry (if the answer
+//  did not replace it) may be queued again.
+static void
+refresh_done(MADNS * mp, QUERY const *qp)
 {
-    DNS_RESP *header = (DNS_RESP *) pkt;
-    char   *s = header->data, *e = pkt + len, *p = s;
-    int     dlen;
+    int     rr = qp->qtype != DNS_A_RECORD && qp->qtype != DNS_AAAA;
+    CACHE_INFO *cip = cache_find(mp, qp->name, qp->len, qp->hash,
+                                 rr ? qp->qtype : 0);
 
-    *rp = (RESPONSE) { INADDR_ANY, /*TTL*/ 0, /*TID*/ header->tid, /*NAME*/ s + 1};
+    if (cip)
+        cip->refresh = 0;
+}
 
-    log_packet(__LINE__, pkt, len);
+// Answer a query from its cache entry, fresh or (more likely) stale.
+static int
+stale_answer(MADNS * mp, QUERY const *qp, MADNS_ANSWER * ap)
+{
+    time_t  now = time(0);
+    CACHE_INFO *cip = cache_find(mp, qp->name, qp->len, qp->hash, 0);
 
-    // We sent 1 query and expect at least 1 answer.
-    if (ntohs(header->nqueries) != 1 || !(0x8000 & ntohs(header->flags)))
+    if (!cip || !cache_live(cip, AF_INET, now - mp->stale))
         return 0;
 
-    // Convert hostname e.g. "\6google\3com\0" to "google.com\0"
-    for (; p < e && *p; p += len + 1)
-        len = *p, *p = '.';
-    if (*p)
-        return log_packet(__LINE__, pkt, len), 0;
-    for (p = s + 1; *p; ++p)
-        *p = tolower(*p);
-    ++p;                        // Skip trailing null
-
-    if (p + 4 > e || NTOHSP(p) != DNS_A_RECORD)
-        return log_packet(__LINE__, pkt, len), 0;
-    p += 4;                     // Skip (type, class)
-
-    // This must be tested AFTER decoding the hostname,
-    //   else madns_response will not update cache.
-    if ((ntohs(header->flags) & 0x000F) == DNS_R_NXDOMAIN)
-        return rp->ip = INADDR_NONE, rp->ttl = 86400, 1;
-    if (header->nanswers == 0)  // Try another server?
-        return 1;
+    ap->naddrs6 = 0, ap->nrecs = 0;
+    ap->naddrs = cip->naddrs;
+    memcpy(ap->addrs, cip->addrs, cip->naddrs * sizeof *ap->addrs);
+    ap->flags = cip->expires < now ? MADNS_STALE | MADNS_CACHED : MADNS_CACHED;
+    ap->ttl = cip->expires < now ? STALE_TTL
+        : cip->flags & CACHE_PINNED ? 0 : cip->expires - now;
+    return 1;
+}
 
-    while (p + 12 < e) {
-        // Skip possible name prefixing a CNAME answer.
-        if ((uint8_t) * p != 0xC0) {
-            while (*p && p + 12 < e)
-                p++;
-            p--;
-        }
-
-        switch (NTOHSP(p + 2)) {
-        case DNS_A_RECORD:
-            rp->ttl = NTOHLP(p + 6);
-            if (p + 12 < e) {
-                dlen = NTOHSP(p + 10);
-                p += 12;
-                if (p + dlen <= e)  // SUCCESS!
-                    return rp->ip = *(in_addr_t *) p, 1;
-            }
-            break;
-        case DNS_CNAME:        // Skip this section. NOTREACHED?
-            log_packet(__LINE__, pkt, len);
-            p += 12 + NTOHSP(p + 10);
-            break;
-        default:               // Leave the loop.
-            p = e;
-        }
+// Completions and lookups may hold views of an entry's records,
+//  so those entries are retired rather than freed at once.
+static void
+cache_free(MADNS * mp, CACHE_INFO * cip)
+{
+    if (!cip)
+        return;
+    mp->nxdomains -= cip->flags & CACHE_NXDOMAIN;
+    if (cip->flags & CACHE_ARENA)
+        arena_release(mp, cip);
+    else if (cip->nrecs)
+        cache_retire(mp, cip);
+    else
+        free(cip);
+}
+
+// Free an entry at the next madns_response, when no answer still
+//  points into it. Returns 0 if it could not be recorded.
+static int
+cache_retire(MADNS * mp, CACHE_INFO * cip)
+{
+    if (mp->nretired == mp->maxretired) {
+        int     max = MAX(16, 2 * mp->maxretired);
+        CACHE_INFO **retired = realloc(mp->retired, max * sizeof *retired);
+
+        if (!retired)
+            return 0;           // Leak it, rather than free it in use.
+        mp->retired = retired, mp->maxretired = max;
     }
+    mp->retired[mp->nretired++] = cip;
+    return 1;
+}
 
-    return 0;
+static void
+free_retired(MADNS * mp)
+{
+    while (mp->nretired)
+        free(mp->retired[--mp->nretired]);
 }
 
+// Count a lookup as a hit or a miss. Lookups may run in several threads
+//  at once, so these two counters are relaxed atomics: exact, though
+//  not ordered with anything else.
 static void
-send_request(MADNS * mp, QUERY * qp)
+count_lookup(MADNS const *mp, int hit)
 {
-    SERVER *prev = qp->server;
-    char    pkt[DNS_PACKET_LEN], ips[99];
-    DNS_RESP *header = (DNS_RESP *) pkt;
+    __atomic_fetch_add(hit ? &mp->stats->c.hits : &mp->stats->c.misses, 1,
+                       __ATOMIC_RELAXED);
+}
 
-    // Choose lowest-latency server:
-    int     i;
+// Where to start in a cached RRset: 0, or the next in turn.
+static unsigned
+cache_rotor(MADNS const *mp, CACHE_INFO * cip)
+{
+    return mp->rotate ? __atomic_fetch_add(&cip->rotor, 1, __ATOMIC_RELAXED)
+        : 0;
+}
 
-    for (i = 0; i < mp->nservs; ++i)
-        if (&mp->serv[i] != prev && mp->serv[i].nreqs < mp->server_reqs)
-            break;
-    if (i == mp->nservs)
-        return;
+// One address of a cached RRset: the first, or the next in turn.
+static in_addr_t
+cache_addr(MADNS const *mp, CACHE_INFO * cip)
+{
+    return cip->addrs[cache_rotor(mp, cip) % cip->naddrs];
+}
 
-    if (prev)
-        prev->nreqs--;
-    for (qp->server = &mp->serv[i]; i < mp->nservs; ++i)
-        if (&mp->serv[i] != prev && mp->serv[i].nreqs < mp->server_reqs
-            && mp->serv[i].latency < qp->server->latency)
-            qp->server = &mp->serv[i];
-    qp->server->nreqs++;
+// Copy the live RRsets of (af) into an answer, rotated if mp->rotate.
+static void
+cache_answer(MADNS const *mp, CACHE_INFO * cip, int af, time_t now,
+             MADNS_ANSWER * ap)
+{
+    int     i, rot = cache_rotor(mp, cip);
+    struct in6_addr const *addrs6 = cache_addrs6(cip);
 
-    header->tid = qp->tid;
-    header->flags = ntohs(0x0100);  // Recursive query.
-    header->nqueries = ntohs(1);
-    header->nanswers = 0;
-    header->nauth = 0;
-    header->nother = 0;
+    ap->naddrs = ap->naddrs6 = ap->nrecs = 0, ap->ttl = 0;
+    ap->flags = cip->flags & CACHE_NXDOMAIN ? MADNS_NXDOMAIN : 0;
+    if (af != AF_INET6 && cip->expires >= now) {
+        for (i = 0; i < cip->naddrs; ++i)
+            ap->addrs[i] = cip->addrs[(rot + i) % cip->naddrs];
+        ap->naddrs = cip->naddrs;
+        ap->ttl = cip->expires - now;
+    }
+    if (af != AF_INET && cip->expires6 >= now) {
+        for (i = 0; i < cip->naddrs6; ++i)
+            ap->addrs6[i] = addrs6[(rot + i) % cip->naddrs6];
+        ap->naddrs6 = cip->naddrs6;
+        if (!ap->naddrs || (time_t) ap->ttl > cip->expires6 - now)
+            ap->ttl = cip->expires6 - now;
+    }
+    // "No address" only if neither family has one.
+    if (ap->naddrs6 && ap->naddrs == 1 && ap->addrs[0] == INADDR_NONE)
+        ap->naddrs = 0;
+    if (cip->flags & CACHE_PINNED)
+        ap->ttl = 0;            // Nothing to count down.
+}
 
-    // Encode "Mail.Google.com" as \4mail\6google\3com\0
-    char   *p = header->data, *dst = p + 1;
-    char const *src;
+// Answer from a (qtype) entry, or an NXDOMAIN parent.
+// Returns nrecs; 0 if not cached; -1 if cached as having none.
+static int
+rr_answer(CACHE_INFO const *cip, time_t now, MADNS_ANSWER * ap)
+{
+    ap->naddrs = ap->naddrs6 = ap->nrecs = 0, ap->ttl = 0, ap->flags = 0;
+    ap->recs = NULL;
+    if (!cip)
+        return 0;
 
-    for (src = qp->name; *src; ++src, ++dst) {
-        if (*src != '.')
-            *dst = tolower(*src);
-        else if (dst - p - 1 <= NS_MAXLABEL)
-            *p = dst - p - 1, p = dst;
+    ap->ttl = cip->expires - now;
+    if (!(ap->nrecs = cip->nrecs)) {
+        ap->naddrs = 1, ap->addrs[0] = INADDR_NONE;
+        ap->flags = cip->flags & CACHE_NXDOMAIN ? MADNS_NXDOMAIN : 0;
+        return -1;
+    }
+    ap->recs = cache_recs(cip);
+    return ap->nrecs;
+}
+
+// The rdata of a record as a MADNS_RECORD, with names decoded into (dst).
+//  (dst) may be NULL, to size the record.
+// Returns the bytes used at (dst), or -1 if the rdata is malformed.
+static int
+rr_decode(DNS_MSG const *msg, DNS_RR const *rr, MADNS_RECORD * rec,
+          char *dst)
+{
+    char    name[DNS_NAME_BUF];
+    int     off = rr->type == DNS_MX ? 2 : rr->type == DNS_SRV ? 6 : 0, len;
+
+    rec->type = rr->type;
+    switch (rr->type) {
+    case DNS_MX:
+    case DNS_SRV:
+    case DNS_PTR:
+    case DNS_NS_RECORD:
+    case DNS_CNAME:
+        if (rr->rdlen <= off
+            || (len = dns_getname(msg, rr->rdata + off, name)) < 0)
+            return -1;
+        if (dst)
+            memcpy(dst, name, len + 1);
+        if (rr->type == DNS_MX)
+            rec->mx.pref = get16(rr->rdata), rec->mx.host = dst;
+        else if (rr->type == DNS_SRV)
+            rec->srv.prio = get16(rr->rdata),
+                rec->srv.weight = get16(rr->rdata + 2),
+                rec->srv.port = get16(rr->rdata + 4), rec->srv.host = dst;
         else
-            return;             // Unencodable domain name; expiry=0.
+            rec->host = dst;
+        return len + 1;
+
+    case DNS_SOA:{              // MNAME RNAME, then five 32-bit fields.
+            uint8_t const *end = rr->rdata + rr->rdlen;
+            uint8_t const *rname = dns_skipname(rr->rdata, end);
+            uint8_t const *p = rname ? dns_skipname(rname, end) : NULL;
+            int     rlen;
+
+            if (!p || p + 20 > end
+                || (len = dns_getname(msg, rr->rdata, name)) < 0)
+                return -1;
+            if (dst)
+                memcpy(dst, name, len + 1);
+            if ((rlen = dns_getname(msg, rname, name)) < 0)
+                return -1;
+            if (dst)
+                memcpy(dst + len + 1, name, rlen + 1);
+            rec->soa.mname = dst, rec->soa.rname = dst ? dst + len + 1 : dst;
+            rec->soa.serial = get32(p), rec->soa.refresh = get32(p + 4);
+            rec->soa.retry = get32(p + 8), rec->soa.expire = get32(p + 12);
+            rec->soa.minimum = get32(p + 16);
+            return len + 1 + rlen + 1;
+        }
+
+    default:                    // TXT, and anything else: rdata as is.
+        rec->raw.len = rr->rdlen;
+        rec->raw.data = (unsigned char *)dst;
+        if (dst)
+            memcpy(dst, rr->rdata, rr->rdlen);
+        return rr->rdlen;
     }
+}
 
-    *p = dst - p - 1, p = dst;
-    *p++ = 0;                   // Mark end of host name
-    *p++ = 0;                   // 1-byte DNS checksum that defaults to 0 (!?)
-    *p++ = DNS_A_RECORD;        // Query Type aka (ns_t_a)
-    *p++ = 0;
-    *p++ = 1;                   // Class: inet aka (ns_c_in)
-    int     len = p - pkt;
+// Build a (qtype) entry: the records, then the decoded names and data.
+static CACHE_INFO *
+rr_entry(RESPONSE const *rp, char const *name, int len, time_t ttl, int flags)
+{
+    MADNS_RECORD rec;
+    int     i, n, size = 0;
 
-    INADDR  addr = { /*FAMILY*/ AF_INET, /*PORT*/ htons(NS_DEFAULTPORT),
-         /*INADDR*/ {qp->server->ip}, /*ZERO*/ {}
-    };
-    if (len == sendto(mp->sock, &pkt, len, 0, (SADDR *) & addr, sizeof addr)
-        && !qp->expires)
-        qp->expires = time(0) + mp->query_time;
+    for (i = 0; i < rp->nrrs; ++i)
+        if ((n = rr_decode(&rp->msg, &rp->rrs[i], &rec, NULL)) >= 0)
+            size += n;
+
+    CACHE_INFO *xp = calloc(1, sizeof(CACHE_INFO) + len + 8
+                            + rp->nrrs * sizeof(MADNS_RECORD) + size);
 
-    LOG("%s tid=%d to %s reqs %d\n", qp->name, qp->tid,
-        ipstr(qp->server->ip, ips), qp->server->nreqs);
+    if (!xp)
+        return NULL;
+    xp->expires = time(0) + ttl;
+    xp->ttl = ttl;
+    xp->len = len;
+    xp->flags = flags;
+    xp->qtype = rp->qtype;
+    memcpy(cache_name(xp), name, len + 1);
+
+    MADNS_RECORD *recs = cache_recs(xp);
+    char   *dst = (char *)(recs + rp->nrrs);
+
+    for (i = 0; i < rp->nrrs; ++i)
+        if ((n = rr_decode(&rp->msg, &rp->rrs[i], &recs[xp->nrecs], dst)) >= 0)
+            dst += n, ++xp->nrecs;
+
+    return xp;
 }
 
-static double
-tick(void)
+// "4.3.2.1.in-addr.arpa" for 1.2.3.4, without printf. Returns its length.
+static int
+ptr_name(in_addr_t ip, char *dst)
 {
-    struct timeval t;
+    uint8_t const *b = (uint8_t const *)&ip;
+    char   *p = dst;
+    int     i;
 
-    gettimeofday(&t, 0);
-    return t.tv_sec + 1E-6 * t.tv_usec;
+    for (i = 3; i >= 0; --i) {
+        if (b[i] >= 100)
+            *p++ = '0' + b[i] / 100;
+        if (b[i] >= 10)
+            *p++ = '0' + b[i] / 10 % 10;
+        *p++ = '0' + b[i] % 10;
+        *p++ = '.';
+    }
+
+    memcpy(p, "in-addr.arpa", sizeof "in-addr.arpa");
+    return p - dst + sizeof "in-addr.arpa" - 1;
 }
 
-static void
-update_cache(MADNS * mp, RESPONSE const *rp)
+// Cache the answer under the query name, and under every name in
+//  its CNAME chain, so a later lookup of any alias (or the target) hits.
+//  Only the last name in the chain is the one that does not exist.
+// Returns the query name's new entry, or NULL if the answer is uncacheable.
+static CACHE_INFO *
+cache_response(MADNS * mp, QUERY const *qp, RESPONSE const *rp)
+{
+    time_t  ttl = rp->chain[rp->nchain].ttl;
+    int     i, len, flags = rp->rcode == DNS_R_NXDOMAIN ? CACHE_NXDOMAIN : 0;
+    char    key[DNS_NAME_BUF];
+    HASH    hash;
+
+    if (!ttl)
+        return NULL;            // e.g. NXDOMAIN without SOA.
+
+    // A name that does not exist has no records of any type.
+    RESPONSE const nx = {.qtype = DNS_A_RECORD,.naddrs = 1,
+        .addrs = {INADDR_NONE}
+    };
+    int     rr = rp->qtype != DNS_A_RECORD && rp->qtype != DNS_AAAA;
+
+    for (i = rp->nchain; i > 0; --i, flags = 0) {
+        ttl = MIN(ttl, rp->chain[i].ttl);
+        if (dns_getname(&rp->msg, rp->chain[i].name, key) > 0
+            && (len = normalize(key, key, &hash)) > 0) {
+            update_cache(mp, key, len, hash, rp, ttl, flags);
+            if (rr && flags)
+                update_cache(mp, key, len, hash, &nx, ttl, flags);
+        }
+    }
+
+    if (rr && flags)
+        update_cache(mp, qp->name, qp->len, qp->hash, &nx, rp->ttl, flags);
+
+    // The SOA of a negative answer, under its zone: to answer for it.
+    //  Only a zone the name is in: a server may not plant any other.
+    if (rp->soa.name && rp->soa.ttl
+        && dns_getname(&rp->msg, rp->soa.name, key) >= 0
+        && (len = normalize(key, key, &hash)) > 0 && len <= qp->len
+        && !memcmp(qp->name + qp->len - len, key, len)
+        && (len == qp->len || qp->name[qp->len - len - 1] == '.')) {
+        RESPONSE const soa = {.qtype = DNS_SOA,.nrrs = 1,.rrs = {rp->soa},
+            .msg = rp->msg
+        };
+
+        update_cache(mp, key, len, hash, &soa, rp->soa.ttl, 0);
+    }
+
+    TRACE(mp, cache, qp, (int)rp->ttl);
+    return update_cache(mp, qp->name, qp->len, qp->hash, rp, rp->ttl, flags);
+}
+
+// Build the A/AAAA entry for a response, merged with (cip), the old one.
+static CACHE_INFO *
+addr_entry(CACHE_INFO const *cip, RESPONSE const *rp, char const *name,
+           int len, time_t ttl, int flags)
 {
-    unsigned hash = fnvstr(rp->name), i = hash;
-    CACHE_INFO *cip, **putp = NULL, *xp;
     time_t  now = time(0);
 
+    // The response sets one family. The entry keeps the other family's
+    //  RRset, unless either answer says the name does not exist.
+    CACHE_INFO const none = { 0 }, *old = cip && !(flags & CACHE_NXDOMAIN)
+        && !(cip->flags & CACHE_NXDOMAIN) ? cip : &none;
+    int     nxdomain = flags & CACHE_NXDOMAIN, aaaa = rp->qtype == DNS_AAAA;
+    int     naddrs = aaaa && !nxdomain ? old->naddrs : rp->naddrs;
+    int     naddrs6 = !aaaa ? old->naddrs6
+        : rp->naddrs6 || nxdomain ? rp->naddrs6 : 0;    // Drop NODATA marker.
+
+    CACHE_INFO *xp = malloc(sizeof(CACHE_INFO)
+                            + (naddrs - 1) * sizeof(in_addr_t)
+                            + naddrs6 * sizeof(struct in6_addr) + len + 1);
+
+    if (!xp)
+        return NULL;
+    xp->expires = aaaa && !nxdomain ? old->expires : now + ttl;
+    xp->expires6 = aaaa || nxdomain ? now + ttl : old->expires6;
+    xp->ttl = aaaa && !nxdomain ? old->ttl : ttl;
+    xp->ttl6 = aaaa || nxdomain ? ttl : old->ttl6;
+    xp->len = len;
+    xp->naddrs = naddrs;
+    xp->naddrs6 = naddrs6;
+    xp->rotor = 0;
+    xp->flags = flags;
+    xp->nrecs = 0;
+    xp->qtype = 0;
+    xp->hits = 0;
+    xp->refresh = 0;
+    memcpy(xp->addrs, aaaa && !nxdomain ? old->addrs : rp->addrs,
+           naddrs * sizeof(in_addr_t));
+    memcpy(cache_addrs6(xp), aaaa ? rp->addrs6 : cache_addrs6(old),
+           naddrs6 * sizeof(struct in6_addr));
+    memcpy(cache_name(xp), name, len + 1);
+    return xp;
+}
+
+// Returns the new entry; NULL if there is no memory for it.
+static CACHE_INFO *
+update_cache(MADNS * mp, char const *name, int len, HASH hash,
+             RESPONSE const *rp, time_t ttl, int flags)
+{
+    int     qtype = rp->qtype == DNS_A_RECORD || rp->qtype == DNS_AAAA
+        ? 0 : rp->qtype;
+    unsigned i = hash = rrhash(hash, qtype);
+    CACHE_INFO *cip, **putp = NULL, *xp, *ret;
+    time_t  now = time(0), dead = now - mp->stale;   // Not even stale.
+
     for (; (cip = mp->cachev[i &= mp->limit - 1]); ++i) {
-        if (cip->hash == hash && !strcmp(cip->name, rp->name)) {
-            cip->expires = now + rp->ttl;
-            return;
-        }
-        if (!putp && cip->expires < now)
+        if (cip->hash == hash && cip->len == len && cip->qtype == qtype
+            && !memcmp(cache_name(cip), name, len))
+            break;
+        if (!putp && cache_expires(cip) < dead)
             putp = &mp->cachev[i];
     }
+    if (cip && cip->flags & CACHE_PINNED)
+        return cip;             // Local data outranks any server.
+
+    xp = qtype ? rr_entry(rp, name, len, ttl, flags)
+        : addr_entry(cip, rp, name, len, ttl, flags);
+    if (!xp)
+        return NULL;            // The old entry, if any, stays.
+    xp->hash = hash;
+    mp->nxdomains += flags & CACHE_NXDOMAIN;
 
-    cip = malloc(sizeof(CACHE_INFO) + strlen(rp->name));
-    cip->hash = hash;
-    cip->expires = now + rp->ttl;
-    cip->ip = rp->ip;
-    strcpy(cip->name, rp->name);
+    if (cip) {
+        cache_free(mp, cip), mp->cachev[i] = xp;        // RRset may differ.
+        return xp;
+    }
 
+    cip = ret = xp;
     if (putp) {                 // An overwritable entry
-        free(*putp), *putp = cip;
+        cache_free(mp, *putp), *putp = cip;
     } else {
         putp = &mp->cachev[i];
         int     j, count = mp->count + 1, limit;
@@ -649,10 +4081,10 @@ update_cache(MADNS * mp, RESPONSE const *rp)
             for (j = mp->limit; --j >= 0;) {
                 if (!(xp = mp->cachev[j]))
                     easy = 1;
-                else if (xp->expires > now)
+                else if (cache_expires(xp) > dead)
                     easy = 0;
                 else if (easy)
-                    --count, free(xp), mp->cachev[j] = NULL;
+                    --count, cache_free(mp, xp), mp->cachev[j] = NULL;
             }
         }
         // To avoid thrashing on easy sweeps, rebuild when there are
@@ -660,30 +4092,285 @@ update_cache(MADNS * mp, RESPONSE const *rp)
         //  for table growth.
         if (count < mp->limit * 3 / 4 || count < mp->count - mp->limit / 4) {
             *putp = cip;
+            mp->count = count;
         } else {
             // Rebuild hash table with (limit) = power of 2 >= count * 4/3:
             for (limit = MIN_CACHE; limit <= count * 4 / 3; limit <<= 1);
-            putp = calloc(limit, sizeof(CACHE_INFO *));
-            putp[hash & (limit - 1)] = cip; // First insertion!
-
-            for (j = 0; j < mp->limit; ++j) {
-                if ((cip = mp->cachev[j])) {
-                    if (cip->expires <= now) {
-                        free(cip);
-                    } else {
-                        for (i = cip->hash; putp[i & (limit - 1)]; ++i);
-                        putp[i & (limit - 1)] = cip;
-                    }
-                }
+            cache_rebuild(mp, limit, dead);
+            for (i = hash; mp->cachev[i &= mp->limit - 1]; ++i);
+            mp->cachev[i] = cip;
+            ++mp->count;
+        }
+    }
+
+    return ret;
+}
+
+// Rehash the entries that are not dead into a table of (limit) slots.
+//  Returns 0 (and keeps the old table) if out of memory.
+static int
+cache_rebuild(MADNS * mp, int limit, time_t dead)
+{
+    CACHE_INFO **cachev = calloc(limit, sizeof *cachev), *cip;
+    int     i, j, count = 0;
+
+    if (!cachev)
+        return 0;
+
+    for (j = 0; j < mp->limit; ++j) {
+        if (!(cip = mp->cachev[j]))
+            continue;
+        if (cache_expires(cip) <= dead) {
+            cache_free(mp, cip);
+        } else {
+            for (i = cip->hash; cachev[i & (limit - 1)]; ++i);
+            cachev[i & (limit - 1)] = cip, ++count;
+        }
+    }
+
+    free(mp->cachev);
+    mp->cachev = cachev, mp->limit = limit, mp->count = count;
+    mp->stats->c.rebuilds++;
+    return 1;
+}
+
+static void
+arena_release(MADNS * mp, CACHE_INFO const *cip)
+{
+    ARENA **app, *ap;
+
+    for (app = &mp->arenas; (ap = *app); app = &ap->next)
+        if ((char const *)cip >= (char *)ap->mem
+            && (char const *)cip < (char *)ap->mem + ap->size) {
+            if (!--ap->live)
+                *app = ap->next, free(ap);
+            return;
+        }
+}
+
+//--------------|---------------------------------------------
+// Preload: a hosts(5) file into the cache. The lines of each name are
+//  chained to its first line, through a temporary index; then the table
+//  is sized once, and every entry is built in one ARENA, in file order.
+//  A name in the file replaces its entry in the cache.
+
+typedef struct {
+    HASH    hash;
+    char const *name;           // Normalized, over the name in the file.
+    int     len;
+    int     af;                 // 0: dropped (a duplicate, or too many).
+    int     next;               // Next line with this name; -1: none.
+    int     last;               // Its first line: the chain's end; else -1.
+    union {
+        in_addr_t ip;
+        struct in6_addr ip6;
+    } addr;
+} HOSTREC;
+
+// Parse "ip name [alias...]" lines in (buf). Returns the number of recs.
+static int
+parse_hosts(char *buf, HOSTREC ** recsp)
+{
+    HOSTREC *recs = NULL, rec;
+    int     nrecs = 0, maxrecs = 0;
+    char   *line, *next, *tok, *save, key[DNS_NAME_BUF];
+
+    for (line = buf; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        if (*next)
+            *next++ = 0;
+        line[strcspn(line, "#")] = 0;
+        if (!(tok = strtok_r(line, " \t\r", &save)))
+            continue;
+        if (inet_pton(AF_INET, tok, &rec.addr.ip) == 1)
+            rec.af = AF_INET;
+        else if (inet_pton(AF_INET6, tok, &rec.addr.ip6) == 1)
+            rec.af = AF_INET6;
+        else
+            continue;
+
+        while ((tok = strtok_r(NULL, " \t\r", &save))) {
+            // normalize() stores 16 bytes at a time, so not in place here.
+            if ((rec.len = normalize(tok, key, &rec.hash)) < 0)
+                continue;
+            memcpy(tok, key, rec.len);
+            if (nrecs == maxrecs) {
+                HOSTREC *more = realloc(recs, (maxrecs = 2 * maxrecs + 1024)
+                                        * sizeof *recs);
+
+                if (!more)
+                    break;
+                recs = more;
             }
+            rec.name = tok;
+            recs[nrecs++] = rec;
+        }
+    }
+
+    *recsp = recs;
+    return nrecs;
+}
+
+// Chain the recs of each name to its first, in file order.
+//  Returns 0 if out of memory.
+static int
+chain_hosts(HOSTREC * recs, int nrecs)
+{
+    int     mask, i, *index;
+    unsigned h;
+
+    for (mask = MIN_CACHE - 1; mask < nrecs * 2; mask = mask * 2 + 1);
+    if (!(index = malloc((mask + 1) * sizeof *index)))
+        return 0;
+    memset(index, -1, (mask + 1) * sizeof *index);
+
+    for (i = 0; i < nrecs; ++i) {
+        HOSTREC *rp = &recs[i], *hp = NULL;
+
+        for (h = rp->hash; index[h &= mask] != -1; ++h, hp = NULL) {
+            hp = &recs[index[h]];
+            if (hp->hash == rp->hash && hp->len == rp->len
+                && !memcmp(hp->name, rp->name, rp->len))
+                break;
+        }
+        rp->next = -1;
+        if (hp)
+            rp->last = -1, recs[hp->last].next = i, hp->last = i;
+        else
+            rp->last = index[h] = i;
+    }
+
+    free(index);
+    return 1;
+}
+
+// Drop duplicate and excess addresses of the name whose first rec is
+//  recs[i]. Returns the size of its entry.
+static size_t
+host_entry_size(HOSTREC * recs, int i, int *naddrs, int *naddrs6)
+{
+    int     j, k;
+
+    *naddrs = *naddrs6 = 0;
+    for (j = i; j != -1; j = recs[j].next) {
+        int    *np = recs[j].af == AF_INET ? naddrs : naddrs6;
+
+        if (!recs[j].af)
+            continue;
+        for (k = i; k != j && (recs[k].af != recs[j].af
+                               || memcmp(&recs[k].addr, &recs[j].addr,
+                                         recs[j].af == AF_INET ? 4 : 16));
+             k = recs[k].next);
+        if (k != j || *np == MADNS_MAX_ADDRS)
+            recs[j].af = 0;
+        else
+            ++*np;
+    }
+
+    // No A record is cached as NODATA: addrs[0] = INADDR_NONE.
+    return (sizeof(CACHE_INFO) + (MAX(*naddrs, 1) - 1) * sizeof(in_addr_t)
+            + *naddrs6 * sizeof(struct in6_addr) + recs[i].len + 1 + 7) & -8;
+}
+
+int
+madns_preload(MADNS * mp, char const *path, int ttl, MADNS_PRELOAD * stats)
+{
+    MADNS_PRELOAD st = {.secs = tick() };
+    FILE   *fp = fopen(path, "r");
+    long    size = fp && !fseek(fp, 0L, SEEK_END) ? ftell(fp) : -1;
+    char   *buf = size >= 0 ? malloc(size + 1) : NULL;
+
+    if (fp)
+        rewind(fp);
+    if (!buf || (long)fread(buf, 1, size, fp) != size || ttl < 0) {
+        if (fp)
+            fclose(fp);
+        free(buf);
+        return -1;
+    }
+    fclose(fp);
+    buf[size] = 0;
+
+    HOSTREC *recs;
+    int     nrecs = parse_hosts(buf, &recs), i, j, k, na, na6;
+    int     chained = chain_hosts(recs, nrecs);
 
-            mp->limit = limit;
-            free(mp->cachev);
-            mp->cachev = putp;
+    // Size the arena, and the table as if every name were new.
+    for (i = 0; chained && i < nrecs; ++i)
+        if (recs[i].last != -1) {
+            st.bytes += host_entry_size(recs, i, &na, &na6);
+            st.addrs += na + na6, ++st.names;
         }
 
-        mp->count = count;
+    ARENA  *ap = chained ? malloc(sizeof *ap + st.bytes) : NULL;
+    time_t  now = time(0);
+    int     limit;
+
+    for (limit = mp->limit; mp->count + st.names >= limit * 3 / 4;
+         limit <<= 1);
+    if (!ap || (limit > mp->limit
+                && !cache_rebuild(mp, limit, now - mp->stale))) {
+        free(ap), free(recs), free(buf);
+        return -1;
+    }
+    *ap = (ARENA) {mp->arenas, st.bytes, 0};
+    mp->arenas = ap;
+
+    // Build each entry, and put it in the table.
+    char   *mem = (char *)ap->mem;
+
+    for (i = 0; i < nrecs; ++i) {
+        CACHE_INFO *xp = (CACHE_INFO *) mem;
+        HOSTREC const *rp = &recs[i];
+
+        if (rp->last == -1)
+            continue;
+        mem += host_entry_size(recs, i, &na, &na6);
+
+        *xp = (CACHE_INFO) {.hash = rp->hash,.len = rp->len,
+            .naddrs = MAX(na, 1),.naddrs6 = na6,
+            .flags = ttl ? CACHE_ARENA : CACHE_ARENA | CACHE_PINNED,
+            .expires = ttl ? now + ttl : PINNED_EXPIRES,
+            .ttl = ttl,.ttl6 = ttl};
+        xp->expires6 = xp->expires;
+        xp->addrs[0] = INADDR_NONE;
+
+        struct in6_addr *addrs6 = cache_addrs6(xp);
+
+        for (j = i, na = na6 = 0; j != -1; j = recs[j].next)
+            if (recs[j].af == AF_INET)
+                xp->addrs[na++] = recs[j].addr.ip;
+            else if (recs[j].af == AF_INET6)
+                addrs6[na6++] = recs[j].addr.ip6;
+        memcpy(cache_name(xp), rp->name, xp->len);
+        cache_name(xp)[xp->len] = 0;
+
+        // Replace the name's entry, or take the first empty slot.
+        for (k = xp->hash;; ++k) {
+            CACHE_INFO *cip = mp->cachev[k &= mp->limit - 1];
+
+            if (!cip) {
+                ++mp->count;
+                break;
+            }
+            if (cip->hash == xp->hash && cip->len == xp->len && !cip->qtype
+                && !memcmp(cache_name(cip), cache_name(xp), xp->len)) {
+                cache_free(mp, cip);
+                break;
+            }
+        }
+        mp->cachev[k] = xp, ++ap->live;
     }
+
+    free(recs), free(buf);
+    st.secs = tick() - st.secs;
+    LOG("preload %s: %d names, %d addrs, %zu bytes, %.3f secs\n", path,
+        st.names, st.addrs, st.bytes, st.secs);
+    if (stats)
+        *stats = st;
+    if (!ap->live)              // No names.
+        mp->arenas = ap->next, free(ap);
+    return st.names;
 }
 
 //--------------|---------------------------------------------
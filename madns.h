@@ -18,13 +18,28 @@
 #define MADNS_H
 
 #include <stdio.h>
-#include <netinet/in.h>         // in_addr_t
+#include <stdint.h>             // uint64_t
+#include <poll.h>               // struct pollfd
+#include <netinet/in.h>         // in_addr_t in6_addr
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct madns MADNS;
 
 // Create a MADNS object.
 // resolv_conf: a resolv.conf(5) file name. Must contain "nameserver <ip>" lines.
-// query_time:  request expiry time, in secs.
+//              "server=/<zone>/.../<ip>" lines send names in those zones
+//              (and below) only to that server; the longest zone wins.
+//              "search" (or "domain") and "options ndots:n timeout:n
+//              attempts:n rotate" apply as for the libc resolver: a name
+//              with fewer than ndots dots, and no trailing dot, is tried
+//              under each search domain first, all in parallel, then as
+//              given. Lookups follow the same order through the cache.
+//              At most 1 in 7 active requests can be such a search.
+// query_time:  request expiry time, in secs; if 0, "options timeout"
+//              or the default. Each of (attempts) sends gets this long.
 // server_reqs: max active requests per server
 MADNS  *madns_create(char const *resolv_conf, int query_time,
                      int server_reqs);
@@ -36,42 +51,354 @@ MADNS  *madns_create(char const *resolv_conf, int query_time,
 
 void    madns_destroy(MADNS *);
 
-// UDP socket fd, for select/epoll:
+// Re-read resolv.conf (path; NULL: the last one read), keeping the cache
+//  and active requests. Requests on a server that is gone are sent again;
+//  servers that remain keep their latency and TCP connections.
+//  Returns the number of servers, or -1 (the old servers are kept).
+//  The request limit (qsize) and query_time are fixed by madns_create.
+//  With MADNS_WATCH set, a new (path) is watched in place of the old one.
+int     madns_reload(MADNS *, char const *path);
+
+// UDP socket fd (or io_uring eventfd; see MADNS_URING), for select/epoll:
 int     madns_fileno(MADNS const *);
 
-// Seconds until the next query expires.
+// Every fd to poll, with its events: the UDP socket first, then any
+//  MADNS_WATCH fd and TCP connections (see MADNS_EDNS). Returns the
+//  number of fds[] set, at most (max). Callers that poll only
+//  madns_fileno still get TCP answers, but only at the next UDP answer
+//  or expiry.
+int     madns_pollfds(MADNS const *, struct pollfd *fds, int max);
+
+// Seconds until the next query expires (or falls back on a stale entry).
 int     madns_expires(MADNS *);
 
 // Number of requests madns can accept (given current pending requests).
 int     madns_ready(MADNS const *);
 
-// Look up host in cache.
+// The lookups (madns_lookup*) may run in any number of threads at once,
+//  as under a read lock, but not alongside any other madns call. The hit
+//  counts, RRset rotation and refresh-ahead queue they update are atomic.
+
+// Look up host in cache. Case is ignored; a trailing dot makes a name
+//  absolute (see "search" under madns_create).
 // Returns host ip, or:
 //      INADDR_ANY:  hostname not in cache.
-//      INADDR_NONE: hostname in cache as NXDOMAIN, _OR_ hostname too long.
+//      INADDR_NONE: hostname in cache as having no address (NXDOMAIN,
+//                   or no A records), _OR_ under a name cached as NXDOMAIN,
+//                   _OR_ too long or containing bytes outside '!'..'~'.
+// Negative answers are cached for the SOA minimum TTL (RFC 2308);
+//  without an SOA they are not cached. That SOA is cached too, under
+//  its zone: madns_lookup_rr(zone, MADNS_T_SOA) finds it.
 in_addr_t madns_lookup(MADNS const *, char const *host);
 
+// Look up the IPv6 address of a host in cache, as cached from AAAA records.
+// Returns 1 and sets *ip6, or:
+//      0:  hostname not in cache (for AAAA).
+//      -1: hostname in cache as having no AAAA address, or invalid;
+//          see madns_lookup.
+int     madns_lookup6(MADNS const *, char const *host, struct in6_addr *ip6);
+
+// Look up (n) hosts in cache, setting out[i] as madns_lookup(names[i]) would.
+//  The whole batch is hashed first and its buckets prefetched, so cache
+//  misses overlap instead of stalling one at a time.
+// Returns the number of out[] that are not INADDR_ANY.
+int     madns_lookup_many(MADNS const *, char const **names,
+                          in_addr_t * out, int n);
+
+// Load a hosts(5) file ("ip name [alias...]"; '#' comments) into the cache,
+//  IPv4 and IPv6 addresses alike, replacing what is cached for those names.
+//  The table is sized once and every entry is built in one allocation,
+//  so a list of 500k names loads in well under a second.
+// ttl: secs the entries live. 0: pinned; they never expire, answers from
+//  servers never replace them, and lookups report a TTL of 0.
+// Returns the number of names loaded, or -1; (stats) may be NULL.
+typedef struct {
+    int     names;              // Distinct names.
+    int     addrs;              // A and AAAA addresses.
+    size_t  bytes;              // Memory for the entries.
+    double  secs;               // Time to load.
+} MADNS_PRELOAD;
+int     madns_preload(MADNS *, char const *path, int ttl, MADNS_PRELOAD *);
+
+// Record types for madns_request_rr. Any other qtype works too.
+enum {
+    MADNS_T_A = 1, MADNS_T_NS = 2, MADNS_T_CNAME = 5, MADNS_T_SOA = 6,
+    MADNS_T_PTR = 12, MADNS_T_MX = 15, MADNS_T_TXT = 16, MADNS_T_AAAA = 28,
+    MADNS_T_SRV = 33,
+};
+
+// A view of one record of a (non-address) RRset. Host names are decoded
+//  to lowercase "a.b.c"; other rdata is left as on the wire.
+typedef struct madns_record {
+    int         type;
+    union {
+        char const *host;       // PTR NS CNAME
+        struct { unsigned pref; char const *host; } mx;
+        struct { unsigned prio, weight, port; char const *host; } srv;
+        struct { char const *mname, *rname;
+                 uint32_t serial, refresh, retry, expire, minimum; } soa;
+        struct { unsigned len; unsigned char const *data; } raw;
+                                // TXT: <len><chars>... ; and other types.
+    };
+} MADNS_RECORD;
+
+// Every address of a name, as cached from its A and AAAA RRsets
+//  (or a response). If neither family has an address, the answer is
+//  naddrs=1, addrs[0]=INADDR_NONE.
+//  For other qtypes, recs[] has the RRset; it points into the cache,
+//  and is valid until the next madns_response(_all/s) or madns_destroy.
+#define MADNS_MAX_ADDRS      32 // Larger RRsets are truncated.
+typedef struct madns_answer {
+    int         naddrs;         // 0: not cached, or query expired.
+    unsigned    ttl;            // secs left
+    int         flags;          // MADNS_STALE MADNS_NXDOMAIN
+    in_addr_t   addrs[MADNS_MAX_ADDRS]; // NXDOMAIN: addrs[0]=INADDR_NONE
+    int         naddrs6;
+    struct in6_addr addrs6[MADNS_MAX_ADDRS];
+    int         nrecs;
+    MADNS_RECORD const *recs;
+} MADNS_ANSWER;
+#define MADNS_STALE     1       // From an expired entry; see MADNS_SERVE_STALE.
+#define MADNS_CACHED    2       // A completion answered from the cache.
+#define MADNS_NXDOMAIN  4       // No address (or record) because the name
+                                //  does not exist; else it is NODATA.
+
+// Like madns_lookup, but returns the whole RRset, and any cached AAAA RRset.
+//  With MADNS_ROTATE, each call starts one address further on.
+// Returns ans->naddrs + ans->naddrs6.
+int     madns_lookup_all(MADNS const *, char const *host, MADNS_ANSWER *);
+
+// Look up a cached (qtype) RRset, other than A or AAAA.
+// Returns ans->nrecs, or:
+//      0:  not in cache.
+//      -1: in cache as having no such records (NXDOMAIN or NODATA),
+//          or invalid; ans->addrs[0]=INADDR_NONE.
+int     madns_lookup_rr(MADNS const *, char const *host, int qtype,
+                        MADNS_ANSWER *);
+
+// madns_lookup_rr(PTR) of the in-addr.arpa name for (ip), built directly.
+int     madns_lookup_ptr(MADNS const *, in_addr_t ip, MADNS_ANSWER *);
+
 // Post request to a DNS server.
-//  Returns 0 if strlen(host) > 1024 or not ready or I/O error.
-// Otherwise, returns (DNS) transaction ID 1..65535.
+//  Returns 0 if refused, with errno EINVAL if host (or qtype) is invalid
+//  (see madns_lookup), EAGAIN if there are too few free query slots (try
+//  again after a response), or ENOBUFS if its search list needs more
+//  slots than madns has. Otherwise, returns (DNS) transaction ID 1..65535.
 int     madns_request(MADNS *, char const *host, void *context);
 
-// Cancel request matching context.
-//      Returns 0 if request not found.
+// Post a request for (af) addresses: AF_INET (A, as madns_request),
+//  AF_INET6 (AAAA), or AF_UNSPEC: A and AAAA queries sent together,
+//  completed as one response when both have answered. Both RRsets are
+//  cached under the one name. AF_UNSPEC needs madns_ready() >= 2.
+int     madns_request_af(MADNS *, char const *host, void *context, int af);
+
+// Post a request for any record type (MADNS_T_MX etc).
+//  The completion, from madns_response_all, has the records in ans->recs.
+int     madns_request_rr(MADNS *, char const *host, int qtype, void *context);
+
+// Post a PTR request for the in-addr.arpa name of (ip).
+int     madns_request_ptr(MADNS *, in_addr_t ip, void *context);
+
+// Cancel request matching context (the oldest, if there are several).
+//      Returns 0 if request not found, else its transaction ID.
 int     madns_cancel(MADNS *, void const *context);
 
+// Cancel every request posted with this context, e.g. all requests
+//  for one connection that is being torn down.
+//      Returns the number of requests cancelled.
+int     madns_cancel_all(MADNS *, void const *context);
+
 // Retrieve a DNS response (ip) or expiry.
 //  Returns the context ptr from madns_request(), and sets *ip:
 //      INADDR_ANY:  an expired request.
-//      INADDR_NONE: NXDOMAIN
+//      INADDR_NONE: NXDOMAIN, or no A records.
 // Returns NULL when there are no more responses pending.
+// This also sends any refresh-ahead queries (see MADNS_REFRESH).
 void   *madns_response(MADNS *, in_addr_t * ip);
 
+// Like madns_response, but returns every address in the answer.
+//  Use this for madns_request_af(AF_INET6 or AF_UNSPEC) and
+//  madns_request_rr requests.
+void   *madns_response_all(MADNS *, MADNS_ANSWER *);
+
+// A completed request, as returned in bulk by madns_responses.
+typedef struct madns_completion {
+    void       *ctx;
+    int         rcode;          // DNS RCODE: 0 NOERROR, 2 SERVFAIL,
+                                //  3 NXDOMAIN ...; -1: no answer (expired,
+                                //  or answered stale; see ans.flags).
+    double      latency;        // secs from request to completion.
+    in_addr_t   server;         // that answered; INADDR_ANY if none.
+    MADNS_ANSWER ans;           // ans.flags: MADNS_STALE MADNS_CACHED
+                                //  MADNS_NXDOMAIN
+} MADNS_COMPLETION;
+
+// Fill out[0..max) with completions, as madns_response_all would return
+//  one at a time. Record views in every out[].ans stay valid until the
+//  next madns_response(s) call.
+// Returns the number of out[] filled; 0 when none are pending.
+int     madns_responses(MADNS *, MADNS_COMPLETION *out, int max);
+
+// Set a run-time parameter. Returns the previous value, or -1.
+typedef enum {
+    MADNS_ROTATE = 1,   // 1: madns_lookup(_all) rotates through the RRset.
+    MADNS_REFRESH,      // 1..100: refresh-ahead a cache entry that has been
+                        //  looked up MADNS_REFRESH_HITS times, once this %
+                        //  of its TTL has passed. Lookups keep hitting the
+                        //  old entry until the answer replaces it. 0: off.
+    MADNS_REFRESH_HITS,
+    MADNS_SERVE_STALE,  // secs: keep expired entries this long (RFC 8767).
+                        //  A request for such a name that fails, expires,
+                        //  or is unanswered after MADNS_STALE_WAIT msecs
+                        //  completes with the expired addresses and the
+                        //  MADNS_STALE flag; the query carries on as a
+                        //  refresh. madns_lookup never returns them. 0: off.
+                        //  This applies to AF_INET requests.
+    MADNS_STALE_WAIT,
+    MADNS_EDNS,         // 512..4096: UDP payload size offered in an EDNS0
+                        //  OPT record (RFC 6891). 0: no OPT; 512 bytes max.
+                        //  Truncated answers are asked again over TCP.
+    MADNS_TCP_CONNS,    // 1..MADNS_TCP_MAXCONNS: TCP connections per server.
+                        //  Each carries any number of queries at once.
+    MADNS_TCP,          // 1: send every query over TCP, for networks that
+                        //  lose UDP packets. Poll madns_pollfds. 0: UDP.
+    MADNS_URING,        // 1: send and receive UDP through io_uring (Linux);
+                        //  madns_fileno is then the ring's eventfd. Sends go
+                        //  out at the next madns_expires or madns_response.
+                        //  Set while no request is active; -1 if unsupported.
+    MADNS_WATCH,        // 1: watch resolv.conf (inotify; Linux) and reload
+                        //  it when it is written or replaced. Changes are
+                        //  noticed by madns_expires; the watch fd is in
+                        //  madns_pollfds. -1 if unsupported.
+    MADNS_TRACE,        // 1..MADNS_TRACE_MAX: queue trace events, for
+                        //  madns_trace_read, in a ring of this many
+                        //  (rounded up to a power of 2). 0: off.
+} MADNS_PARAM;
+#define MADNS_REFRESH_HITS_DEFAULT  4
+#define MADNS_STALE_WAIT_DEFAULT    1800
+#define MADNS_EDNS_DEFAULT          1232
+#define MADNS_TCP_CONNS_DEFAULT     2
+#define MADNS_TCP_MAXCONNS          8
+#define MADNS_TRACE_MAX             (1 << 20)
+int     madns_set(MADNS *, MADNS_PARAM, int value);
+
+//--------------|---------------------------------------------
+#ifdef __linux__
+// A driver loop: one thread runs madns under epoll, and any thread may
+//  submit requests. Completions go to the callback, on the loop thread;
+//  record views in (c->ans) are valid only during the call.
+typedef struct madns_loop MADNS_LOOP;
+typedef void MADNS_CALLBACK(void *arg, MADNS_COMPLETION const *c);
+
+// Returns NULL if out of memory or fds. The loop does not own (mp);
+//  after madns_loop_create, only the loop thread may use it.
+MADNS_LOOP *madns_loop_create(MADNS *, MADNS_CALLBACK *, void *arg);
+void    madns_loop_destroy(MADNS_LOOP *);
+
+// The epoll fd: readable when madns_loop_run has work to do.
+int     madns_loop_fileno(MADNS_LOOP const *);
+
+// Wait up to timeout_ms (-1: forever) for events, take submissions,
+//  and deliver completions. Call this from one thread only.
+// Returns the number of completions delivered, or -1 on error.
+int     madns_loop_run(MADNS_LOOP *, int timeout_ms);
+
+// Queue a (qtype) request from any thread, without locks. A request
+//  answered from the cache completes at once, with MADNS_CACHED and
+//  rcode 0; one madns refuses, other than for want of a free query slot,
+//  completes with rcode -1 and INADDR_NONE. The rest wait in the queue.
+// Returns 0 if the queue is full (about 2 * reqs), or host is too long.
+int     madns_loop_submit(MADNS_LOOP *, char const *host, int qtype,
+                          void *context);
+
+// Make a madns_loop_run that is waiting return (from any thread).
+void    madns_loop_wake(MADNS_LOOP *);
+#endif
+
 //--------------|---------------------------------------------
 typedef enum { SUMMARY = 0, QUERIES = 1, CACHE = 2 } MADNS_OPTS;
 void    madns_dump(MADNS const *, FILE *, MADNS_OPTS);
 
+// Counters since madns_create, kept up to date as things happen, so
+//  reading them is cheap; madns_dump walks every query and cache slot.
+//  Lookups, which may run in many threads at once, count hits and misses
+//  with relaxed atomic adds; every other counter changes only in calls
+//  that must not run alongside another.
+//  Latencies are in secs, from log-linear histograms (within 12.5%).
+typedef struct madns_stats {
+    uint64_t requests;          // Requests taken (a search request is one).
+    uint64_t drops;             // Refused: no free query, or an invalid name.
+    uint64_t sends;             // Queries sent, retries included.
+    uint64_t retries;           // Sent again after query_time; see attempts.
+    uint64_t truncated;         // Truncated over UDP, so asked over TCP.
+    uint64_t answers;           // Server answers matched to a query,
+    uint64_t nxdomains;         //  of which NXDOMAIN;
+    uint64_t errors;            //  of which SERVFAIL, REFUSED etc.
+    uint64_t expiries;          // Queries never answered.
+    uint64_t stale;             // Requests answered with an expired entry.
+    uint64_t refreshes;         // Refresh-ahead queries.
+    uint64_t hits, misses;      // Lookups found (or not) in the cache.
+    uint64_t rebuilds;          // Cache table rebuilds.
+    uint64_t trace_lost;        // Trace events dropped: the ring was full.
+    int     entries, limit;     // Cache entries; table slots.
+    int     active;             // Queries in flight.
+    int     nservs;
+    double  p50, p99, p999;     // Request latency (as MADNS_COMPLETION).
+} MADNS_STATS;
+void    madns_stats(MADNS const *, MADNS_STATS *);
+
+// Server (i) of MADNS_STATS.nservs: its answers and response times.
+//  Returns 0 if there is no such server.
+typedef struct {
+    in_addr_t ip;
+    int     reqs;               // In flight.
+    uint64_t sends, answers;
+    double  latency;            // Decaying average, to choose servers by.
+    double  p50, p99, p999;     // Time from (last) send to answer.
+} MADNS_SERVER_STATS;
+int     madns_server_stats(MADNS const *, int i, MADNS_SERVER_STATS *);
+
+// Write the counters, and the request and per-server latency histograms,
+//  in the Prometheus text format (0.0.4), for a scraper to serve.
+void    madns_prometheus(MADNS const *, FILE *);
+
+// Query lifecycle tracing, cheap enough to leave on. With MADNS_TRACE set,
+//  each stage of each query (each half of an A+AAAA request, each search
+//  candidate) queues an event; another thread may drain them. Where
+//  <sys/sdt.h> is installed, the same points are USDT probes: provider
+//  "madns", probe "request" etc., args (tid, server, qtype, value, name),
+//  a nop apiece until bpftrace or SystemTap attaches.
+typedef enum {
+    MADNS_EV_REQUEST = 1,       // value: 1 if half of an A+AAAA request.
+    MADNS_EV_SEND,              // value: 1 over TCP. Also a resend.
+    MADNS_EV_RETRY,             // value: sends left after this one.
+    MADNS_EV_RECEIVE,           // value: message bytes. At arrival.
+    MADNS_EV_PARSE,             // value: rcode. Parsed and matched.
+    MADNS_EV_CACHE,             // value: TTL of the new entry.
+    MADNS_EV_COMPLETE,          // value: rcode; -1 expired; -2 cancelled.
+} MADNS_EVENT_TYPE;
+
+typedef struct {
+    uint64_t nsecs;             // CLOCK_REALTIME.
+    in_addr_t server;           // INADDR_ANY before the first send.
+    int32_t value;
+    uint16_t tid;               // As madns_request returned, for the first.
+    uint16_t qtype;
+    uint8_t event;              // MADNS_EVENT_TYPE.
+} MADNS_EVENT;
+
+// Move up to (max) queued events, oldest first, to out[].
+//  Returns the number moved. Safe to call from one thread other than
+//  the one calling madns; set MADNS_TRACE before that thread starts,
+//  and clear it after it stops. Events that find the ring full are
+//  dropped, and counted in MADNS_STATS.trace_lost.
+int     madns_trace_read(MADNS *, MADNS_EVENT *out, int max);
+
 // Enable diagnostics with "madns_log = stderr".
 extern FILE *madns_log;
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // MADNS_H
@@ -0,0 +1,245 @@
+// madns.hpp: a header-only C++20 layer over madns.h.
+//
+//  mad::Resolver owns a MADNS. In a coroutine,
+//
+//      MADNS_COMPLETION c = co_await resolver.resolve("example.com");
+//
+//  suspends until the answer arrives. The awaiter lives in the coroutine
+//  frame and is itself the madns request context, so a query allocates
+//  nothing. A name already in the cache completes without suspending
+//  (ans.flags has MADNS_CACHED). Destroying a suspended coroutine cancels
+//  its query. A request refused for want of a free query slot waits,
+//  and is posted as dispatch() frees slots; a Resolver must not move
+//  while coroutines are waiting on it.
+//
+//  Nothing runs by itself: whatever executor polls the fds from pollfds()
+//  calls dispatch() when one is readable or expires() has passed, and
+//  dispatch() resumes the completed coroutines, on that thread. run_once()
+//  does one such poll() round.
+//
+//  Record views in a completion (ans.recs) are valid until the coroutine
+//  next suspends.
+
+#ifndef MADNS_HPP
+#define MADNS_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <poll.h>
+
+#include "madns.h"
+
+namespace mad {  // "madns" is taken: struct madns.
+
+class Resolver {
+  public:
+    class Awaiter;
+
+    // Parameters as for madns_create; (0) means "use the default".
+    explicit Resolver(char const *resolv_conf = nullptr, int query_time = 0,
+                      int server_reqs = 0)
+        : mp_(madns_create(resolv_conf, query_time, server_reqs))
+    {
+        if (!mp_)
+            throw std::runtime_error("madns_create failed");
+    }
+
+    Resolver(Resolver &&r) noexcept : mp_(std::exchange(r.mp_, nullptr)) {}
+    Resolver &operator=(Resolver &&r) noexcept
+    {
+        std::swap(mp_, r.mp_);
+        return *this;
+    }
+    Resolver(Resolver const &) = delete;
+    Resolver &operator=(Resolver const &) = delete;
+
+    ~Resolver()
+    {
+        if (mp_)
+            madns_destroy(mp_);
+    }
+
+    MADNS  *get() const noexcept { return mp_; }
+    int     set(MADNS_PARAM p, int value) noexcept { return madns_set(mp_, p, value); }
+    int     pollfds(struct pollfd *fds, int max) const noexcept
+    {
+        return madns_pollfds(mp_, fds, max);
+    }
+    int     expires() noexcept { return madns_expires(mp_); }
+
+    // co_await resolve(name, qtype): A by default; MADNS_T_AAAA, MADNS_T_MX
+    //  etc. as for madns_request_rr. (name) must outlive the co_await.
+    Awaiter resolve(char const *name, int qtype = MADNS_T_A) noexcept;
+
+    // Resume every coroutine whose request has completed or expired.
+    //  Returns the number resumed.
+    int     dispatch();
+
+    // poll() the madns fds for up to timeout_ms (-1: until the next
+    //  expiry), then dispatch().
+    int     run_once(int timeout_ms = -1);
+
+  private:
+    int     retry();
+
+    MADNS  *mp_;
+    Awaiter *wait_ = nullptr;       // Refused for want of a slot, oldest
+    Awaiter **wait_end_ = &wait_;   //  first; posted again by dispatch().
+    std::vector<struct pollfd> fds_;    // For run_once; grows as needed.
+};
+
+class Resolver::Awaiter {
+  public:
+    Awaiter(Resolver *r, char const *name, int qtype) noexcept
+        : r_(r), mp_(r->mp_), name_(name), qtype_(qtype) {}
+
+    // Its address is the request context, so it never moves.
+    Awaiter(Awaiter const &) = delete;
+    Awaiter &operator=(Awaiter const &) = delete;
+
+    ~Awaiter()
+    {
+        if (pending_)
+            madns_cancel(mp_, this);
+        else if (prev_)
+            unlink();
+    }
+
+    bool    await_ready() noexcept
+    {
+        int     hit;
+
+        if (qtype_ == MADNS_T_A || qtype_ == MADNS_T_AAAA)
+            hit = madns_lookup_all(mp_, name_, &c_.ans)
+                && (qtype_ == MADNS_T_AAAA ? c_.ans.naddrs6 : c_.ans.naddrs);
+        else
+            hit = madns_lookup_rr(mp_, name_, qtype_, &c_.ans) != 0;
+
+        if (hit) {
+            c_.ctx = this, c_.rcode = 0, c_.latency = 0, c_.server = INADDR_ANY;
+            c_.ans.flags |= MADNS_CACHED;
+        }
+        return hit;
+    }
+
+    // A request with no free query slot waits for one. Any other that
+    //  madns refuses (an invalid name) completes at once with rcode -1
+    //  and INADDR_NONE.
+    bool    await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        handle_ = h;
+        if (madns_request_rr(mp_, name_, qtype_, this))
+            return pending_ = true;
+        if (errno != EAGAIN)
+            return refuse(), false;
+
+        prev_ = r_->wait_end_, *prev_ = this, next_ = nullptr;
+        r_->wait_end_ = &next_;
+        return true;
+    }
+
+    MADNS_COMPLETION await_resume() const noexcept { return c_; }
+
+  private:
+    friend class Resolver;
+
+    void    complete(MADNS_COMPLETION const &c) noexcept
+    {
+        pending_ = false;
+        c_ = c;
+        handle_.resume();
+    }
+
+    void    refuse() noexcept
+    {
+        c_ = MADNS_COMPLETION{};
+        c_.ctx = this, c_.rcode = -1, c_.server = INADDR_ANY;
+        c_.ans.naddrs = 1, c_.ans.addrs[0] = INADDR_NONE;
+    }
+
+    void    unlink() noexcept
+    {
+        *prev_ = next_;
+        if (next_)
+            next_->prev_ = prev_;
+        else
+            r_->wait_end_ = prev_;
+        prev_ = nullptr;
+    }
+
+    Resolver *r_;
+    MADNS  *mp_;
+    char const *name_;
+    int     qtype_;
+    bool    pending_ = false;
+    Awaiter *next_ = nullptr, **prev_ = nullptr;   // In r_->wait_.
+    std::coroutine_handle<> handle_;
+    MADNS_COMPLETION c_;
+};
+
+inline Resolver::Awaiter
+Resolver::resolve(char const *name, int qtype) noexcept
+{
+    return Awaiter(this, name, qtype);
+}
+
+// One completion at a time: a resumed coroutine may destroy another
+//  whose answer is already in hand, cancelling it.
+inline int
+Resolver::dispatch()
+{
+    MADNS_COMPLETION c;
+    int     n = 0;
+
+    while (madns_responses(mp_, &c, 1) == 1) {
+        static_cast<Awaiter *>(c.ctx)->complete(c);
+        n += 1 + retry();
+    }
+    return n;
+}
+
+// Post waiting requests, oldest first, while there are free slots.
+//  Returns the number refused for good, and so resumed.
+inline int
+Resolver::retry()
+{
+    int     n = 0;
+
+    while (wait_ && madns_ready(mp_) > 0) {
+        Awaiter *ap = wait_;
+
+        if (madns_request_rr(mp_, ap->name_, ap->qtype_, ap))
+            ap->unlink(), ap->pending_ = true;
+        else if (errno == EAGAIN)
+            break;              // A search wants more slots: still first.
+        else
+            ap->unlink(), ap->refuse(), ap->handle_.resume(), ++n;
+    }
+    return n;
+}
+
+inline int
+Resolver::run_once(int timeout_ms)
+{
+    int     n, secs = expires();
+
+    if (timeout_ms < 0 || timeout_ms > 1000 * secs)
+        timeout_ms = 1000 * secs;
+
+    // A full vector may have left fds out: TCP connections, per server.
+    if (fds_.empty())
+        fds_.resize(8);
+    while ((n = pollfds(fds_.data(), fds_.size())) == (int)fds_.size())
+        fds_.resize(2 * fds_.size());
+
+    if (poll(fds_.data(), n, timeout_ms) < 0)
+        return -1;
+    return dispatch();
+}
+
+}   // namespace mad
+
+#endif // MADNS_HPP
@@ -0,0 +1,120 @@
+// "madns_bench" times cached lookups, one at a time (madns_lookup)
+//  and in batches (madns_lookup_many), for a range of cache sizes.
+//  It includes madns.c to fill the cache without a DNS server.
+//  Then it times loading names one at a time (update_cache) against
+//  madns_preload of a hosts file, and the heap each one takes.
+
+#include "madns.c"
+#include <malloc.h>             // mallinfo2
+
+static size_t
+heap_used(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd;     // Big blocks are mmap'd apart.
+}
+
+#define NLOOKUPS    (1 << 21)
+#define NBATCH      64
+
+int
+main(int argc, char **argv)
+{
+    char   *conf = getenv("madns");
+    int     maxsize = argc > 1 ? atoi(argv[1]) : 1 << 20;
+
+    asprintf(&conf, "%s/resolv.conf", conf ? conf : ".");
+    printf("# %9s %9s %12s %12s\n", "names", "limit", "lookup/s", "many/s");
+
+    int     size;
+
+    for (size = 1 << 10; size <= maxsize; size <<= 2) {
+        MADNS  *mp = madns_create(conf, 0, 0);
+        char  **names = malloc(size * sizeof *names);
+        char const **batch = malloc(NLOOKUPS * sizeof *batch);
+        in_addr_t *out = malloc(NLOOKUPS * sizeof *out);
+        QUERY   q;
+        RESPONSE r = {.qtype = 1,.naddrs = 1,.ttl = 3600 };
+        int     i, hits = 0;
+
+        for (i = 0; i < size; ++i) {
+            asprintf(&names[i], "Host%d.Bench.Example", i);
+            q.len = normalize(names[i], q.name, &q.hash);
+            r.addrs[0] = htonl(0x0A000000 + i);
+            update_cache(mp, q.name, q.len, q.hash, &r, r.ttl, 0);
+        }
+
+        for (i = 0; i < NLOOKUPS; ++i)
+            batch[i] = names[rand() % size];
+
+        double  t0 = tick();
+
+        for (i = 0; i < NLOOKUPS; ++i)
+            hits += madns_lookup(mp, batch[i]) != INADDR_ANY;
+
+        double  t1 = tick();
+
+        for (i = 0; i < NLOOKUPS; i += NBATCH)
+            hits += madns_lookup_many(mp, batch + i, out + i, NBATCH);
+
+        double  t2 = tick();
+
+        printf("  %9d %9d %12.0f %12.0f%s\n", size, mp->limit,
+               NLOOKUPS / (t1 - t0), NLOOKUPS / (t2 - t1),
+               hits == 2 * NLOOKUPS ? "" : " MISSES!");
+
+        for (i = 0; i < size; ++i)
+            free(names[i]);
+        free(names), free(batch), free(out);
+        madns_destroy(mp);
+    }
+
+    char    hosts[] = "/tmp/madns_bench.XXXXXX";
+    FILE   *fp = fdopen(mkstemp(hosts), "w");
+
+    printf("# %9s %12s %12s %12s %12s\n", "names", "update s",
+           "update MB", "preload s", "preload MB");
+    for (size = 1 << 10; fp && size <= maxsize; size <<= 2) {
+        MADNS  *mp = madns_create(conf, 0, 0);
+        QUERY   q;
+        RESPONSE r = {.qtype = 1,.naddrs = 1,.ttl = 3600 };
+        char    name[64];
+        int     i;
+
+        rewind(fp);
+        for (i = 0; i < size; ++i)
+            fprintf(fp, "10.%d.%d.%d\tsvc%d.bench.example\n", i >> 16 & 255,
+                    i >> 8 & 255, i & 255, i);
+        fflush(fp);
+
+        size_t  heap = heap_used();
+        double  t0 = tick();
+
+        for (i = 0; i < size; ++i) {
+            snprintf(name, sizeof name, "svc%d.bench.example", i);
+            q.len = normalize(name, q.name, &q.hash);
+            r.addrs[0] = htonl(0x0A000000 + i);
+            update_cache(mp, q.name, q.len, q.hash, &r, r.ttl, 0);
+        }
+
+        double  t1 = tick();
+        size_t  heap1 = heap_used();
+
+        madns_destroy(mp);
+        mp = madns_create(conf, 0, 0);
+        heap = heap_used();
+
+        MADNS_PRELOAD st = { 0 };
+        int     n = madns_preload(mp, hosts, 0, &st);
+
+        printf("  %9d %12.3f %12.1f %12.3f %12.1f%s\n", size, t1 - t0,
+               (heap1 - heap) / 1E6, st.secs,
+               (heap_used() - heap) / 1E6, n == size ? "" : " MISSES!");
+        madns_destroy(mp);
+    }
+    if (fp)
+        fclose(fp), unlink(hosts);
+
+    return 0;
+}
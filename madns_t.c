@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>             // getenv
+#include <string.h>             // strstr
+#include <time.h>
 #include <unistd.h>             // sleep
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>          // inet_ntoa
 
 #include "tap.h"
@@ -9,17 +15,358 @@
 
 #define iptoa(ip)    inet_ntoa((struct in_addr){ip})
 
+static MADNS_COMPLETION looped;
+
+static void
+loop_done(void *arg, MADNS_COMPLETION const *c)
+{
+    (void)arg;
+    looped = *c;
+}
+
+//--------------|---------------------------------------------
+// A fake upstream on FAKE:53 and FAKE2:53, and TCP on FAKE:53, forked
+//  before the tests (which are skipped if it cannot bind), so they need
+//  no network. fake_answer
+//  crafts its answers by name; a name it does not know is REFUSED.
+#define FAKE    "127.53.0.2"
+#define FAKE2   "127.53.0.3"
+
+// How often the fake was asked each name, in memory shared with it.
+static struct {
+    int     accepts, tcp;       // TCP connections, and queries over them.
+    int     nnames;
+    struct { char name[64]; int asked; } q[64];
+} *seen;
+
+// Returns how often (name) was asked, after adding (n).
+static int
+fake_asked(char const *name, int n)
+{
+    int     i;
+
+    for (i = 0; i < seen->nnames && strcmp(seen->q[i].name, name); ++i);
+    if (i == seen->nnames && (!n || i == 64 || strlen(name) >= 64))
+        return 0;
+    if (i == seen->nnames)
+        strcpy(seen->q[seen->nnames++].name, name);
+    return seen->q[i].asked += n;
+}
+
+static uint8_t *
+put16(uint8_t * p, unsigned v)
+{
+    *p++ = v >> 8, *p++ = v;
+    return p;
+}
+
+static uint8_t *
+put32(uint8_t * p, unsigned v)
+{
+    return put16(put16(p, v >> 16), v);
+}
+
+static uint8_t *
+put_name(uint8_t * p, char const *name)
+{
+    while (*name) {
+        int     len = strcspn(name, ".");
+
+        *p++ = len, memcpy(p, name, len), p += len, name += len;
+        name += *name == '.';
+    }
+    *p++ = 0;
+    return p;
+}
+
+// The rest of an RR, after its owner name: class IN.
+static uint8_t *
+put_rr(uint8_t * p, int type, unsigned ttl, int rdlen)
+{
+    return put16(put32(put16(put16(p, type), 1), ttl), rdlen);
+}
+
+// An SOA record for the zone at (zone), an offset into the packet.
+static uint8_t *
+put_soa(uint8_t * p, unsigned zone, unsigned ttl, unsigned minimum)
+{
+    p = put_rr(put16(p, 0xC000 | zone), 6, ttl, 2 + 2 + 20);
+    p = put16(put16(p, 0xC000 | zone), 0xC000 | zone);  // MNAME, RNAME
+    return put32(put32(put32(put32(put32(p, 1), 2), 3), 4), minimum);
+}
+
+// Append the answer to the query in pkt[0..len), which came to (self)
+//  (host order), and make it a response.
+// Returns its length; 0 to drop the query.
+static int
+fake_answer(uint8_t * pkt, int len, int tcp, uint32_t self)
+{
+    uint8_t *p = pkt + 12, *end = pkt + len;
+    char    name[256], cname[300];
+    int     n = 0, i, qtype, rcode = 0, an = 0, ns = 0, tc = 0;
+    int     edns = pkt[10] << 8 | pkt[11];      // ARCOUNT: an OPT record.
+
+    for (*name = 0; p < end && *p && p + *p < end; p += *p + 1)
+        n += sprintf(name + n, "%s%.*s", n ? "." : "", *p, p + 1);
+    if (p + 5 > end)
+        return 0;
+    qtype = p[1] << 8 | p[2], p += 5;
+    int     asked = fake_asked(name, 1);
+    unsigned parent = 12 + 1 + pkt[12];  // The qname, less its first label.
+
+    if (!strcmp(name, "google.com") && qtype == 1) {
+        p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x08080808), an = 1;
+    } else if (!strcmp(name, "google.com") && qtype == 15) {
+        uint8_t *rd = put_rr(put16(p, 0xC00C), 15, 300, 0);
+
+        p = put16(rd, 10), *p++ = 4, memcpy(p, "mail", 4);
+        p = put16(p + 4, 0xC00C), put16(rd - 2, p - rd), an = 1;
+    } else if (!strcmp(name, "facebook.com") && qtype == 1) {
+        for (i = 0; i < 2; ++i, ++an)
+            p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x01020304 + i);
+    } else if (!strncmp(name, "invalid.", 8) || !strcmp(name, "nx.test")) {
+        p = put_soa(p, parent, 3600, 60), rcode = 3, ns = 1;
+    } else if (!strcmp(name, "nodata.test")) {
+        p = put_soa(p, parent, 30, 60), ns = 1;
+
+    // Parser cases: all A queries.
+    } else if (!strcmp(name, "mid.test")) {     // "mid" + pointer to "test"
+        *p++ = 3, memcpy(p, "mid", 3), p += 3;
+        p = put32(put_rr(put16(p, 0xC000 | 16), 1, 300, 4), 0x0A001E01), an = 1;
+    } else if (!strcmp(name, "fwd.test")) {     // Points into its rdata.
+        p = put16(p, 0xC000 | (p - pkt + 12));
+        p = put32(put_rr(p, 1, 300, 4), 0x0A001E02), an = 1;
+    } else if (!strcmp(name, "loop.test")) {    // Points to itself.
+        p = put16(p, 0xC000 | (p - pkt));
+        p = put32(put_rr(p, 1, 300, 4), 0x0A001E03), an = 1;
+    } else if (!strcmp(name, "long.test")) {    // A 64-byte label.
+        *p++ = 64, memset(p, 'x', 64), p += 64, *p++ = 0;
+        p = put32(put_rr(p, 1, 300, 4), 0x0A001E04), an = 1;
+    } else if (!strcmp(name, "short.test")) {   // 2 bytes of A rdata.
+        p = put16(put_rr(put16(p, 0xC00C), 1, 300, 2), 0x0A00), an = 1;
+    } else if (!strcmp(name, "past.test")) {    // rdlength past the end.
+        p = put16(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x0A00), an = 1;
+    } else if (!strcmp(name, "other.test")) {   // Another question.
+        p = put16(put16(put_name(pkt + 12, "else.test"), 1), 1);
+        p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x0A001E05), an = 1;
+    } else if (!strcmp(name, "chain.test") || !strcmp(name, "chain8.test")) {
+        unsigned owner = 12;    // CNAMEs c1.(name) .. c10 or c8, then A.
+
+        for (i = 1; i <= (name[5] == '8' ? 8 : 10); ++i, ++an) {
+            uint8_t *rd = put_rr(put16(p, 0xC000 | owner), 5, 300, 0);
+
+            snprintf(cname, sizeof cname, "c%d.%s", i, name);
+            p = put_name(rd, cname), put16(rd - 2, p - rd);
+            owner = rd - pkt;
+        }
+        p = put32(put_rr(put16(p, 0xC000 | owner), 1, 300, 4), 0x0A001E08);
+        ++an;
+    } else if (!strcmp(name, "cn.test")) {      // To a CDN: TTLs 600 100 200.
+        uint8_t *rd = put_rr(put16(p, 0xC00C), 5, 600, 0);
+
+        p = put_name(rd, "e1.cdn.test"), put16(rd - 2, p - rd);
+        rd = put_rr(put16(p, 0xC000 | (rd - pkt)), 5, 100, 0);
+        p = put_name(rd, "e2.cdn.test"), put16(rd - 2, p - rd);
+        p = put_rr(put16(p, 0xC000 | (rd - pkt)), 1, 200, 4);
+        p = put32(p, 0x0A002001), an = 3;
+    } else if (!strcmp(name, "hot.test") || !strcmp(name, "cold.test")) {
+        if (*name == 'c' && asked > 1)
+            return 0;           // Unanswered after the first time.
+        p = put32(put_rr(put16(p, 0xC00C), 1, 6, 4), 0x0A002201), an = 1;
+    } else if (!strcmp(name, "stale.test")) {
+        if (asked > 1)
+            return 0;
+        p = put32(put_rr(put16(p, 0xC00C), 1, 1, 4), 0x0A002301), an = 1;
+    } else if (!strcmp(name, "dual.test") || !strcmp(name, "half.test")
+               || !strcmp(name, "half6.test")) {
+        if (qtype == 28 && strcmp(name, "half.test")) {
+            uint8_t ip6[16] = { 0x20, 0x01, 0x0d, 0xb8,[15] = 0x36 };
+
+            p = put_rr(put16(p, 0xC00C), 28, 300, 16);
+            memcpy(p, ip6, 16), p += 16, an = 1;
+        } else if (qtype == 1 && strcmp(name, "half6.test")) {
+            p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x0A002401), an = 1;
+        } else {
+            rcode = 2;
+        }
+    } else if (!strcmp(name, "mx.test") && qtype == 15) {
+        for (i = 1; i <= 2; ++i, ++an) {        // 10 mx1.mx.test, 20 mx2
+            uint8_t *rd = put_rr(put16(p, 0xC00C), 15, 300, 2 + 4 + 2);
+
+            p = put16(rd, 10 * i), *p++ = 3, p += sprintf((char *)p, "mx%d", i);
+            p = put16(p, 0xC00C);
+        }
+    } else if (!strcmp(name, "_sip._udp.srv.test") && qtype == 33) {
+        uint8_t *rd = put_rr(put16(p, 0xC00C), 33, 300, 0);
+
+        p = put_name(put16(put16(put16(rd, 1), 2), 5060), "sip.srv.test");
+        put16(rd - 2, p - rd), an = 1;
+    } else if (!strcmp(name, "1.0.0.10.in-addr.arpa") && qtype == 12) {
+        uint8_t *rd = put_rr(put16(p, 0xC00C), 12, 300, 0);
+
+        p = put_name(rd, "host.ptr.test"), put16(rd - 2, p - rd), an = 1;
+    } else if (!strncmp(name, "who.", 4)) {    // Which server was asked?
+        p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), self), an = 1;
+    } else if (n > 10 && !strcmp(name + n - 10, ".pipe.test")) {
+        p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x0A002700 + *name - '0');
+        an = 1;
+    } else if (!strcmp(name, "tc.test")) {      // Too big for UDP.
+        if (!(tc = !tcp))
+            p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x0A002601), an = 1;
+    } else if (!strcmp(name, "old.test")) {     // EDNS: FORMERR.
+        if (!(rcode = edns ? 1 : 0))
+            p = put32(put_rr(put16(p, 0xC00C), 1, 300, 4), 0x0A002602), an = 1;
+    } else {
+        rcode = 5;
+    }
+
+    pkt[2] = 0x80 | (pkt[2] & 1) | tc << 1, pkt[3] = 0x80 | rcode;
+    put16(put16(put16(pkt + 6, an), ns), 0);
+    return p - pkt;
+}
+
+// fds[]: UDP on FAKE and FAKE2, TCP listening on FAKE, then connections.
+//  It exits when madns_t does, or is gone: it must not keep the ports.
+#define FAKE_FDS    16
+static void
+fake_upstream(struct pollfd *fds, int nfds, pid_t parent)
+{
+    uint8_t pkt[2 + 4096];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    int     i, len;
+    uint32_t self;
+
+    while (poll(fds, nfds, 1000) >= 0 && getppid() == parent) {
+        for (i = 0; i < nfds; ++i) {
+            self = ntohl(inet_addr(i == 1 ? FAKE2 : FAKE));
+            if (!fds[i].revents) {
+                continue;
+            } else if (i == 2) {
+                if (nfds < FAKE_FDS) {
+                    fds[nfds++] = (struct pollfd) {
+                    accept(fds[2].fd, NULL, NULL), POLLIN, 0};
+                    seen->accepts++;
+                }
+            } else if (i > 2) { // <length><query>, answered alike.
+                if (recv(fds[i].fd, pkt, 2, MSG_WAITALL) != 2
+                    || (len = recv(fds[i].fd, pkt + 2, pkt[0] << 8 | pkt[1],
+                                   MSG_WAITALL)) <= 12) {
+                    close(fds[i].fd), fds[i--] = fds[--nfds];
+                    continue;
+                }
+                seen->tcp++;
+                if ((len = fake_answer(pkt + 2, len, 1, self)) > 0)
+                    put16(pkt, len), send(fds[i].fd, pkt, 2 + len, 0);
+            } else {
+                fromlen = sizeof from;
+                len = recvfrom(fds[i].fd, pkt, 512, 0,
+                               (struct sockaddr *)&from, &fromlen);
+                if (len > 12 && (len = fake_answer(pkt, len, 0, self)) > 0)
+                    sendto(fds[i].fd, pkt, len, 0, (struct sockaddr *)&from,
+                           fromlen);
+            }
+        }
+    }
+    _exit(0);
+}
+
+// Returns the fake upstream's pid, or 0 if it cannot bind.
+static pid_t
+fake_start(void)
+{
+    char const *ips[] = { FAKE, FAKE2, FAKE };
+    struct pollfd fds[FAKE_FDS];
+    struct sockaddr_in addr = {.sin_family = AF_INET,.sin_port = htons(53) };
+    int     i, nbound = 0, on = 1;
+    pid_t   pid = 0, parent = getpid();
+
+    seen = mmap(NULL, sizeof *seen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    for (i = 0; i < 3; ++i) {
+        fds[i] = (struct pollfd) {
+        socket(AF_INET, i < 2 ? SOCK_DGRAM : SOCK_STREAM, 0), POLLIN, 0};
+        setsockopt(fds[i].fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        inet_pton(AF_INET, ips[i], &addr.sin_addr);
+        nbound += !bind(fds[i].fd, (struct sockaddr *)&addr, sizeof addr);
+    }
+    if (nbound == 3 && !listen(fds[2].fd, 8) && seen != MAP_FAILED
+        && !(pid = fork()))
+        fake_upstream(fds, 3, parent);
+    for (i = 0; i < 3; ++i)
+        close(fds[i].fd);
+    return pid > 0 ? pid : 0;
+}
+
+// A MADNS whose only server is the fake, with more resolv.conf (lines).
+static MADNS *
+fake_madns(char const *lines)
+{
+    char    conf[] = "/tmp/madns_t.XXXXXX";
+    FILE   *fp = fdopen(mkstemp(conf), "w");
+    MADNS  *mp;
+
+    fprintf(fp, "nameserver " FAKE "\noptions attempts:1 timeout:1\n%s", lines);
+    fclose(fp);
+    mp = madns_create(conf, 0, 0);
+    unlink(conf);
+    return mp;
+}
+
+// Take completions into done[] until there are (n), or (secs) pass.
+// Returns how many there are.
+static int
+collect(MADNS * mp, MADNS_COMPLETION * done, int n, int secs)
+{
+    time_t  end = time(0) + secs;
+    int     got = 0;
+
+    while (got < n && time(0) <= end) {
+        struct pollfd fds[8];
+        int     nfds = (madns_expires(mp), madns_pollfds(mp, fds, 8));
+
+        poll(fds, nfds, 100);
+        got += madns_responses(mp, done + got, n - got);
+    }
+    return got;
+}
+
+// The completion in done[0..n) for (ctx); one with rcode -99 if none.
+static MADNS_COMPLETION const *
+find(MADNS_COMPLETION const *done, int n, char const *ctx)
+{
+    static MADNS_COMPLETION const none = {.rcode = -99 };
+
+    while (n-- > 0)
+        if (done[n].ctx == ctx)
+            return &done[n];
+    return &none;
+}
+
 char const *default_argv[] =
         { "google.com", "cookie4you.com", "abc.com", NULL };
 
 int
 main(void)
 {
-    plan_tests(13);
+    plan_tests(58);
 
-    char *conf = getenv("madns");
-    int expt = asprintf(&conf, "%s/resolv.conf", conf ? conf : ".");
-    MADNS *mp = madns_create(conf, /*expiry */ expt = 5, /*reqs */ 4);
+    // Ask the fake; failing that, the servers in $madns/resolv.conf.
+    char *dir = getenv("madns"), *conf, fakeconf[] = "/tmp/madns_t.XXXXXX";
+    pid_t fake = fake_start();
+    FILE *fp;
+    int expt = 5;
+
+    if (fake) {
+        fp = fdopen(mkstemp(fakeconf), "w");
+        fputs("nameserver " FAKE "\nnameserver " FAKE2 "\n", fp);
+        fclose(fp);
+        conf = strdup(fakeconf);
+    } else {
+        asprintf(&conf, "%s/resolv.conf", dir ? dir : ".");
+    }
+
+    MADNS *mp = madns_create(conf, /*expiry */ expt, /*reqs */ 4);
     ok(mp, "created");
 
     int ret = madns_request(mp, "invalid.host1", (void *)(intptr_t) "INVALID host ONE");
@@ -38,6 +385,12 @@ main(void)
     ret = madns_cancel(mp, google);
     ok(ret == tid, "%s request cancelled: %d", google, ret);
 
+    char const *owner = "owner";
+    madns_request(mp, "yahoo.com", (void *)(intptr_t) owner);
+    madns_request(mp, "msn.com", (void *)(intptr_t) owner);
+    ret = madns_cancel_all(mp, owner);
+    ok(ret == 2, "cancel_all cancelled %d requests", ret);
+
     int secs = madns_expires(mp);
 
     ok(secs == expt, "next expiry in %d secs", secs);
@@ -79,15 +432,453 @@ main(void)
     ok(ip != INADDR_ANY, "facebook lookup returned: %s",
        iptoa(ip));
 
+    char const *names[] = { "10.1.2.3", "FACEbook.COM", google };
+    in_addr_t out[3];
+
+    ret = madns_lookup_many(mp, names, out, 3);
+    ok(ret == 1 + (ip != INADDR_ANY) && out[0] == inet_addr(names[0])
+       && out[1] == ip && out[2] == INADDR_ANY,
+       "lookup_many found %d of 3", ret);
+
+    ip = madns_lookup(mp, "www.Invalid.Host1");
+    ok(ip == INADDR_NONE, "lookup under NXDOMAIN invalid.host1 returned: %s",
+       iptoa(ip));
+
+    MADNS_ANSWER ans;
+
+    ret = madns_set(mp, MADNS_ROTATE, 1);
+    madns_lookup_all(mp, "FACEbook.COM", &ans);
+    ok(!ret && ans.naddrs >= 1 && madns_lookup(mp, "facebook.com")
+       == ans.addrs[1 % ans.naddrs], "lookup_all returned %d addrs, rotating",
+       ans.naddrs);
+
+    struct in6_addr ip6;
+
+    ret = madns_lookup6(mp, "2001:DB8::1", &ip6);
+    ok(ret == 1 && ip6.s6_addr[0] == 0x20 && ip6.s6_addr[15] == 1
+       && madns_lookup6(mp, "google.com", &ip6) == 0,
+       "lookup6 of a literal IPv6 address");
+
+    ret = madns_lookup_rr(mp, google, MADNS_T_MX, &ans);
+    ok(ret == 0 && madns_request_rr(mp, google, MADNS_T_MX, (void *)(intptr_t) "MX") > 0,
+       "MX not cached; request_rr posted");
+
+    struct pollfd fds[4];
+
+    ret = madns_pollfds(mp, fds, 4);
+    ok(ret >= 1 && fds[0].fd == madns_fileno(mp)
+       && madns_set(mp, MADNS_EDNS, 100) == -1
+       && madns_set(mp, MADNS_EDNS, 4096) == MADNS_EDNS_DEFAULT,
+       "pollfds has %d fds; EDNS size checked", ret);
+
     secs = madns_expires(mp);
     fprintf(stderr, "# sleep(expires=%d)\n", secs);
     sleep(secs);
+
+    MADNS_COMPLETION done[9];
+    int     i;
+
+    ret = madns_responses(mp, done, 8);
+    for (i = 0; i < ret; ++i)
+        fprintf(stderr, "# responses: %s rcode %d\n", (char *)done[i].ctx,
+                done[i].rcode);
+    ok(ret >= 1 && (done[0].rcode >= 0) == (done[0].server != INADDR_ANY),
+       "responses returned %d completions", ret);
     while ((cp = madns_response(mp, &ip)))
         fprintf(stderr, "# response: %s -> %s\n", cp,
                 iptoa(ip));
 
+    ret = madns_reload(mp, NULL);
+    ok(ret >= 1 && madns_reload(mp, "/nonexistent/resolv.conf") == -1
+       && madns_lookup(mp, "10.1.2.3") == inet_addr("10.1.2.3"),
+       "reload found %d servers; a missing file changes nothing", ret);
+
+    char hosts[] = "/tmp/madns_t.XXXXXX";
+
+    fp = fdopen(mkstemp(hosts), "w");
+    MADNS_PRELOAD st;
+
+    fputs("# pinned\n10.9.8.7 Pinned.Example alias.example\n"
+          "::1 pinned.example\n10.9.8.7 pinned.example.\n", fp);
+    fclose(fp);
+    ret = madns_preload(mp, hosts, 0, &st);
+    madns_lookup_all(mp, "alias.example", &ans);
+    ok(ret == 2 && st.addrs == 3 && madns_lookup(mp, "PINNED.example")
+       == inet_addr("10.9.8.7") && madns_lookup6(mp, "pinned.example", &ip6) == 1
+       && ans.naddrs == 1 && ans.ttl == 0,
+       "preload pinned %d names, %d addrs in %zu bytes", ret, st.addrs, st.bytes);
+
+    char search[] = "/tmp/madns_t.XXXXXX";
+    MADNS *sp;
+
+    fp = fdopen(mkstemp(search), "w");
+    fputs("nameserver 127.0.0.1\nsearch example\noptions ndots:2\n", fp);
+    fclose(fp);
+    sp = madns_create(search, 0, 0);
+    unlink(search);
+    ret = sp ? madns_preload(sp, hosts, 0, NULL) : -1;
+    ok(ret == 2 && madns_lookup(sp, "Pinned") == inet_addr("10.9.8.7")
+       && madns_lookup(sp, "pinned.example") == INADDR_ANY
+       && madns_lookup(sp, "pinned.example.") == inet_addr("10.9.8.7"),
+       "search list: a short name is found under its search domain");
+
+#ifdef __linux__
+    char watchdir[] = "/tmp/madns_t.XXXXXX", watched[64], *log = NULL;
+    size_t loglen;
+
+    snprintf(watched, sizeof watched, "%s/resolv.conf", mkdtemp(watchdir));
+    fp = fopen(watched, "w");
+    fputs("nameserver 127.0.0.1\n", fp);
+    fclose(fp);
+    ret = madns_set(sp, MADNS_WATCH, 1) == 0 && madns_reload(sp, watched) == 1;
+    madns_log = open_memstream(&log, &loglen);
+    fclose(fopen(watched, "a"));        // IN_CLOSE_WRITE
+    madns_expires(sp);
+    fclose(madns_log), madns_log = NULL;
+    ok(ret && strstr(log, "reloaded ") && strstr(log, watched),
+       "watch follows madns_reload to %s", watched);
+    unlink(watched), rmdir(watchdir), free(log);
+#else
+    skip(1, "MADNS_WATCH is Linux-only");
+#endif
+    madns_destroy(sp);
+    unlink(hosts);
+
+    fp = fdopen(mkstemp(strcpy(search, "/tmp/madns_t.XXXXXX")), "w");
+    fputs("server=/corp.example/127.0.0.1\noptions rotate\n", fp);
+    fclose(fp);
+    sp = madns_create(search, 0, 0);
+    unlink(search);
+    ret = sp ? madns_request(sp, "outside.example", (void *)(intptr_t) "none") : 0;
+    ok(ret > 0 && madns_responses(sp, done, 8) == 1 && done[0].rcode == -1,
+       "a name with no server to route to fails at once");
+    madns_destroy(sp);
+
+    MADNS_STATS st2;
+
+    fp = fdopen(mkstemp(strcpy(search, "/tmp/madns_t.XXXXXX")), "w");
+    fputs("nameserver 127.0.0.1\noptions attempts:2 timeout:1\n", fp);
+    fclose(fp);
+    sp = madns_create(search, 0, 0);
+    unlink(search);
+    ret = sp ? madns_request(sp, "drop.com", (void *)(intptr_t) "dropped") : 0;
+    for (i = 0; ret > 0 && i < 40 && !madns_responses(sp, done, 8); ++i)
+        usleep(100000);
+    madns_stats(sp, &st2);
+    ok(ret > 0 && i < 40 && done[0].rcode == -1 && st2.retries == 1
+       && st2.sends == 2 && st2.expiries == 1,
+       "attempts:2 sends an unanswered query twice: %d sends in %.1f secs",
+       (int)st2.sends, i / 10.0);
+    madns_destroy(sp);
+
+    MADNS_STATS stats;
+    char *prom = NULL;
+    size_t promlen;
+
+    madns_stats(mp, &stats);
+    fp = open_memstream(&prom, &promlen);
+    madns_prometheus(mp, fp);
+    fclose(fp);
+    ok(stats.requests == 7 && stats.hits + stats.misses >= 10
+       && strstr(prom, "\nmadns_requests_total 7\n")
+       && strstr(prom, "\nmadns_request_latency_seconds_bucket{le=\"+Inf\"}"),
+       "stats: %llu requests, %llu sends, %llu hits, p99 %.4f secs",
+       (unsigned long long)stats.requests, (unsigned long long)stats.sends,
+       (unsigned long long)stats.hits, stats.p99);
+    free(prom);
+
+    MADNS_EVENT ev[8];
+
+    ret = madns_set(mp, MADNS_TRACE, 50);
+    tid = madns_request(mp, "trace.example", (void *)(intptr_t) "trace");
+    madns_cancel(mp, "trace");
+    secs = madns_trace_read(mp, ev, 8);
+    ok(ret == 0 && secs >= 3 && ev[0].event == MADNS_EV_REQUEST
+       && ev[0].tid == tid && ev[1].event == MADNS_EV_SEND
+       && ev[secs - 1].event == MADNS_EV_COMPLETE && ev[secs - 1].value == -2
+       && madns_trace_read(mp, ev, 8) == 0 && madns_set(mp, MADNS_TRACE, 0) == 64,
+       "trace: %d events, request to cancel", secs);
+
+#ifdef __linux__
+    MADNS_LOOP *lp = madns_loop_create(mp, loop_done, NULL);
+
+    ret = lp && madns_loop_submit(lp, "10.1.2.3", MADNS_T_A, (void *)(intptr_t) "loop")
+        ? madns_loop_run(lp, 0) : -1;
+    ok(ret == 1 && looped.ans.flags & MADNS_CACHED
+       && looped.ans.addrs[0] == inet_addr("10.1.2.3"),
+       "loop completed a submission from the cache: %d", ret);
+    madns_loop_destroy(lp);
+#else
+    skip(1, "madns_loop is Linux-only");
+#endif
+
     madns_dump(mp, stderr, -1);
     madns_destroy(mp);
 
+    MADNS_COMPLETION const *c[9];
+
+    skip_start(!fake, 6, "cannot bind " FAKE " or " FAKE2 ":53");
+    char const *bad[] = { "mid.test", "fwd.test", "loop.test", "long.test",
+        "short.test", "past.test", "other.test", "chain.test", "chain8.test"
+    };
+
+    sp = fake_madns("");
+    for (i = 0; i < 9; ++i)
+        madns_request(sp, bad[i], (void *)(intptr_t) bad[i]);
+    ret = collect(sp, done, 9, 4);
+    for (i = 0; i < 9; ++i)
+        c[i] = find(done, ret, bad[i]);
+
+    ok(!c[0]->rcode && c[0]->ans.naddrs == 1
+       && c[0]->ans.addrs[0] == inet_addr("10.0.30.1")
+       && madns_lookup(sp, "mid.test") == inet_addr("10.0.30.1"),
+       "parse: a compression pointer mid-name is followed");
+    ok(!c[1]->rcode && !c[1]->ans.naddrs && !c[2]->rcode && !c[2]->ans.naddrs
+       && madns_lookup(sp, "fwd.test") == INADDR_ANY,
+       "parse: forward and looping pointers are not followed");
+    ok(c[3]->rcode == -1 && c[3]->server == INADDR_ANY
+       && c[5]->rcode == -1 && c[5]->server == INADDR_ANY,
+       "parse: a 64-byte label, or rdlength past the end, drops the answer");
+    ok(!c[4]->rcode && !c[4]->ans.naddrs && c[4]->server == inet_addr(FAKE),
+       "parse: an A record with 2 bytes of rdata is skipped");
+    ok(c[6]->rcode == -1 && c[6]->server == INADDR_ANY,
+       "parse: an answer to another question is dropped");
+    ok(!c[7]->rcode && !c[7]->ans.naddrs && !c[8]->rcode
+       && c[8]->ans.addrs[0] == inet_addr("10.0.30.8"),
+       "parse: a CNAME chain is followed %d links, no further", 8);
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 2, "no fake upstream");
+    MADNS_ANSWER cn, e1, e2;
+
+    sp = fake_madns("");
+    madns_request(sp, "cn.test", (void *)(intptr_t) "cn.test");
+    ret = collect(sp, done, 1, 2);
+    ok(ret == 1 && !done[0].rcode && done[0].ans.ttl == 100
+       && done[0].ans.addrs[0] == inet_addr("10.0.32.1"),
+       "a CNAME chain completes with its least TTL: %u", done[0].ans.ttl);
+    madns_lookup_all(sp, "cn.test", &cn);
+    madns_lookup_all(sp, "e1.cdn.test", &e1);
+    madns_lookup_all(sp, "e2.cdn.test", &e2);
+    ok(cn.addrs[0] == inet_addr("10.0.32.1") && cn.ttl + 1 >= 100
+       && cn.ttl <= 100 && e1.addrs[0] == cn.addrs[0] && e1.ttl + 1 >= 100
+       && e1.ttl <= 100 && e2.addrs[0] == cn.addrs[0] && e2.ttl + 1 >= 200
+       && e2.ttl <= 200, "every link is cached, TTLs %u %u %u", cn.ttl,
+       e1.ttl, e2.ttl);
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 3, "no fake upstream");
+    MADNS_ANSWER soa;
+
+    sp = fake_madns("");
+    madns_request(sp, "nx.test", (void *)(intptr_t) "nx.test");
+    madns_request(sp, "nodata.test", (void *)(intptr_t) "nodata.test");
+    ret = collect(sp, done, 2, 2);
+    c[0] = find(done, ret, "nx.test"), c[1] = find(done, ret, "nodata.test");
+    ok(c[0]->rcode == 3 && c[0]->ans.flags & MADNS_NXDOMAIN
+       && c[0]->ans.ttl == 60 && c[0]->ans.addrs[0] == INADDR_NONE
+       && !c[1]->rcode && !(c[1]->ans.flags & MADNS_NXDOMAIN)
+       && c[1]->ans.ttl == 30 && c[1]->ans.addrs[0] == INADDR_NONE,
+       "negative answers last the lesser of SOA TTL and minimum: %u %u",
+       c[0]->ans.ttl, c[1]->ans.ttl);
+    ok(madns_lookup(sp, "a.b.nx.test") == INADDR_NONE
+       && madns_lookup(sp, "nodata.test") == INADDR_NONE
+       && madns_lookup(sp, "a.nodata.test") == INADDR_ANY,
+       "NXDOMAIN, not NODATA, answers for the names under it");
+    ok(madns_lookup_rr(sp, "test", MADNS_T_SOA, &soa) == 1
+       && soa.recs[0].soa.minimum == 60 && soa.recs[0].soa.serial == 1,
+       "the SOA is cached under its zone");
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 2, "no fake upstream");
+    MADNS_ANSWER hot, cold;
+
+    sp = fake_madns("");
+    madns_set(sp, MADNS_REFRESH, 10);
+    madns_set(sp, MADNS_REFRESH_HITS, 1);
+    madns_request(sp, "hot.test", (void *)(intptr_t) "hot.test");
+    madns_request(sp, "cold.test", (void *)(intptr_t) "cold.test");
+    collect(sp, done, 2, 2);
+
+    // A whole second into the 6 sec TTL: due for refresh. cold.test's
+    //  refresh is not answered; it expires within the next 2 secs.
+    usleep(1100000);
+    madns_lookup(sp, "hot.test"), madns_lookup(sp, "cold.test");
+    collect(sp, done, 1, 2);
+    madns_lookup_all(sp, "hot.test", &hot);
+    madns_lookup_all(sp, "cold.test", &cold);
+    ok(fake_asked("hot.test", 0) == 2 && fake_asked("cold.test", 0) == 2
+       && hot.ttl > cold.ttl && cold.addrs[0] == inet_addr("10.0.34.1"),
+       "a hot entry is refreshed ahead of expiry: TTLs %u %u", hot.ttl,
+       cold.ttl);
+
+    madns_lookup(sp, "hot.test"), madns_lookup(sp, "cold.test");
+    collect(sp, done, 1, 0);   // Sends them, and waits out the second.
+    ok(fake_asked("hot.test", 0) == 3 && fake_asked("cold.test", 0) == 3,
+       "... and again, once the refresh is answered or expires");
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 2, "no fake upstream");
+    sp = fake_madns("");
+    madns_set(sp, MADNS_SERVE_STALE, 60);
+    madns_set(sp, MADNS_STALE_WAIT, 200);
+    madns_request(sp, "stale.test", (void *)(intptr_t) "stale.test");
+    collect(sp, done, 1, 2);
+    sleep(2);                   // Its 1 sec TTL is over.
+
+    madns_request(sp, "stale.test", (void *)(intptr_t) "stale.test");
+    ret = collect(sp, done, 1, 1);
+    ok(ret == 1 && done[0].rcode == -1 && done[0].ans.flags & MADNS_STALE
+       && done[0].ans.addrs[0] == inet_addr("10.0.35.1")
+       && done[0].latency >= 0.2 && done[0].latency < 1,
+       "an unanswered request for an expired name is served stale: %.3f secs",
+       done[0].latency);
+    madns_stats(sp, &st2);
+    ok(madns_lookup(sp, "stale.test") == INADDR_ANY && st2.stale == 1
+       && !collect(sp, done, 1, 2),
+       "... once; madns_lookup does not serve stale");
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 3, "no fake upstream");
+    char const *duals[] = { "dual.test", "half.test", "half6.test" };
+    struct in6_addr v6;
+    MADNS_ANSWER all;
+
+    inet_pton(AF_INET6, "2001:db8::36", &v6);
+    sp = fake_madns("");
+    for (i = 0; i < 3; ++i)
+        madns_request_af(sp, duals[i], (void *)(intptr_t) duals[i], AF_UNSPEC);
+    ret = collect(sp, done, 3, 2);
+    for (i = 0; i < 3; ++i)
+        c[i] = find(done, ret, duals[i]);
+    ok(ret == 3 && !c[0]->rcode && c[0]->ans.naddrs == 1
+       && c[0]->ans.addrs[0] == inet_addr("10.0.36.1")
+       && c[0]->ans.naddrs6 == 1 && !memcmp(&c[0]->ans.addrs6[0], &v6, 16),
+       "AF_UNSPEC: one completion with both families");
+    ok(c[1]->ans.naddrs == 1 && c[1]->ans.addrs[0] == inet_addr("10.0.36.1")
+       && !c[1]->ans.naddrs6 && !c[2]->ans.naddrs && c[2]->ans.naddrs6 == 1
+       && !memcmp(&c[2]->ans.addrs6[0], &v6, 16),
+       "AF_UNSPEC: a family that fails leaves the other's addresses");
+    memset(&v6, 0, 16);
+    ok(madns_lookup(sp, "dual.test") == inet_addr("10.0.36.1")
+       && madns_lookup6(sp, "dual.test", &v6) == 1 && v6.s6_addr[15] == 0x36
+       && madns_lookup_all(sp, "dual.test", &all) == 2,
+       "both families are cached under one entry");
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 3, "no fake upstream");
+    MADNS_ANSWER mx, srv, ptr;
+
+    sp = fake_madns("");
+    madns_request_rr(sp, "mx.test", MADNS_T_MX, (void *)(intptr_t) "mx");
+    madns_request_rr(sp, "_sip._udp.srv.test", MADNS_T_SRV,
+                     (void *)(intptr_t) "srv");
+    madns_request_rr(sp, "1.0.0.10.in-addr.arpa", MADNS_T_PTR,
+                     (void *)(intptr_t) "ptr");
+    ret = collect(sp, done, 3, 2);
+    c[0] = find(done, ret, "mx"), c[1] = find(done, ret, "srv");
+    c[2] = find(done, ret, "ptr");
+    ok(!c[0]->rcode && c[0]->ans.nrecs == 2 && !c[1]->rcode
+       && c[1]->ans.nrecs == 1 && !c[2]->rcode && c[2]->ans.nrecs == 1,
+       "MX, SRV and PTR requests complete with their records");
+    ok(madns_lookup_rr(sp, "mx.test", MADNS_T_MX, &mx) == 2
+       && mx.recs[0].type == MADNS_T_MX && mx.recs[0].mx.pref == 10
+       && !strcmp(mx.recs[0].mx.host, "mx1.mx.test") && mx.recs[1].mx.pref == 20
+       && !strcmp(mx.recs[1].mx.host, "mx2.mx.test")
+       && madns_lookup_rr(sp, "_SIP._udp.srv.test", MADNS_T_SRV, &srv) == 1
+       && srv.recs[0].srv.prio == 1 && srv.recs[0].srv.weight == 2
+       && srv.recs[0].srv.port == 5060
+       && !strcmp(srv.recs[0].srv.host, "sip.srv.test"),
+       "MX and SRV records are cached, with decoded views");
+    ok(madns_lookup_ptr(sp, inet_addr("10.0.0.1"), &ptr) == 1
+       && !strcmp(ptr.recs[0].host, "host.ptr.test")
+       && !madns_lookup_ptr(sp, inet_addr("10.0.0.2"), &ptr),
+       "madns_lookup_ptr finds the cached PTR record");
+    madns_destroy(sp);
+    skip_end;
+
+    skip_start(!fake, 2, "no fake upstream");
+    sp = fake_madns("");
+    madns_request(sp, "tc.test", (void *)(intptr_t) "tc.test");
+    madns_request(sp, "old.test", (void *)(intptr_t) "old.test");
+    ret = collect(sp, done, 2, 2);
+    c[0] = find(done, ret, "tc.test"), c[1] = find(done, ret, "old.test");
+    madns_stats(sp, &st2);
+    ok(!c[0]->rcode && c[0]->ans.addrs[0] == inet_addr("10.0.38.1")
+       && fake_asked("tc.test", 0) == 2 && seen->tcp == 1 && st2.truncated == 1,
+       "a truncated answer is asked again over TCP");
+    ok(!c[1]->rcode && c[1]->ans.addrs[0] == inet_addr("10.0.38.2")
+       && fake_asked("old.test", 0) == 2 && st2.sends == 4,
+       "FORMERR to EDNS is asked again without; every send counted: %d",
+       (int)st2.sends);
+    madns_destroy(sp);
+    skip_end;
+
+    char const *pipes[] = { "1.pipe.test", "2.pipe.test", "3.pipe.test",
+        "4.pipe.test", "5.pipe.test", "6.pipe.test"
+    };
+
+    skip_start(!fake, 2, "no fake upstream");
+    int accepts = seen->accepts, tcp = seen->tcp;
+
+    sp = fake_madns("");
+    madns_set(sp, MADNS_TCP, 1);
+    madns_set(sp, MADNS_TCP_CONNS, 1);
+    for (i = 0; i < 6; ++i)
+        madns_request(sp, pipes[i], (void *)(intptr_t) pipes[i]);
+    ret = collect(sp, done, 6, 2);
+    for (i = 0; i < 6 && find(done, ret, pipes[i])->ans.addrs[0]
+         == htonl(0x0A002700 + i + 1); ++i);
+    ok(ret == 6 && i == 6, "MADNS_TCP: every query is answered");
+    ok(seen->accepts - accepts == 1 && seen->tcp - tcp == 6,
+       "... %d queries over %d connection", seen->tcp - tcp,
+       seen->accepts - accepts);
+    madns_destroy(sp);
+    skip_end;
+
+    sp = fake ? fake_madns("") : NULL;
+    skip_start(!sp || madns_set(sp, MADNS_URING, 1) < 0, 1, "no io_uring");
+    for (i = 0; i < 6; ++i)
+        madns_request(sp, pipes[i], (void *)(intptr_t) pipes[i]);
+    ret = collect(sp, done, 6, 2);
+    for (i = 0; i < 6 && find(done, ret, pipes[i])->ans.addrs[0]
+         == htonl(0x0A002700 + i + 1); ++i);
+    madns_stats(sp, &st2);
+    ok(ret == 6 && i == 6 && st2.sends == 6 && st2.answers == 6,
+       "MADNS_URING: every query is answered");
+    skip_end;
+    if (sp)
+        madns_destroy(sp);
+
+    skip_start(!fake, 2, "no fake upstream");
+    char const *who[] = { "who.corp.test", "who.test", "who.notcorp.test" };
+
+    sp = fake_madns("server=/corp.test/" FAKE2 "\n");
+    for (i = 0; i < 3; ++i)
+        madns_request(sp, who[i], (void *)(intptr_t) who[i]);
+    ret = collect(sp, done, 3, 2);
+    for (i = 0; i < 3; ++i)
+        c[i] = find(done, ret, who[i]);
+    ok(c[0]->ans.addrs[0] == inet_addr(FAKE2) && c[0]->server == inet_addr(FAKE2),
+       "a name in a routed zone goes to its server: %s",
+       iptoa(c[0]->ans.addrs[0]));
+    ok(c[1]->ans.addrs[0] == inet_addr(FAKE) && c[1]->server == inet_addr(FAKE)
+       && c[2]->ans.addrs[0] == inet_addr(FAKE)
+       && c[2]->server == inet_addr(FAKE),
+       "other names go to the nameservers");
+    madns_destroy(sp);
+    skip_end;
+
+    if (fake)
+        kill(fake, SIGTERM), waitpid(fake, NULL, 0);
+    if (fake)
+        unlink(fakeconf);
+    free(conf);
     return exit_status();
 }
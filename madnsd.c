@@ -0,0 +1,601 @@
+// "madnsd" is a caching DNS forwarder for local clients: it answers
+//  UDP queries from the madns cache, and forwards misses through madns
+//  to the servers in resolv.conf. Client queries for the same name and
+//  type wait on one madns request.
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>             // malloc...
+#include <string.h>
+#include <time.h>
+#include <unistd.h>             // access getopt
+#include <arpa/inet.h>          // inet_pton
+#include <sys/socket.h>
+
+#include "madns.h"
+
+#define NMSGS       64          // recvmmsg/sendmmsg batch.
+#define PKT_LEN     1232        // Largest answer, for EDNS0 clients.
+#define UDP_LEN     512         // Largest answer, for others.
+#define QUEST_LEN   (255 + 4)   // Wire name, qtype, qclass.
+#define NBUCKETS    4096        // Pending requests hash.
+#define STALE_TTL   30          // RFC 8767.
+#define T_SOA       6
+#define T_OPT       41
+
+#define R_FORMERR   1
+#define R_SERVFAIL  2
+#define R_NXDOMAIN  3
+#define R_NOTIMP    4
+
+// A client query, as it was asked.
+typedef struct client {
+    struct client *next;        // Waiting on the same PENDING.
+    struct sockaddr_in from;
+    uint16_t tid, rd, edns;     // edns: the client's OPT payload size, or 0.
+    int     quest_len;
+    uint8_t quest[QUEST_LEN];
+} CLIENT;
+
+// A madns request (context), with the clients waiting on it.
+typedef struct pending {
+    struct pending *next;       // Hash chain.
+    CLIENT *clients;
+    int     qtype;
+    unsigned hash;
+    char    name[256];
+} PENDING;
+
+static PENDING *pending[NBUCKETS];
+
+static struct {
+    unsigned long queries, hits, forwarded, coalesced, dropped, answers;
+} stats;
+
+static struct {
+    int     sock, n;
+    struct mmsghdr msgs[NMSGS];
+    struct iovec iovs[NMSGS];
+    struct sockaddr_in to[NMSGS];
+    uint8_t pkts[NMSGS][PKT_LEN];
+} out;
+
+static volatile sig_atomic_t stop, hup;
+
+static void
+usage(void)
+{
+    fputs("Usage: madnsd [-c resolv.conf] [-H hosts] [-l [ip:]port] [-r reqs]"
+          " [-m file.prom] [-T] [-u] [-d]\n"
+          "\t-H: answer for the names in a hosts(5) file, from it alone\n"
+          "\t-l: listen on ip:port (default 127.0.0.1:53)\n"
+          "\t-m: write madns metrics (Prometheus text) there every 10 secs\n"
+          "\t-r: max active requests per server (default 100)\n"
+          "\t-T: send every query over TCP\n"
+          "\t-u: send and receive through io_uring\n", stderr);
+    exit(1);
+}
+
+static void
+on_signal(int sig)
+{
+    if (sig == SIGHUP)
+        hup = 1;
+    else
+        stop = 1;
+}
+
+static inline unsigned
+get16(uint8_t const *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static inline uint8_t *
+put16(uint8_t * p, unsigned v)
+{
+    p[0] = v >> 8, p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t *
+put32(uint8_t * p, uint32_t v)
+{
+    return put16(put16(p, v >> 16), v & 0xFFFF);
+}
+
+// Parse a query into (cp) and its question into "a.b.c" (name).
+// Returns the qtype, 0 to drop the packet, or -rcode to refuse it.
+static int
+parse_query(uint8_t const *pkt, int len, CLIENT * cp, char *name)
+{
+    uint8_t const *p = pkt + 12, *end = pkt + len;
+    char   *np = name;
+
+    if (len < 12 || pkt[2] & 0x80)
+        return 0;               // Runt, or a response.
+    cp->tid = get16(pkt), cp->rd = pkt[2] & 1, cp->edns = 0;
+    cp->quest_len = 0;
+    if (pkt[2] & 0x78)
+        return -R_NOTIMP;       // Not a standard query.
+    if (get16(pkt + 4) != 1)
+        return -R_FORMERR;
+
+    for (; p < end && *p; p += *p + 1) {
+        if (*p > 63 || p + *p + 1 >= end || np + *p + 1 >= name + 254)
+            return -R_FORMERR;
+        if (np > name)
+            *np++ = '.';
+        memcpy(np, p + 1, *p), np += *p;
+    }
+    *np++ = '.', *np = 0;       // Absolute: no search list.
+    if (p + 5 > end)
+        return -R_FORMERR;
+    p += 5;
+    cp->quest_len = p - (pkt + 12);
+    memcpy(cp->quest, pkt + 12, cp->quest_len);
+    if (get16(p - 2) != 1)
+        return -R_NOTIMP;       // Not class IN.
+
+    // An OPT record (RFC 6891) must be the only additional record.
+    if (get16(pkt + 10) == 1 && p + 11 <= end && !p[0]
+        && get16(p + 1) == T_OPT)
+        cp->edns = get16(p + 3) < UDP_LEN ? UDP_LEN : get16(p + 3);
+
+    return get16(p - 4) ? (int)get16(p - 4) : -R_FORMERR;
+}
+
+static uint8_t *
+put_name(uint8_t * p, char const *name)
+{
+    while (*name) {
+        int     len = strcspn(name, ".");
+
+        *p++ = len, memcpy(p, name, len), p += len, name += len;
+        name += *name == '.';
+    }
+    *p++ = 0;
+    return p;
+}
+
+// The rdata of a (non-address) record view.
+// Returns its length, or -1 if it is longer than PKT_LEN.
+static int
+put_rdata(uint8_t * p, MADNS_RECORD const *rp)
+{
+    uint8_t *start = p;
+
+    switch (rp->type) {
+    case MADNS_T_MX:
+        return put_name(put16(p, rp->mx.pref), rp->mx.host) - start;
+    case MADNS_T_SRV:
+        p = put16(put16(put16(p, rp->srv.prio), rp->srv.weight), rp->srv.port);
+        return put_name(p, rp->srv.host) - start;
+    case MADNS_T_PTR:
+    case MADNS_T_NS:
+    case MADNS_T_CNAME:
+        return put_name(p, rp->host) - start;
+    case MADNS_T_SOA:
+        p = put_name(put_name(p, rp->soa.mname), rp->soa.rname);
+        p = put32(put32(put32(p, rp->soa.serial), rp->soa.refresh),
+                  rp->soa.retry);
+        return put32(put32(p, rp->soa.expire), rp->soa.minimum) - start;
+    default:
+        if (rp->raw.len > PKT_LEN)
+            return -1;
+        memcpy(p, rp->raw.data, rp->raw.len);
+        return rp->raw.len;
+    }
+}
+
+// The number of (qtype) records in an answer.
+static unsigned
+answer_count(MADNS_ANSWER const *ap, int qtype)
+{
+    if (!ap)
+        return 0;
+    if (qtype == MADNS_T_A)
+        return ap->naddrs && ap->addrs[0] != INADDR_NONE ? ap->naddrs : 0;
+    return qtype == MADNS_T_AAAA ? ap->naddrs6 : ap->nrecs;
+}
+
+// The cached SOA of the zone that (name) has no records in: that of the
+//  nearest enclosing name with one. Returns its offset in (name), which
+//  is its offset in the question too; or -1 if there is none.
+static int
+find_soa(MADNS const *mp, char const *name, MADNS_ANSWER * soa)
+{
+    char const *zone;
+
+    for (zone = name; *zone && strcmp(zone, "."); zone += *zone == '.') {
+        if (madns_lookup_rr(mp, zone, MADNS_T_SOA, soa) > 0)
+            return zone - name;
+        zone += strcspn(zone, ".");
+    }
+    return -1;
+}
+
+// Build the answer to (cp) in (pkt). (ap) may be NULL for an error.
+//  Answer records are owned by the question name (a pointer to it),
+//  CNAME chains included: madns caches the addresses under each alias.
+//  An answer with no records carries (soa), if not NULL, owned by the
+//  question name from (zone) on, so the client can cache it (RFC 2308).
+// Returns the packet length.
+static int
+build_answer(uint8_t * pkt, CLIENT const *cp, int qtype, int rcode,
+             MADNS_ANSWER const *ap, MADNS_ANSWER const *soa, int zone)
+{
+    int     size = cp->edns ? (cp->edns < PKT_LEN ? cp->edns : PKT_LEN) : UDP_LEN;
+    uint8_t *p = pkt + 12, *end = pkt + size - (cp->edns ? 11 : 0);
+    uint8_t rdata[PKT_LEN];
+    unsigned i, n = answer_count(ap, qtype), nscount = 0;
+    unsigned ancount = 0, ttl = !ap ? 0 : ap->flags & MADNS_STALE ? STALE_TTL
+        : ap->ttl;
+
+    memcpy(p, cp->quest, cp->quest_len), p += cp->quest_len;
+    for (i = 0; i < n; ++i) {
+        uint8_t const *rd = rdata;
+        int     len;
+        unsigned type = qtype;
+
+        if (qtype == MADNS_T_A)
+            rd = (uint8_t const *)&ap->addrs[i], len = 4;
+        else if (qtype == MADNS_T_AAAA)
+            rd = ap->addrs6[i].s6_addr, len = 16;
+        else
+            len = put_rdata(rdata, &ap->recs[i]), type = ap->recs[i].type;
+
+        // There is no TCP listener to ask again on, so an RRset too big
+        //  for the client is cut to fit, without TC.
+        if (len < 0 || p + 12 + len > end)
+            break;
+        p = put16(put16(put16(p, 0xC00C), type), 1);
+        p = put16(put32(p, ttl), len);
+        memcpy(p, rd, len), p += len, ++ancount;
+    }
+
+    if (!ancount && soa && cp->quest_len) {
+        int     len = put_rdata(rdata, &soa->recs[0]);
+
+        if (p + 12 + len <= end) {
+            p = put16(put16(put16(p, 0xC000 | (12 + zone)), T_SOA), 1);
+            p = put16(put32(p, ttl), len);
+            memcpy(p, rdata, len), p += len, ++nscount;
+        }
+    }
+
+    if (cp->edns) {             // OPT: root, type, payload size, ttl, rdlen.
+        *p++ = 0;
+        p = put16(put16(p, T_OPT), PKT_LEN);
+        p = put16(put32(p, 0), 0);
+    }
+
+    put16(pkt, cp->tid);
+    pkt[2] = 0x80 | cp->rd;     // QR RD
+    pkt[3] = 0x80 | rcode;      // RA
+    put16(put16(put16(put16(pkt + 4, !!cp->quest_len), ancount), nscount),
+          !!cp->edns);
+    return p - pkt;
+}
+
+static void
+flush_answers(void)
+{
+    int     i, n;
+
+    for (i = 0; i < out.n; i += n)
+        if ((n = sendmmsg(out.sock, out.msgs + i, out.n - i, 0)) <= 0) {
+            if (errno != EINTR)
+                perror("madnsd: sendmmsg");
+            n = 1;              // Lose one, rather than spin.
+        }
+    out.n = 0;
+}
+
+// Send the answer for (name) to (cp). A negative answer (NXDOMAIN, or
+//  no records) gets the SOA of its zone, if madns has it.
+static void
+send_answer(MADNS const *mp, CLIENT const *cp, char const *name, int qtype,
+            int rcode, MADNS_ANSWER const *ap)
+{
+    MADNS_ANSWER soa;
+    int     i = out.n++, zone = -1;
+
+    if (ap && (rcode == R_NXDOMAIN || (!rcode && !answer_count(ap, qtype))))
+        zone = find_soa(mp, name, &soa);
+    out.to[i] = cp->from;
+    out.iovs[i].iov_len = build_answer(out.pkts[i], cp, qtype, rcode, ap,
+                                       zone < 0 ? NULL : &soa, zone);
+    ++stats.answers;
+    if (out.n == NMSGS)
+        flush_answers();
+}
+
+static unsigned
+hash_of(char const *name, int qtype)
+{
+    unsigned h = 2166136261U ^ qtype;
+
+    for (; *name; ++name)
+        h = (h ^ (*name | 0x20)) * 16777619U;
+    return h;
+}
+
+// The pending request for (name, qtype), if any. Names compare without case.
+static PENDING **
+find_pending(char const *name, int qtype, unsigned hash)
+{
+    PENDING **pp = &pending[hash % NBUCKETS];
+
+    for (; *pp; pp = &(*pp)->next)
+        if ((*pp)->hash == hash && (*pp)->qtype == qtype
+            && !strcasecmp((*pp)->name, name))
+            break;
+    return pp;
+}
+
+// Answer from the cache, join a pending request, or start one.
+static void
+handle_query(MADNS * mp, CLIENT * cp, uint8_t const *pkt, int len)
+{
+    char    name[256];
+    int     qtype = parse_query(pkt, len, cp, name);
+    MADNS_ANSWER ans;
+
+    ++stats.queries;
+    if (qtype <= 0) {
+        if (qtype < 0)
+            send_answer(mp, cp, name, 0, -qtype, NULL);
+        return;
+    }
+
+    int     hit;
+
+    if (qtype == MADNS_T_A || qtype == MADNS_T_AAAA)
+        hit = madns_lookup_all(mp, name, &ans)
+            && (qtype == MADNS_T_AAAA ? ans.naddrs6 : ans.naddrs);
+    else
+        hit = madns_lookup_rr(mp, name, qtype, &ans) != 0;
+    if (hit) {
+        ++stats.hits;
+        send_answer(mp, cp, name, qtype,
+                    ans.flags & MADNS_NXDOMAIN ? R_NXDOMAIN : 0, &ans);
+        return;
+    }
+
+    unsigned hash = hash_of(name, qtype);
+    PENDING **pp = find_pending(name, qtype, hash), *rp = *pp;
+    CLIENT *ncp;
+
+    if (!rp && madns_ready(mp) <= 0) {
+        ++stats.dropped;        // The client will ask again.
+        return;
+    }
+    if (!(ncp = malloc(sizeof *ncp))) {
+        ++stats.dropped;
+        return;
+    }
+    *ncp = *cp;
+
+    if (rp) {
+        ++stats.coalesced;
+        ncp->next = rp->clients, rp->clients = ncp;
+        return;
+    }
+
+    if (!(rp = malloc(sizeof *rp))) {
+        ++stats.dropped;
+        free(ncp);
+        return;
+    }
+    *rp = (PENDING) {.clients = ncp,.qtype = qtype,.hash = hash};
+    strcpy(rp->name, name);
+    ncp->next = NULL;
+    if (!madns_request_rr(mp, name, qtype, rp)) {
+        send_answer(mp, cp, name, qtype, R_FORMERR, NULL);  // Invalid name.
+        free(ncp), free(rp);
+        return;
+    }
+    ++stats.forwarded;
+    *pp = rp;
+}
+
+// Answer every client waiting on a completed request.
+static void
+complete(MADNS const *mp, MADNS_COMPLETION const *dp)
+{
+    PENDING *rp = dp->ctx;
+    CLIENT *cp, *next;
+    int     rcode = dp->rcode < 0 ? R_SERVFAIL : dp->rcode;
+
+    if (dp->ans.flags & MADNS_STALE)
+        rcode = 0;
+    *find_pending(rp->name, rp->qtype, rp->hash) = rp->next;
+    for (cp = rp->clients; cp; cp = next) {
+        next = cp->next;
+        send_answer(mp, cp, rp->name, rp->qtype, rcode,
+                    rcode && rcode != R_NXDOMAIN ? NULL : &dp->ans);
+        free(cp);
+    }
+    free(rp);
+}
+
+// Pin the names in a hosts file. Returns the number loaded, or -1.
+static int
+preload(MADNS * mp, char const *hosts)
+{
+    MADNS_PRELOAD st;
+    int     ret = madns_preload(mp, hosts, 0, &st);
+
+    if (ret >= 0)
+        fprintf(stderr, "madnsd: %s: %d names, %d addrs, %zu bytes,"
+                " %.3f secs\n", hosts, st.names, st.addrs, st.bytes, st.secs);
+    return ret;
+}
+
+// Replace (path) whole, as the node_exporter textfile collector expects.
+static void
+write_metrics(MADNS const *mp, char const *path)
+{
+    char    tmp[4096];
+    FILE   *fp;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    if (!(fp = fopen(tmp, "w"))) {
+        perror(tmp);
+        return;
+    }
+    madns_prometheus(mp, fp);
+    if (fclose(fp) || rename(tmp, path))
+        perror(path);
+}
+
+int
+main(int argc, char **argv)
+{
+    char const *resolv_conf = "/etc/resolv.conf", *hosts = NULL;
+    char const *metrics = NULL;
+    char    listen_ip[64] = "127.0.0.1";
+    int     opt, port = 53, reqs = 100, tcp = 0, uring = 0;
+
+    while ((opt = getopt(argc, argv, "c:dH:l:m:r:Tu")) != -1) {
+        switch (opt) {
+        case 'c':
+            resolv_conf = optarg;
+            break;
+        case 'd':
+            madns_log = stderr;
+            break;
+        case 'H':
+            hosts = optarg;
+            break;
+        case 'l':
+            if (strchr(optarg, ':'))
+                sscanf(optarg, "%63[^:]:%d", listen_ip, &port);
+            else
+                port = atoi(optarg);
+            break;
+        case 'm':
+            metrics = optarg;
+            break;
+        case 'r':
+            reqs = atoi(optarg);
+            break;
+        case 'T':
+            tcp = 1;
+            break;
+        case 'u':
+            uring = 1;
+            break;
+        default:
+            usage();            // '?' etc.
+        }
+    }
+    if (optind < argc || port <= 0 || port > 65535)
+        usage();
+    if (access(resolv_conf, R_OK))
+        return fprintf(stderr,
+                       "madnsd: %s not a valid (resolv.conf) file\n",
+                       resolv_conf);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,.sin_port = htons(port) };
+    int     sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    int     bufsize = 1 << 20;
+
+    if (inet_pton(AF_INET, listen_ip, &addr.sin_addr) != 1)
+        usage();
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof addr))
+        return fprintf(stderr, "madnsd: %s:%d: %s\n", listen_ip, port,
+                       strerror(errno));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+
+    MADNS  *mp = madns_create(resolv_conf, /*expiry */ 5, reqs);
+    if (!mp)
+        return fputs("madnsd: madns_create failed\n", stderr);
+    madns_set(mp, MADNS_TCP, tcp);
+    if (uring && madns_set(mp, MADNS_URING, 1) < 0)
+        fputs("madnsd: io_uring unavailable; using sendto/recvfrom\n", stderr);
+
+    if (hosts && preload(mp, hosts) < 0)
+        return fprintf(stderr, "madnsd: unable to load %s\n", hosts);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGHUP, on_signal);  // Re-read resolv.conf.
+
+    static uint8_t pkts[NMSGS][PKT_LEN];
+    static struct mmsghdr msgs[NMSGS];
+    static struct iovec iovs[NMSGS];
+    static CLIENT clients[NMSGS];
+    MADNS_COMPLETION done[16];
+    struct pollfd fds[1 + 64];
+    int     i, k, n;
+    time_t  t = time(0), written = t;
+
+    out.sock = sock;
+    for (i = 0; i < NMSGS; ++i) {
+        iovs[i] = (struct iovec) {pkts[i], PKT_LEN};
+        msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = &clients[i].from,.msg_namelen = sizeof addr,
+                .msg_iov = &iovs[i],.msg_iovlen = 1};
+        out.iovs[i].iov_base = out.pkts[i];
+        out.msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = &out.to[i],.msg_namelen = sizeof addr,
+                .msg_iov = &out.iovs[i],.msg_iovlen = 1};
+    }
+
+    while (!stop) {
+        if (hup) {
+            hup = 0;
+            if (madns_reload(mp, NULL) < 0)
+                fputs("madnsd: reload failed; keeping the old servers\n",
+                      stderr);
+            if (hosts && preload(mp, hosts) < 0)
+                fprintf(stderr, "madnsd: unable to reload %s\n", hosts);
+        }
+
+        int     nfds = 1 + madns_pollfds(mp, fds + 1, 64);
+
+        fds[0] = (struct pollfd) {sock, POLLIN, 0};
+        if (poll(fds, nfds, 1000 * madns_expires(mp)) < 0 && errno != EINTR) {
+            perror("madnsd: poll");
+            break;
+        }
+
+        while ((n = madns_responses(mp, done, 16)) > 0)
+            for (i = 0; i < n; ++i)
+                complete(mp, &done[i]);
+
+        // A few batches at most, so a flood cannot starve madns.
+        for (k = 0; k < 16 && (n = recvmmsg(sock, msgs, NMSGS, 0, NULL)) > 0;
+             ++k) {
+            for (i = 0; i < n; ++i) {
+                handle_query(mp, &clients[i], pkts[i], msgs[i].msg_len);
+                msgs[i].msg_hdr.msg_namelen = sizeof addr;
+            }
+            if (n < NMSGS)
+                break;
+        }
+        flush_answers();
+
+        if (metrics && time(0) - written >= 10)
+            write_metrics(mp, metrics), written = time(0);
+    }
+
+    t = time(0) - t;
+    fprintf(stderr, "MADNSD: queries: %lu hits: %lu forwarded: %lu"
+            " coalesced: %lu dropped: %lu answers: %lu secs: %lu => %.0f q/s\n",
+            stats.queries, stats.hits, stats.forwarded, stats.coalesced,
+            stats.dropped, stats.answers, t,
+            (double)stats.queries / (t ? t : 1));
+    if (metrics)
+        write_metrics(mp, metrics);
+    if (madns_log)
+        madns_dump(mp, madns_log, -1);
+    madns_destroy(mp);
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,195 @@
+// Loopback test of madnsd and dnsload: a fake upstream server on
+//  127.53.0.1:53 (skipped if it cannot bind), madnsd in front of it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>             // dirname
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "tap.h"
+
+#define UPSTREAM    "127.53.0.1"
+
+static uint8_t *
+put16(uint8_t * p, unsigned v)
+{
+    *p++ = v >> 8, *p++ = v;
+    return p;
+}
+
+static uint8_t *
+put32(uint8_t * p, unsigned v)
+{
+    return put16(put16(p, v >> 16), v);
+}
+
+// Encode a query for (name), without EDNS: answers must fit 512 bytes.
+static int
+encode_query(uint8_t * pkt, char const *name, int qtype, int opcode)
+{
+    uint8_t *p = pkt + 12;
+
+    memset(pkt, 0, 12);
+    pkt[0] = 0x12, pkt[1] = 0x34, pkt[2] = opcode << 3 | 1, pkt[5] = 1;
+    while (*name) {
+        int     len = strcspn(name, ".");
+
+        *p++ = len, memcpy(p, name, len), p += len, name += len;
+        name += *name == '.';
+    }
+    *p++ = 0;
+    p = put16(put16(p, qtype), 1);
+    return p - pkt;
+}
+
+// The fake upstream: nx.test does not exist, nodata.test has only A
+//  records, big.test has 60 of them. The zone "test" has an SOA.
+//  Anything else is REFUSED.
+static void
+upstream(int sock)
+{
+    uint8_t pkt[4096];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof from;
+    int     len;
+
+    while ((len = recvfrom(sock, pkt, sizeof pkt, 0, (struct sockaddr *)&from,
+                           &fromlen)) > 12) {
+        uint8_t *p = pkt + 12, *end = pkt + len;
+        char    name[256];
+        int     n = 0, i, qtype, nx, ancount = 0, nscount = 0;
+
+        for (*name = 0; p < end && *p && p + *p < end; p += *p + 1)
+            n += sprintf(name + n, "%.*s.", *p, p + 1);
+        if (p + 5 > end)
+            continue;
+        qtype = p[1] << 8 | p[2], p += 5;
+        nx = !strcmp(name, "nx.test.");
+        if (nx || !strcmp(name, "nodata.test.") || !strcmp(name, "big.test.")) {
+            int     nrrs = !strcmp(name, "big.test.") ? 60 : 1;
+
+            for (i = 0; qtype == 1 && !nx && i < nrrs; ++i, ++ancount) {
+                p = put16(put16(put16(p, 0xC00C), 1), 1);
+                p = put32(put16(put32(p, 300), 4), 0x0A000001 + i);
+            }
+            if (!ancount) {     // Owner "test": after the first label.
+                p = put16(put16(put16(p, 0xC00C + pkt[12] + 1), 6), 1);
+                p = put16(put32(p, 3600), 2 + 2 + 20);
+                p = put16(p, 0xC00C + pkt[12] + 1);     // MNAME: test.
+                p = put16(p, 0xC00C + pkt[12] + 1);     // RNAME: test.
+                p = put32(put32(put32(put32(put32(p, 1), 2), 3), 4), 60);
+                nscount = 1;
+            }
+        }
+        pkt[2] = 0x80 | (pkt[2] & 1), pkt[3] = 0x80 | (nx ? 3 : ancount
+                                                       || nscount ? 0 : 5);
+        put16(put16(put16(pkt + 6, ancount), nscount), 0);
+        sendto(sock, pkt, p - pkt, 0, (struct sockaddr *)&from, fromlen);
+        fromlen = sizeof from;
+    }
+    _exit(0);
+}
+
+// Ask madnsd; returns the answer length, or 0 after a 2 sec wait.
+static int
+ask(int sock, char const *name, int qtype, int opcode, uint8_t * ans)
+{
+    uint8_t pkt[512];
+    int     len = encode_query(pkt, name, qtype, opcode);
+    struct pollfd pfd = { sock, POLLIN, 0 };
+
+    send(sock, pkt, len, 0);
+    return poll(&pfd, 1, 2000) == 1 ? recv(sock, ans, 4096, 0) : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    plan_tests(7);
+    (void)argc;
+
+    char   *dir = dirname(strdup(argv[0])), conf[] = "/tmp/madnsd_t.XXXXXX";
+    char    hosts[] = "/tmp/madnsd_t.XXXXXX", names[] = "/tmp/madnsd_t.XXXXXX";
+    char    cmd[4096], listen[32], line[256];
+    int     port = 20000 + getpid() % 20000, sock, up, len, ret;
+    struct sockaddr_in addr = {.sin_family = AF_INET,.sin_port = htons(53) };
+    pid_t   upid = 0, dpid;
+    uint8_t ans[4096];
+    FILE   *fp;
+
+    // The upstream is bound before madnsd starts, so no query is lost.
+    inet_pton(AF_INET, UPSTREAM, &addr.sin_addr);
+    up = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!bind(up, (struct sockaddr *)&addr, sizeof addr) && !(upid = fork()))
+        upstream(up);
+    close(up);
+
+    fp = fdopen(mkstemp(conf), "w");
+    fputs("nameserver " UPSTREAM "\n", fp);
+    fclose(fp);
+    fp = fdopen(mkstemp(hosts), "w");
+    fputs("10.9.8.7 pinned.test\n", fp);
+    fclose(fp);
+    fp = fdopen(mkstemp(names), "w");
+    fputs("pinned.test\n", fp);
+    fclose(fp);
+
+    snprintf(cmd, sizeof cmd, "%s/madnsd", dir);
+    snprintf(listen, sizeof listen, "127.0.0.1:%d", port);
+    if (!(dpid = fork())) {
+        execl(cmd, cmd, "-c", conf, "-H", hosts, "-l", listen, (char *)NULL);
+        _exit(127);
+    }
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(sock, (struct sockaddr *)&addr, sizeof addr);
+    for (ret = 0; ret < 20; ++ret, usleep(100000))    // madnsd is starting.
+        if ((len = ask(sock, "pinned.test", 1, 0, ans)) > 0)
+            break;
+    ok(len == 12 + 17 + 16 && ans[3] == 0x80 && ans[7] == 1
+       && !memcmp(ans + len - 4, "\x0A\x09\x08\x07", 4),
+       "madnsd answers a pinned name: %d bytes", len);
+
+    len = ask(sock, "pinned.test", 1, 2, ans);
+    ok(len >= 12 && (ans[3] & 15) == 4, "a STATUS query gets NOTIMP");
+
+    skip_start(!upid, 3, "cannot bind " UPSTREAM ":53");
+    len = ask(sock, "nx.test", 1, 0, ans);
+    ok(len > 12 + 13 + 12 && (ans[3] & 15) == 3 && !ans[7] && ans[9] == 1
+       && ans[12 + 13] == 0xC0 && ans[12 + 13 + 1] == 12 + 3
+       && ans[12 + 13 + 3] == 6,
+       "NXDOMAIN carries the SOA of its zone: %d bytes", len);
+
+    len = ask(sock, "nodata.test", 28, 0, ans);
+    ok(len > 12 + 17 + 12 && (ans[3] & 15) == 0 && !ans[7] && ans[9] == 1
+       && ans[12 + 17 + 3] == 6, "a name with no AAAA records gets the SOA");
+
+    len = ask(sock, "big.test", 1, 0, ans);
+    ok(len > 12 && len <= 512 && !(ans[2] & 2) && ans[7] > 0,
+       "a big answer is trimmed to %d bytes, %d records, without TC",
+       len, ans[7]);
+    skip_end;
+
+    snprintf(cmd, sizeof cmd, "%s/dnsload -s %s -n 1000 -w 64 %s", dir,
+             listen, names);
+    fp = popen(cmd, "r");
+    for (ret = 0; fp && fgets(line, sizeof line, fp);)
+        ret |= !!strstr(line, " answered: 1000 lost: 0 ");
+    ok(fp && !pclose(fp) && ret, "dnsload: all 1000 queries answered");
+
+    kill(dpid, SIGTERM);
+    waitpid(dpid, &ret, 0);
+    ok(WIFEXITED(ret) && !WEXITSTATUS(ret), "madnsd exits on SIGTERM");
+
+    if (upid)
+        kill(upid, SIGTERM), waitpid(upid, NULL, 0);
+    unlink(conf), unlink(hosts), unlink(names);
+    close(sock);
+    return exit_status();
+}
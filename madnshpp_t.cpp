@@ -0,0 +1,81 @@
+// Offline test of madns.hpp: co_await a pinned name, an invalid name, and
+//  more requests than query slots. The nameserver never answers.
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "madns.hpp"
+
+// TAP output, as tap.h would print it; tap.h does not compile as C++.
+static int ntests, nfailed;
+
+static void
+ok(bool pass, char const *name)
+{
+    printf("%sok %d - %s\n", pass ? "" : "not ", ++ntests, name);
+    nfailed += !pass;
+}
+
+#define SILENT  "127.53.0.9"    // Nothing listens there.
+
+struct Task {
+    struct promise_type {
+        Task    get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void    return_void() {}
+        void    unhandled_exception() { std::abort(); }
+    };
+};
+
+static int ndone;
+
+static Task
+ask(mad::Resolver &r, char const *name, MADNS_COMPLETION *out)
+{
+    *out = co_await r.resolve(name);
+    ++ndone;
+}
+
+int
+main()
+{
+    printf("1..5\n");
+
+    char    conf[] = "/tmp/madnshpp_t.XXXXXX", hosts[] = "/tmp/madnshpp_t.XXXXXX";
+    FILE   *fp = fdopen(mkstemp(conf), "w");
+
+    fputs("nameserver " SILENT "\noptions attempts:1\n", fp);
+    fclose(fp);
+    fp = fdopen(mkstemp(hosts), "w");
+    fputs("10.9.8.7 pinned.test\n", fp);
+    fclose(fp);
+
+    mad::Resolver r(conf, 1, 2);
+    MADNS_COMPLETION c[4];
+
+    madns_preload(r.get(), hosts, 0, NULL);
+    ask(r, "pinned.test", &c[0]);
+    ok(ndone == 1 && !c[0].rcode && c[0].ans.flags & MADNS_CACHED
+       && c[0].ans.addrs[0] == inet_addr("10.9.8.7"),
+       "a cached name completes without suspending");
+
+    ask(r, "bad name", &c[0]);
+    ok(ndone == 2 && c[0].ans.naddrs == 1 && c[0].ans.addrs[0] == INADDR_NONE,
+       "an invalid name completes at once with INADDR_NONE");
+
+    // Two query slots: the third request waits for one.
+    ask(r, "a.test", &c[1]), ask(r, "b.test", &c[2]), ask(r, "c.test", &c[3]);
+    ok(ndone == 2 && !madns_ready(r.get()), "three requests wait, two sent");
+
+    for (int i = 0; i < 10 && ndone < 5; ++i)
+        r.run_once(1000);
+    ok(ndone == 5 && c[1].rcode == -1 && c[2].rcode == -1
+       && c[3].rcode == -1 && !c[3].ans.naddrs,
+       "the waiting request is sent, and expires like the others");
+    ok(madns_ready(r.get()) == 2 && !r.run_once(0), "every slot is free");
+
+    unlink(conf), unlink(hosts);
+    return nfailed;
+}